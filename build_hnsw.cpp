@@ -0,0 +1,674 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <queue>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::pair;
+using std::priority_queue;
+using std::sort;
+using std::min;
+using std::max;
+using std::thread;
+
+#ifdef _MSC_VER
+#define O_BINARY_FLAG _O_BINARY
+#else
+#define O_BINARY_FLAG 0
+#endif
+
+constexpr unsigned TOP_K = 32;  // top_k of learning_to_rank.py, recall is measured at it
+
+// Embeddings exported by export_embeddings.py: two unsigned (n, dim), then n rows of dim floats of unit length,
+// so that the dot product of two rows is their cosine similarity
+struct Embeddings {
+    unsigned n = 0, dim = 0;
+    const float *data = nullptr;
+
+    const float *row(unsigned i) const {
+        return data + (size_t) i * dim;
+    }
+};
+
+// The graph file, mapped to memory by main as it is. After the header, each section begins on a cache line:
+// levels (n bytes), level 0 links (n blocks of 1 + 2m unsigned: count, then neighbors), upper offsets
+// (n + 1 unsigned long long: first upper block of each node), and upper links (a block of 1 + m unsigned for
+// each level of each node from level 1 up).
+struct GraphHeader {
+    char magic[8];
+    unsigned n, dim, m, max_level, entry_point, reserved;
+    unsigned long long levels_begin, level0_begin, upper_offsets_begin, upper_begin, size;
+};
+
+constexpr char GRAPH_MAGIC[8] = "HNSW v1";
+
+struct Options {
+    const char *embeddings_path = "corpus_embeddings.f32";
+    const char *graph_path = "hnsw.graph";
+    const char *queries_path = nullptr;  // corpus embeddings are sampled as queries without it
+    unsigned m = 16;
+    unsigned ef_construction = 200;
+    vector<unsigned> ef_searches = {32, 64, 128, 256};
+    unsigned n_queries = 1000;
+    int n_threads = (int) std::thread::hardware_concurrency();
+    bool build = true;
+};
+
+void print_usage(char *program_name) {
+    printf("Usage: %s [-h] [-e embeddings_file] [-o graph_file] [-m max_links]\n"
+           "\t[-c ef_construction] [-s ef_search_list] [-q query_embeddings_file] [-r n_queries]\n"
+           "\t[-j n_threads] [-b build]\n"
+           "Options:\n"
+           "\t-e\tcorpus embeddings file from export_embeddings.py, default: corpus_embeddings.f32\n"
+           "\t-o\tgraph file, default: hnsw.graph\n"
+           "\t-m\tmax links of a node above level 0 (twice as many at level 0), default: 16\n"
+           "\t-c\tcandidates searched when a node is inserted, default: 200\n"
+           "\t-s\tcomma-separated ef_search values to measure recall@%u with, default: 32,64,128,256\n"
+           "\t-q\tquery embeddings file from export_embeddings.py, default: none (sample corpus embeddings)\n"
+           "\t-r\tnumber of queries to measure recall with (0 to skip), default: 1000\n"
+           "\t-j\tnumber of threads, default: number of logical cores (%u on this machine)\n"
+           "\t-b\tbuild the graph, or only measure the recall of an existing one (true|false), default: true\n"
+           "\t-h\thelp\n", program_name, TOP_K, std::thread::hardware_concurrency());
+}
+
+Options parse_args(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i += 2) {
+        char *option = argv[i];
+        if (strcmp(option, "-h") == 0) {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        if (i + 1 < argc) {
+            char *value = argv[i + 1];
+            if (strcmp(option, "-e") == 0) options.embeddings_path = value;
+            else if (strcmp(option, "-o") == 0) options.graph_path = value;
+            else if (strcmp(option, "-q") == 0) options.queries_path = value;
+            else if (strcmp(option, "-m") == 0) {
+                options.m = (unsigned) atoi(value);
+                if (options.m < 2) {
+                    cerr << "Invalid value for option -m: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-c") == 0) {
+                options.ef_construction = (unsigned) atoi(value);
+                if (options.ef_construction <= 0) {
+                    cerr << "Invalid value for option -c: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-s") == 0) {
+                options.ef_searches.clear();
+                for (char *p = value; *p != '\0';) {
+                    int ef = atoi(p);
+                    if (ef <= 0) {
+                        cerr << "Invalid value for option -s: " << value << endl;
+                        print_usage(argv[0]);
+                        exit(EXIT_FAILURE);
+                    }
+                    options.ef_searches.push_back((unsigned) ef);
+                    p = strchr(p, ',');
+                    p = p == nullptr ? value + strlen(value) : p + 1;
+                }
+            } else if (strcmp(option, "-r") == 0) {
+                options.n_queries = (unsigned) atoi(value);
+            } else if (strcmp(option, "-j") == 0) {
+                options.n_threads = atoi(value);
+                if (options.n_threads <= 0) {
+                    cerr << "Invalid value for option -j: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-b") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.build = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.build = false;
+                } else {
+                    cerr << "Invalid value for option -b: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                cerr << "Unknown option: " << option << endl;
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            cerr << "Missing value for option: " << argv[i] << endl;
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return options;
+}
+
+// Map a whole file to memory read-only, or read it into memory where mmap is not available
+const char *map_file(const char *path, size_t &size) {
+    int fd = open(path, O_RDONLY | O_BINARY_FLAG);
+    if (fd < 0) {
+        perror((string("Failed to open file ") + path).c_str());
+        exit(EXIT_FAILURE);
+    }
+#ifdef _MSC_VER
+    size = (size_t) _filelengthi64(fd);
+    auto data = (char *) malloc(max(size, (size_t) 1));
+    for (size_t pos = 0; pos < size;) {
+        int n = _read(fd, data + pos, (unsigned) min(size - pos, (size_t) 1 << 30));
+        if (n <= 0) {
+            perror((string("Failed to read file ") + path).c_str());
+            exit(EXIT_FAILURE);
+        }
+        pos += n;
+    }
+#else
+    struct stat st{};
+    fstat(fd, &st);
+    size = (size_t) st.st_size;
+    void *data = mmap(nullptr, max(size, (size_t) 1), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror((string("Failed to map file ") + path).c_str());
+        exit(EXIT_FAILURE);
+    }
+#endif
+    close(fd);
+    return (const char *) data;
+}
+
+Embeddings load_embeddings(const char *path) {
+    size_t size;
+    const char *data = map_file(path, size);
+    Embeddings embeddings;
+    if (size >= 2 * sizeof(unsigned)) {
+        memcpy(&embeddings.n, data, sizeof(unsigned));
+        memcpy(&embeddings.dim, data + sizeof(unsigned), sizeof(unsigned));
+    }
+    if (size < 2 * sizeof(unsigned) || size != 2 * sizeof(unsigned) + (size_t) embeddings.n * embeddings.dim * sizeof(float)) {
+        cerr << "Invalid embeddings file " << path << ", export it with export_embeddings.py" << endl;
+        exit(EXIT_FAILURE);
+    }
+    embeddings.data = (const float *) (data + 2 * sizeof(unsigned));
+    return embeddings;
+}
+
+float dot(const float *a, const float *b, unsigned dim) {
+    unsigned i = 0;
+    float sum = 0;
+#ifdef __AVX2__
+    __m256 sum_v = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        sum_v = _mm256_add_ps(sum_v, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    __m128 sum_4 = _mm_add_ps(_mm256_castps256_ps128(sum_v), _mm256_extractf128_ps(sum_v, 1));
+    sum_4 = _mm_hadd_ps(sum_4, sum_4);
+    sum_4 = _mm_hadd_ps(sum_4, sum_4);
+    sum = _mm_cvtss_f32(sum_4);
+#endif
+    for (; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+using Candidate = pair<float, unsigned>;  // distance (negative similarity) and node
+
+// Nodes visited by a search on this thread, a node is visited if its tag is the current epoch
+struct Visited {
+    vector<unsigned> tags;
+    unsigned epoch = 0;
+
+    void reset(unsigned n) {
+        if (tags.size() != n) {
+            tags.assign(n, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0) {
+            std::fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+    }
+
+    bool visit(unsigned node) {
+        if (tags[node] == epoch) {
+            return false;
+        }
+        tags[node] = epoch;
+        return true;
+    }
+};
+
+thread_local Visited visited;
+
+// Best-first search of one level from entry, keeping the ef nearest nodes, returned from the nearest.
+// links(node, level, out) copies the neighbors of a node.
+template<typename Links>
+vector<Candidate> search_level(const Embeddings &embeddings, const float *query, Candidate entry, unsigned ef,
+                               unsigned level, Links &&links) {
+    visited.reset(embeddings.n);
+    visited.visit(entry.second);
+    priority_queue<Candidate, vector<Candidate>, std::greater<>> candidates;  // nearest on top
+    priority_queue<Candidate> nearest;  // farthest on top
+    candidates.push(entry);
+    nearest.push(entry);
+    vector<unsigned> neighbors;
+    while (!candidates.empty()) {
+        Candidate candidate = candidates.top();
+        if (candidate.first > nearest.top().first) {
+            break;  // all the remaining candidates are farther than the ef nearest nodes
+        }
+        candidates.pop();
+        links(candidate.second, level, neighbors);
+        for (unsigned neighbor: neighbors) {
+            if (!visited.visit(neighbor)) {
+                continue;
+            }
+            float distance = -dot(query, embeddings.row(neighbor), embeddings.dim);
+            if (nearest.size() < ef || distance < nearest.top().first) {
+                candidates.emplace(distance, neighbor);
+                nearest.emplace(distance, neighbor);
+                if (nearest.size() > ef) {
+                    nearest.pop();
+                }
+            }
+        }
+    }
+    vector<Candidate> result(nearest.size());
+    for (size_t i = result.size(); i-- > 0; nearest.pop()) {
+        result[i] = nearest.top();
+    }
+    return result;
+}
+
+// The graph while it is built, in the layout of the graph file
+struct Graph {
+    unsigned n = 0, m = 0, max_level = 0, entry_point = 0;
+    vector<unsigned char> levels;
+    vector<unsigned> level0;
+    vector<unsigned long long> upper_offsets;
+    vector<unsigned> upper;
+
+    unsigned max_links(unsigned level) const {
+        return level == 0 ? 2 * m : m;
+    }
+
+    unsigned *links(unsigned node, unsigned level) {
+        if (level == 0) {
+            return level0.data() + (size_t) node * (1 + 2 * m);
+        }
+        return upper.data() + (upper_offsets[node] + level - 1) * (1 + m);
+    }
+};
+
+// Inserts nodes into the graph on many threads at once, each node has its own lock for its links
+class Builder {
+private:
+    Graph &graph;
+    const Embeddings &embeddings;
+    unsigned ef_construction;
+    vector<std::mutex> locks;
+    std::mutex entry_mutex;  // for the entry point and the max level
+
+    float distance(unsigned a, unsigned b) const {
+        return -dot(embeddings.row(a), embeddings.row(b), embeddings.dim);
+    }
+
+    void copy_links(unsigned node, unsigned level, vector<unsigned> &out) {
+        std::lock_guard<std::mutex> lock(locks[node]);
+        const unsigned *links = graph.links(node, level);
+        out.assign(links + 1, links + 1 + links[0]);
+    }
+
+    // Keep a candidate only if it is nearer to the node than to every neighbor kept so far, so that the links
+    // of a node point in different directions (the heuristic of the HNSW paper)
+    vector<unsigned> select_neighbors(const vector<Candidate> &sorted_candidates, unsigned max_links) const {
+        vector<unsigned> selected;
+        for (const auto &[candidate_distance, candidate]: sorted_candidates) {
+            if (selected.size() >= max_links) {
+                break;
+            }
+            bool keep = true;
+            for (unsigned neighbor: selected) {
+                if (distance(candidate, neighbor) < candidate_distance) {
+                    keep = false;
+                    break;
+                }
+            }
+            if (keep) {
+                selected.push_back(candidate);
+            }
+        }
+        return selected;
+    }
+
+public:
+    Builder(Graph &graph, const Embeddings &embeddings, unsigned ef_construction) :
+            graph(graph), embeddings(embeddings), ef_construction(ef_construction), locks(graph.n) {}
+
+    void insert(unsigned node) {
+        const float *query = embeddings.row(node);
+        unsigned level = graph.levels[node];
+        unsigned entry_point, max_level;
+        {
+            std::lock_guard<std::mutex> lock(entry_mutex);
+            entry_point = graph.entry_point;
+            max_level = graph.max_level;
+        }
+        auto links = [this](unsigned n, unsigned l, vector<unsigned> &out) { copy_links(n, l, out); };
+        Candidate entry{distance(node, entry_point), entry_point};
+        for (unsigned l = max_level; l > level; l--) {
+            entry = search_level(embeddings, query, entry, 1, l, links)[0];
+        }
+        for (int l = (int) min(level, max_level); l >= 0; l--) {
+            auto candidates = search_level(embeddings, query, entry, ef_construction, l, links);
+            auto neighbors = select_neighbors(candidates, graph.m);
+            {
+                std::lock_guard<std::mutex> lock(locks[node]);
+                unsigned *node_links = graph.links(node, l);
+                node_links[0] = (unsigned) neighbors.size();
+                std::copy(neighbors.begin(), neighbors.end(), node_links + 1);
+            }
+            for (unsigned neighbor: neighbors) {
+                std::lock_guard<std::mutex> lock(locks[neighbor]);
+                unsigned *neighbor_links = graph.links(neighbor, l);
+                if (neighbor_links[0] < graph.max_links(l)) {
+                    neighbor_links[++neighbor_links[0]] = node;
+                    continue;
+                }
+                // the neighbor is full, keep the best of its links and the new node
+                vector<Candidate> neighbor_candidates{{distance(neighbor, node), node}};
+                for (unsigned i = 1; i <= neighbor_links[0]; i++) {
+                    neighbor_candidates.emplace_back(distance(neighbor, neighbor_links[i]), neighbor_links[i]);
+                }
+                sort(neighbor_candidates.begin(), neighbor_candidates.end());
+                auto kept = select_neighbors(neighbor_candidates, graph.max_links(l));
+                neighbor_links[0] = (unsigned) kept.size();
+                std::copy(kept.begin(), kept.end(), neighbor_links + 1);
+            }
+            entry = candidates[0];
+        }
+        if (level > max_level) {
+            std::lock_guard<std::mutex> lock(entry_mutex);
+            if (level > graph.max_level) {
+                graph.max_level = level;
+                graph.entry_point = node;
+            }
+        }
+    }
+};
+
+Graph build_graph(const Embeddings &embeddings, const Options &options) {
+    Graph graph;
+    graph.n = embeddings.n;
+    graph.m = options.m;
+    // Levels are drawn before the build so that the upper links can be laid out at once
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> uniform(0, 1);
+    double level_mult = 1 / log((double) options.m);
+    graph.levels.resize(graph.n);
+    graph.upper_offsets.resize(graph.n + 1);
+    for (unsigned i = 0; i < graph.n; i++) {
+        graph.levels[i] = (unsigned char) min(-log(1 - uniform(rng)) * level_mult, 31.0);
+        graph.upper_offsets[i + 1] = graph.upper_offsets[i] + graph.levels[i];
+    }
+    graph.level0.assign((size_t) graph.n * (1 + 2 * graph.m), 0);
+    graph.upper.assign(graph.upper_offsets[graph.n] * (1 + graph.m), 0);
+    graph.entry_point = 0;
+    graph.max_level = graph.levels[0];
+
+    Builder builder(graph, embeddings, options.ef_construction);
+    std::atomic<unsigned> next = 1;
+    std::atomic<unsigned> n_inserted = 1;
+    auto start = std::chrono::steady_clock::now();
+    vector<thread> threads;
+    for (int t = 0; t < options.n_threads; t++) {
+        threads.emplace_back([&]() {
+            for (unsigned node = next++; node < graph.n; node = next++) {
+                builder.insert(node);
+                unsigned cnt = ++n_inserted;
+                if (cnt % 100000 == 0) {
+                    auto now = std::chrono::steady_clock::now();
+                    printf("inserted %u of %u nodes, time used %llds\n", cnt, graph.n,
+                           (long long) std::chrono::duration_cast<std::chrono::seconds>(now - start).count());
+                    fflush(stdout);
+                }
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    return graph;
+}
+
+void save_graph(const Graph &graph, const Embeddings &embeddings, const char *path) {
+    FILE *fp = fopen(path, "wb");
+    if (fp == nullptr) {
+        perror("Failed to open graph file");
+        exit(EXIT_FAILURE);
+    }
+    auto aligned = [](unsigned long long pos) { return (pos + 63) / 64 * 64; };
+    GraphHeader header{};
+    memcpy(header.magic, GRAPH_MAGIC, sizeof(header.magic));
+    header.n = graph.n;
+    header.dim = embeddings.dim;
+    header.m = graph.m;
+    header.max_level = graph.max_level;
+    header.entry_point = graph.entry_point;
+    header.levels_begin = aligned(sizeof(GraphHeader));
+    header.level0_begin = aligned(header.levels_begin + graph.levels.size());
+    header.upper_offsets_begin = aligned(header.level0_begin + graph.level0.size() * sizeof(unsigned));
+    header.upper_begin = aligned(header.upper_offsets_begin + graph.upper_offsets.size() * sizeof(unsigned long long));
+    header.size = header.upper_begin + graph.upper.size() * sizeof(unsigned);
+    unsigned long long pos = 0;
+    auto write_section = [&](unsigned long long begin, const void *data, size_t size) {
+        static const char zeros[64] = {};
+        fwrite(zeros, 1, begin - pos, fp);
+        if (fwrite(data, 1, size, fp) != size) {
+            perror("Failed to write graph file");
+            exit(EXIT_FAILURE);
+        }
+        pos = begin + size;
+    };
+    write_section(0, &header, sizeof(header));
+    write_section(header.levels_begin, graph.levels.data(), graph.levels.size());
+    write_section(header.level0_begin, graph.level0.data(), graph.level0.size() * sizeof(unsigned));
+    write_section(header.upper_offsets_begin, graph.upper_offsets.data(),
+                  graph.upper_offsets.size() * sizeof(unsigned long long));
+    write_section(header.upper_begin, graph.upper.data(), graph.upper.size() * sizeof(unsigned));
+    fclose(fp);
+}
+
+// The graph file mapped to memory, searched without locks as in main
+struct GraphView {
+    const GraphHeader *header = nullptr;
+    const unsigned char *levels = nullptr;
+    const unsigned *level0 = nullptr;
+    const unsigned long long *upper_offsets = nullptr;
+    const unsigned *upper = nullptr;
+
+    const unsigned *links(unsigned node, unsigned level) const {
+        if (level == 0) {
+            return level0 + (size_t) node * (1 + 2 * header->m);
+        }
+        return upper + (upper_offsets[node] + level - 1) * (1 + header->m);
+    }
+};
+
+GraphView load_graph(const char *path, const Embeddings &embeddings) {
+    size_t size;
+    const char *data = map_file(path, size);
+    GraphView graph;
+    graph.header = (const GraphHeader *) data;
+    if (size < sizeof(GraphHeader) || memcmp(graph.header->magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC)) != 0 ||
+        graph.header->size != size) {
+        cerr << "Invalid graph file " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (graph.header->n != embeddings.n || graph.header->dim != embeddings.dim) {
+        cerr << "The graph file " << path << " was not built from these embeddings" << endl;
+        exit(EXIT_FAILURE);
+    }
+    graph.levels = (const unsigned char *) (data + graph.header->levels_begin);
+    graph.level0 = (const unsigned *) (data + graph.header->level0_begin);
+    graph.upper_offsets = (const unsigned long long *) (data + graph.header->upper_offsets_begin);
+    graph.upper = (const unsigned *) (data + graph.header->upper_begin);
+    return graph;
+}
+
+// The k nearest nodes found by descending the levels greedily and searching level 0 with ef candidates
+vector<Candidate> search_graph(const GraphView &graph, const Embeddings &embeddings, const float *query, unsigned k,
+                               unsigned ef) {
+    auto links = [&graph](unsigned node, unsigned level, vector<unsigned> &out) {
+        const unsigned *node_links = graph.links(node, level);
+        out.assign(node_links + 1, node_links + 1 + node_links[0]);
+    };
+    unsigned entry_point = graph.header->entry_point;
+    Candidate entry{-dot(query, embeddings.row(entry_point), embeddings.dim), entry_point};
+    for (unsigned l = graph.header->max_level; l > 0; l--) {
+        entry = search_level(embeddings, query, entry, 1, l, links)[0];
+    }
+    auto result = search_level(embeddings, query, entry, max(ef, k), 0, links);
+    result.resize(min((size_t) k, result.size()));
+    return result;
+}
+
+// Exact top k of all queries by a scan of all embeddings, each thread scanning a range of them for all queries
+// so that the queries stay in the cache
+vector<vector<unsigned>> exact_search(const Embeddings &embeddings, const vector<float> &queries, unsigned n_queries,
+                                      int n_threads) {
+    using Heap = priority_queue<Candidate>;  // farthest on top
+    vector<vector<Heap>> thread_heaps(n_threads, vector<Heap>(n_queries));
+    vector<thread> threads;
+    for (int t = 0; t < n_threads; t++) {
+        threads.emplace_back([&, t]() {
+            unsigned begin = (unsigned) ((unsigned long long) embeddings.n * t / n_threads);
+            unsigned end = (unsigned) ((unsigned long long) embeddings.n * (t + 1) / n_threads);
+            auto &heaps = thread_heaps[t];
+            for (unsigned i = begin; i < end; i++) {
+                for (unsigned q = 0; q < n_queries; q++) {
+                    float distance = -dot(queries.data() + (size_t) q * embeddings.dim, embeddings.row(i),
+                                          embeddings.dim);
+                    if (heaps[q].size() < TOP_K) {
+                        heaps[q].emplace(distance, i);
+                    } else if (distance < heaps[q].top().first) {
+                        heaps[q].pop();
+                        heaps[q].emplace(distance, i);
+                    }
+                }
+            }
+        });
+    }
+    for (auto &t: threads) {
+        t.join();
+    }
+    vector<vector<unsigned>> results(n_queries);
+    for (unsigned q = 0; q < n_queries; q++) {
+        vector<Candidate> all;
+        for (auto &heaps: thread_heaps) {
+            for (; !heaps[q].empty(); heaps[q].pop()) {
+                all.push_back(heaps[q].top());
+            }
+        }
+        sort(all.begin(), all.end());
+        for (size_t i = 0; i < min((size_t) TOP_K, all.size()); i++) {
+            results[q].push_back(all[i].second);
+        }
+    }
+    return results;
+}
+
+// recall@TOP_K of the graph against the exact scan, for each ef_search
+void measure_recall(const GraphView &graph, const Embeddings &embeddings, const Options &options) {
+    vector<float> queries;
+    unsigned n_queries;
+    if (options.queries_path != nullptr) {
+        Embeddings query_embeddings = load_embeddings(options.queries_path);
+        if (query_embeddings.dim != embeddings.dim) {
+            cerr << "The query embeddings have " << query_embeddings.dim << " dimensions instead of "
+                 << embeddings.dim << endl;
+            exit(EXIT_FAILURE);
+        }
+        n_queries = min(options.n_queries, query_embeddings.n);
+        queries.assign(query_embeddings.data, query_embeddings.data + (size_t) n_queries * embeddings.dim);
+    } else {
+        // corpus embeddings as queries find themselves first, so the recall is a little optimistic
+        n_queries = min(options.n_queries, embeddings.n);
+        std::mt19937 rng(7);
+        std::uniform_int_distribution<unsigned> pick(0, embeddings.n - 1);
+        for (unsigned q = 0; q < n_queries; q++) {
+            const float *row = embeddings.row(pick(rng));
+            queries.insert(queries.end(), row, row + embeddings.dim);
+        }
+    }
+    if (n_queries == 0) {
+        return;
+    }
+    printf("Scanning all embeddings for the exact top %u of %u queries...", TOP_K, n_queries);
+    fflush(stdout);
+    auto start = std::chrono::steady_clock::now();
+    auto exact = exact_search(embeddings, queries, n_queries, options.n_threads);
+    auto stop = std::chrono::steady_clock::now();
+    printf("done in %.2f seconds\n", std::chrono::duration<double>(stop - start).count());
+    for (unsigned ef: options.ef_searches) {
+        size_t found = 0, expected = 0;
+        start = std::chrono::steady_clock::now();
+        for (unsigned q = 0; q < n_queries; q++) {
+            auto result = search_graph(graph, embeddings, queries.data() + (size_t) q * embeddings.dim, TOP_K, ef);
+            for (const auto &[distance, node]: result) {
+                found += std::find(exact[q].begin(), exact[q].end(), node) != exact[q].end();
+            }
+            expected += exact[q].size();
+        }
+        stop = std::chrono::steady_clock::now();
+        printf("ef_search %u: recall@%u %.4f, %.1f microseconds per query on one thread\n", ef, TOP_K,
+               (double) found / (double) max(expected, (size_t) 1),
+               std::chrono::duration<double, std::micro>(stop - start).count() / n_queries);
+    }
+}
+
+int main(int argc, char *argv[]) {
+    auto start = std::chrono::steady_clock::now();
+
+    Options options = parse_args(argc, argv);
+    Embeddings embeddings = load_embeddings(options.embeddings_path);
+    if (embeddings.n == 0) {
+        cerr << "No embeddings in " << options.embeddings_path << endl;
+        exit(EXIT_FAILURE);
+    }
+    printf("%u embeddings of %u dimensions\n", embeddings.n, embeddings.dim);
+    if (options.build) {
+        Graph graph = build_graph(embeddings, options);
+        save_graph(graph, embeddings, options.graph_path);
+        auto end = std::chrono::steady_clock::now();
+        cout << "graph built with max level " << graph.max_level << ", time used "
+             << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << "s" << endl;
+    }
+    GraphView graph = load_graph(options.graph_path, embeddings);
+    measure_recall(graph, embeddings, options);
+    return 0;
+}
@@ -19,6 +19,10 @@ using std::unordered_map;
 
 struct Entry {
     vector<unsigned> doc_ids, freqs;
+    vector<unsigned> offsets;  // byte offset of the first occurrence in each doc, only if options.record_offsets
+    // word positions in each doc, freqs[i] of them for the i-th doc, each relative to the previous one in the same doc,
+    // only if options.record_positions
+    vector<unsigned> positions;
 };
 using Index = unordered_map<string, Entry>;
 
@@ -102,6 +106,8 @@ struct Options {
     decltype(dump_uints_vbyte) *dump_uints = dump_uints_vbyte;
     int input_buffer_size = 256 * 1024 * 1024;
     int output_entry_size = 1000000;
+    bool record_offsets = false;
+    bool record_positions = false;
 } options;
 
 FILE *fopen_guarded(const string &filename, const char *mode) {
@@ -134,6 +140,14 @@ void sort_and_dump_index(const char *path, int name_num) {
     string filename_prefix = filename.str();
     FILE *ids_fp = fopen_guarded(filename_prefix + "." + options.index_type, "wb");
     FILE *freqs_fp = fopen_guarded(filename_prefix + "_freqs." + options.index_type, "wb");
+    FILE *offsets_fp = nullptr;
+    if (options.record_offsets) {
+        offsets_fp = fopen_guarded(filename_prefix + "_offsets." + options.index_type, "wb");
+    }
+    FILE *positions_fp = nullptr;
+    if (options.record_positions) {
+        positions_fp = fopen_guarded(filename_prefix + "_positions." + options.index_type, "wb");
+    }
     for (auto &entry: index_sorted) {
         fwrite(entry->first.c_str(), sizeof(char), entry->first.size(), ids_fp);
         char sep = ' ';
@@ -144,9 +158,21 @@ void sort_and_dump_index(const char *path, int name_num) {
         }
         options.dump_uints(ids_fp, entry->second.doc_ids);
         options.dump_uints(freqs_fp, entry->second.freqs);
+        if (offsets_fp != nullptr) {
+            options.dump_uints(offsets_fp, entry->second.offsets);
+        }
+        if (positions_fp != nullptr) {
+            options.dump_uints(positions_fp, entry->second.positions);
+        }
     }
     fclose(ids_fp);
     fclose(freqs_fp);
+    if (offsets_fp != nullptr) {
+        fclose(offsets_fp);
+    }
+    if (positions_fp != nullptr) {
+        fclose(positions_fp);
+    }
 }
 
 void dump_docs_info_txt(FILE *docs_info_fp) {
@@ -224,7 +250,7 @@ int get_utf8_char_len() {
 
 void print_usage(char *program_name) {
     printf("Usage: %s [-h] [-d dataset_file_path] [-i index_path] [-p doc_info_path]\n"
-           "\t[-t index_type] [-b input_buffer_size] [-e output_entry_size]\n"
+           "\t[-t index_type] [-b input_buffer_size] [-e output_entry_size] [-f record_offsets] [-r record_positions]\n"
            "Options:\n"
            "\t-d\tdataset path, default: msmarco-docs.trec.gz\n"
            "\t-i\tindex path, default: index\n"
@@ -232,6 +258,8 @@ void print_usage(char *program_name) {
            "\t-t\tindex type (txt|bin|vbyte), default: vbyte\n"
            "\t-b\tinput buffer size (unsigned int but must < 2GB, unit: bytes), default: 256MB\n"
            "\t-e\toutput entry size, default: 1000000\n"
+           "\t-f\talso record the byte offset of the first occurrence of each term in each doc (true|false), default: false\n"
+           "\t-r\talso record the word positions of each term in each doc (true|false), default: false\n"
            "\t-h\thelp\n", program_name);
 }
 
@@ -269,6 +297,26 @@ void parse_args(int argc, char *argv[]) {
                     print_usage(argv[0]);
                     exit(EXIT_FAILURE);
                 }
+            } else if (strcmp(option, "-f") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.record_offsets = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.record_offsets = false;
+                } else {
+                    cerr << "Invalid record offsets: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-r") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.record_positions = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.record_positions = false;
+                } else {
+                    cerr << "Invalid record positions: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
             } else if (strcmp(option, "-e") == 0) {
                 options.output_entry_size = atoi(value);
                 if (options.output_entry_size <= 0) {
@@ -352,9 +400,11 @@ int main(int argc, char *argv[]) {
             doc.url.push_back(*next);
         }
         doc.begin = offset;
-        unordered_map<string, unsigned> term_cnt;
+        unordered_map<string, pair<unsigned, unsigned>> term_cnt;  // count and offset of the first occurrence
+        unordered_map<string, vector<unsigned>> term_positions;  // only if options.record_positions
         while (!startswith("</TEXT>", 7)) {
             word.clear();
+            auto word_begin = (unsigned) (offset - doc.begin);
             int len = get_utf8_char_len();  // must be called before next_char()
             next = next_char();
             while (is_al_num(next, len)) {
@@ -373,16 +423,30 @@ int main(int argc, char *argv[]) {
             pos += len - 1;
             offset += len - 1;
             if (!word.empty()) {
+                if (options.record_positions) {
+                    term_positions[word].push_back(doc.term_cnt);
+                }
                 doc.term_cnt++;
                 total_term_cnt++;
                 if (inv_index.find(word) == inv_index.end() || inv_index[word].doc_ids.back() != doc_id) {
                     inv_index[word].doc_ids.push_back(doc_id);  // OK in C++
                 }
-                term_cnt[word]++;  // OK in C++
+                auto [it, inserted] = term_cnt.try_emplace(word, 0, word_begin);
+                it->second.first++;
             }
         }
         for (auto &[term, cnt]: term_cnt) {
-            inv_index[term].freqs.push_back(cnt);
+            inv_index[term].freqs.push_back(cnt.first);
+            if (options.record_offsets) {
+                inv_index[term].offsets.push_back(cnt.second);
+            }
+            if (options.record_positions) {
+                unsigned prev_position = 0;
+                for (auto position: term_positions[term]) {
+                    inv_index[term].positions.push_back(position - prev_position);
+                    prev_position = position;
+                }
+            }
         }
         doc.end = offset - 7;
         docs.push_back(doc);
@@ -9,12 +9,17 @@
 #include <list>
 #include <queue>
 #include <algorithm>
+#include <bit>
 #include <cmath>
 #include <chrono>
 #include <memory>
 #include <thread>
 #include <mutex>
+#include <atomic>
 #include <condition_variable>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using std::string;
 using std::vector;
@@ -30,6 +35,7 @@ using std::list;
 using std::shared_ptr;
 using std::make_shared;
 using std::sort;
+using std::min;
 using std::thread;
 using std::unique_lock;
 using std::mutex;
@@ -79,44 +85,93 @@ struct DocInfo {
 vector<DocInfo> docs_info;
 //mutex docs_info_mutex;
 
-using ResultDocInfos = vector<pair<unsigned, double>>;
+using ResultDocInfos = vector<pair<unsigned, float>>;
 
-template<typename KeyType, typename ValueType>
-class LRUCache {
-protected:
-    int capacity;
-    unordered_map<KeyType, pair<ValueType, typename list<KeyType>::iterator>> cache;
-    list<KeyType> lru_list;
-    mutex cache_mutex;
+// Approximate memory held by a cached entry, used to bound the cache by bytes instead of by entry count
+size_t cache_charge(const Entry &entry) {
+    return sizeof(Entry) + entry.term.capacity() + (entry.doc_ids.capacity() + entry.freqs.capacity()) * sizeof(unsigned);
+}
 
-public:
-    explicit LRUCache(int capacity) : capacity(capacity) {}
+struct CacheStats {
+    size_t hits = 0, misses = 0, evictions = 0, bytes = 0, items = 0;
+};
 
-    virtual ~LRUCache() = default;
+// LRU cache bounded by the total cache_charge() of its values. Keys are spread over shards by hash,
+// each with its own lock, LRU list and byte budget, so that evaluator threads rarely wait for each other.
+template<typename T>
+class ShardedLRUCache {
+private:
+    struct Item {
+        string key;
+        shared_ptr<T> value;
+        size_t charge;
+    };
 
-    ValueType get(const KeyType &key) {
-        lock_guard<mutex> lock(cache_mutex);
-        if (cache.find(key) != cache.end()) {
-            lru_list.erase(cache[key].second);
-            lru_list.push_front(key);
-            cache[key].second = lru_list.begin();
-            return cache[key].first;
-        } else {
-            return ValueType();
+    struct Shard {
+        mutex shard_mutex;
+        list<Item> lru_list;  // most recently used first
+        unordered_map<string, typename list<Item>::iterator> items;
+        size_t bytes = 0;
+    };
+
+    size_t shard_capacity;
+    vector<Shard> shards;
+    std::atomic<size_t> hits = 0, misses = 0, evictions = 0;
+
+    Shard &shard_of(const string &key) {
+        return shards[std::hash<string>()(key) % shards.size()];
+    }
+
+public:
+    explicit ShardedLRUCache(size_t capacity, size_t n_shards = 16) :
+            shard_capacity(capacity / n_shards), shards(n_shards) {}
+
+    shared_ptr<T> get(const string &key) {
+        Shard &shard = shard_of(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        auto it = shard.items.find(key);
+        if (it == shard.items.end()) {
+            misses++;
+            return nullptr;
+        }
+        hits++;
+        shard.lru_list.splice(shard.lru_list.begin(), shard.lru_list, it->second);
+        return it->second->value;
+    }
+
+    void put(const string &key, const shared_ptr<T> &value) {
+        size_t charge = sizeof(Item) + key.capacity() + (value ? cache_charge(*value) : 0);
+        if (charge > shard_capacity) {  // would evict everything else in its shard
+            return;
         }
+        Shard &shard = shard_of(key);
+        lock_guard<mutex> lock(shard.shard_mutex);
+        auto it = shard.items.find(key);
+        if (it != shard.items.end()) {
+            shard.bytes -= it->second->charge;
+            shard.lru_list.erase(it->second);
+            shard.items.erase(it);
+        }
+        while (shard.bytes + charge > shard_capacity) {
+            const Item &least_recent = shard.lru_list.back();
+            shard.bytes -= least_recent.charge;
+            shard.items.erase(least_recent.key);
+            shard.lru_list.pop_back();
+            evictions++;
+        }
+        shard.lru_list.push_front({key, value, charge});
+        shard.items.emplace(key, shard.lru_list.begin());
+        shard.bytes += charge;
     }
 
-    virtual void put(const KeyType &key, const ValueType &value) {
-        lock_guard<mutex> lock(cache_mutex);
-        if (cache.find(key) != cache.end()) {
-            lru_list.erase(cache[key].second);
-        } else if (cache.size() >= capacity) {
-            KeyType leastRecent = lru_list.back();
-            lru_list.pop_back();
-            cache.erase(leastRecent);
+    CacheStats stats() {
+        CacheStats stats{hits, misses, evictions};
+        for (auto &shard: shards) {
+            lock_guard<mutex> lock(shard.shard_mutex);
+            stats.bytes += shard.bytes;
+            stats.items += shard.items.size();
         }
-        lru_list.push_front(key);
-        cache[key] = {value, lru_list.begin()};
+        return stats;
     }
 };
 
@@ -243,6 +298,7 @@ void print_usage(char *program_name) {
     printf("Usage: %s [-h] [-p doc_info_file] [-s storage_info_file]\n"
            "\t[-i index_ids_file] [-f index_freqs_file] [-t index_file_type]\n"
            "\t[-q queries_path] [-r relevance_path] [-n n_results] [-m n_threads] [-c cache_size]\n"
+           "\t[-b bench_bm25]\n"
            "Options:\n"
            "\t-p\tdoc info (page table) file, default: docs.txt\n"
            "\t-s\tstorage info (lexicon) file, default: storage_vbyte.txt\n"
@@ -253,7 +309,8 @@ void print_usage(char *program_name) {
            "\t-r\trelevance path, default: msmarco-doctrain-qrels-idconverted.tsv\n"
            "\t-n\tnumber of results, default: 10\n"
            "\t-m\tnumber of threads, default: number of logical cores (%u on this machine)\n"
-           "\t-c\tcache size, default: 131072\n"
+           "\t-c\tindex entry cache size in MiB, default: 4096\n"
+           "\t-b\tbenchmark BM25 kernels on the postings of the queries instead (true|false), default: false\n"
            "\t-h\thelp\n", program_name, std::thread::hardware_concurrency());
 }
 
@@ -271,7 +328,8 @@ struct Options {
     double k = 0.9, b = 0.4;
     int n_results = 10;
     int n_threads = (int) std::thread::hardware_concurrency();
-    int cache_size = 131072;
+    int cache_size = 4096;  // in MiB
+    bool bench_bm25 = false;
 };
 
 Options parse_args(int argc, char *argv[]) {
@@ -314,6 +372,16 @@ Options parse_args(int argc, char *argv[]) {
                     print_usage(argv[0]);
                     exit(EXIT_FAILURE);
                 }
+            } else if (strcmp(option, "-b") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.bench_bm25 = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.bench_bm25 = false;
+                } else {
+                    cerr << "Invalid value for option -b: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
             } else if (strcmp(option, "-c") == 0) {
                 options.cache_size = atoi(value);
                 if (options.cache_size <= 0) {
@@ -427,6 +495,127 @@ double BM25(unsigned freq, unsigned doc_cnt, unsigned doc_len, const Options &op
            (freq * (options.k + 1)) / (freq + K);
 }
 
+// BM25 is split into parts that are computed once: the length normalization K of each doc at startup,
+// and the IDF of each term once per query. Only TF is left for each posting.
+vector<float> doc_norms;
+
+void init_doc_norms(const Options &options) {
+    doc_norms.resize(docs_info.size());
+    for (size_t i = 0; i < docs_info.size(); i++) {
+        doc_norms[i] = (float) (options.k * ((1 - options.b) + options.b * docs_info[i].term_cnt / options.avg_doc_len));
+    }
+}
+
+float BM25_IDF(unsigned doc_cnt, const Options &options) {
+    return (float) log((options.total_doc_cnt - doc_cnt + 0.5) / (doc_cnt + 0.5));
+}
+
+float BM25(unsigned freq, unsigned doc_id, float idf, float k1) {
+    return idf * ((float) freq * k1) / ((float) freq + doc_norms[doc_id]);
+}
+
+// Score n postings of a term into scores, 8 at a time with AVX2. k1 is k + 1.
+void BM25_block(const unsigned *doc_ids, const unsigned *freqs, size_t n, float idf, float k1, float *scores) {
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256 weight_v = _mm256_set1_ps(idf * k1);
+    for (; i + 8 <= n; i += 8) {
+        // freqs and doc ids are less than 2^31, so signed conversion and indexing are fine
+        __m256 freq_v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *) (freqs + i)));
+        __m256i id_v = _mm256_loadu_si256((const __m256i *) (doc_ids + i));
+        __m256 norm_v = _mm256_i32gather_ps(doc_norms.data(), id_v, sizeof(float));
+        __m256 score_v = _mm256_div_ps(_mm256_mul_ps(weight_v, freq_v), _mm256_add_ps(freq_v, norm_v));
+        _mm256_storeu_ps(scores + i, score_v);
+    }
+#endif
+    for (; i < n; i++) {
+        scores[i] = BM25(freqs[i], doc_ids[i], idf, k1);
+    }
+}
+
+// Dense score array for term-at-a-time scoring, indexed by doc id.
+// Docs are grouped into pages, and only the pages touched by the last query are cleared on reset().
+class ScoreAccumulator {
+private:
+    static constexpr unsigned PAGE_BITS = 12;  // 4096 docs per page, must be >= 6
+    vector<float> scores;
+    vector<unsigned long long> touched;  // one bit per doc
+    vector<bool> page_dirty;
+    vector<unsigned> dirty_pages;
+    size_t touched_cnt = 0;
+
+public:
+    explicit ScoreAccumulator(size_t n_docs) :
+            scores(n_docs), touched((n_docs + 63) / 64), page_dirty((n_docs >> PAGE_BITS) + 1) {}
+
+    void add(unsigned doc_id, float score) {
+        unsigned page = doc_id >> PAGE_BITS;
+        if (!page_dirty[page]) {
+            page_dirty[page] = true;
+            dirty_pages.push_back(page);
+        }
+        unsigned long long &word = touched[doc_id >> 6];
+        unsigned long long bit = 1ULL << (doc_id & 63);
+        if (!(word & bit)) {
+            word |= bit;
+            touched_cnt++;
+        }
+        scores[doc_id] += score;
+    }
+
+    // number of docs that have been added since the last reset()
+    size_t size() const {
+        return touched_cnt;
+    }
+
+    // Select the k highest scores, sorted by score descending and then doc id ascending.
+    vector<pair<unsigned, float>> top_k(size_t k) const {
+        // heap top is the worst result kept so far
+        auto better = [](const pair<unsigned, float> &lhs, const pair<unsigned, float> &rhs) {
+            return lhs.second > rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
+        };
+        vector<pair<unsigned, float>> heap;
+        if (k == 0) {
+            return heap;
+        }
+        heap.reserve(min(k, touched_cnt));
+        for (auto page : dirty_pages) {
+            size_t word_begin = (size_t) page << (PAGE_BITS - 6);
+            size_t word_end = min(word_begin + (1 << (PAGE_BITS - 6)), touched.size());
+            for (size_t w = word_begin; w < word_end; w++) {
+                for (unsigned long long word = touched[w]; word != 0; word &= word - 1) {
+                    auto doc_id = (unsigned) (w * 64 + std::countr_zero(word));
+                    pair<unsigned, float> item(doc_id, scores[doc_id]);
+                    if (heap.size() < k) {
+                        heap.push_back(item);
+                        push_heap(heap.begin(), heap.end(), better);
+                    } else if (better(item, heap.front())) {
+                        pop_heap(heap.begin(), heap.end(), better);
+                        heap.back() = item;
+                        push_heap(heap.begin(), heap.end(), better);
+                    }
+                }
+            }
+        }
+        sort_heap(heap.begin(), heap.end(), better);
+        return heap;
+    }
+
+    void reset() {
+        for (auto page : dirty_pages) {
+            size_t doc_begin = (size_t) page << PAGE_BITS;
+            size_t doc_end = min(doc_begin + (1 << PAGE_BITS), scores.size());
+            std::fill(scores.begin() + (long long) doc_begin, scores.begin() + (long long) doc_end, 0.f);
+            size_t word_begin = doc_begin >> 6;
+            size_t word_end = min(word_begin + (1 << (PAGE_BITS - 6)), touched.size());
+            std::fill(touched.begin() + (long long) word_begin, touched.begin() + (long long) word_end, 0ULL);
+            page_dirty[page] = false;
+        }
+        dirty_pages.clear();
+        touched_cnt = 0;
+    }
+};
+
 class Evaluator {
 protected:
     const Options &options;
@@ -446,17 +635,18 @@ public:
 
 class BM25Evaluator : public Evaluator {
     FILE *ids_fp = nullptr, *freqs_fp = nullptr;
-    LRUCache<string, shared_ptr<Entry>> &entry_cache;
+    ShardedLRUCache<Entry> &entry_cache;
     vector<string> query_list;
-    unordered_map<unsigned, double> infos;
+    ScoreAccumulator accumulator;
     vector<EntryP> entries;
 
 public:
-    explicit BM25Evaluator(LRUCache<string, shared_ptr<Entry>> &entry_cache, const Options &options) :
+    explicit BM25Evaluator(ShardedLRUCache<Entry> &entry_cache, const Options &options) :
             Evaluator(options),
             ids_fp(fopen_guarded(options.index_ids_path, "rb")),
             freqs_fp(fopen_guarded(options.index_freqs_path, "rb")),
-            entry_cache(entry_cache) {
+            entry_cache(entry_cache),
+            accumulator(docs_info.size()) {
         name = "BM25Evaluator";
     }
 
@@ -524,8 +714,7 @@ public:
             return nullptr;
         }
 
-        // Calculate infos and sort by score
-        infos.clear();
+        // Calculate scores and select the top ones
         auto last_intersection = entries[0]->doc_ids;  // if not pointer, use & to avoid copy
         vector<unsigned> current_intersection;
         for (int i = 1; i < entries.size(); i++) {
@@ -535,33 +724,30 @@ public:
             swap(last_intersection, current_intersection);
             current_intersection.clear();
         }
+        constexpr size_t BLOCK_SIZE = 256;
+        unsigned freqs[BLOCK_SIZE];
+        float scores[BLOCK_SIZE];
+        auto k1 = (float) (options.k + 1);
         for (const auto &entry : entries) {
-            for (auto doc_id : last_intersection) {
-                auto it = lower_bound(entry->doc_ids.begin(), entry->doc_ids.end(), doc_id);
-                if (it != entry->doc_ids.end() && *it == doc_id) {
-                    auto freq = entry->freqs[it - entry->doc_ids.begin()];
-                    unsigned term_cnt;
-                    {
-                        //lock_guard<mutex> lock(docs_info_mutex);
-                        term_cnt = docs_info[doc_id].term_cnt;
-                    }
-                    infos[doc_id] += BM25(freq, (unsigned)entry->doc_ids.size(), term_cnt, options);
+            float idf = BM25_IDF((unsigned) entry->doc_ids.size(), options);
+            auto it = entry->doc_ids.begin();
+            for (size_t begin = 0; begin < last_intersection.size(); begin += BLOCK_SIZE) {
+                size_t n = min(BLOCK_SIZE, last_intersection.size() - begin);
+                for (size_t i = 0; i < n; i++) {
+                    // doc ids are sorted, so never search backwards
+                    it = lower_bound(it, entry->doc_ids.end(), last_intersection[begin + i]);
+                    freqs[i] = entry->freqs[it - entry->doc_ids.begin()];
+                }
+                BM25_block(last_intersection.data() + begin, freqs, n, idf, k1, scores);
+                for (size_t i = 0; i < n; i++) {
+                    accumulator.add(last_intersection[begin + i], scores[i]);
                 }
             }
         }
 
-        // Sort by score
-        auto sorted_infos = make_shared<ResultDocInfos>();
-        sorted_infos->reserve(infos.size());
-        for (const auto &info : infos) {
-            sorted_infos->emplace_back(info);
-        }
-        sort(sorted_infos->begin(), sorted_infos->end(),
-             [](const pair<unsigned, double> &lhs, const pair<unsigned, double> &rhs) {
-                 return lhs.second > rhs.second ||
-                        (lhs.second == rhs.second && lhs.first < rhs.first);
-             });
-
+        // Only the first n_results are evaluated
+        auto sorted_infos = make_shared<ResultDocInfos>(accumulator.top_k(options.n_results));
+        accumulator.reset();
 
         return sorted_infos;
     }
@@ -693,13 +879,117 @@ unordered_map<unsigned, unsigned> read_relevance(const char *filename) {
     return relevance;
 }
 
+// Microbenchmark of the BM25 kernels on the postings of all query terms. The original BM25 is the reference
+// for both the speed and the max error, which must stay within float tolerance to keep the ranking.
+void bench_bm25(const vector<pair<unsigned, string>> &queries, const Options &options) {
+    printf("Reading postings of query terms...");
+    fflush(stdout);
+    unordered_set<string> terms;
+    vector<string> query_list;
+    for (auto &[_, query] : queries) {
+        query_list.clear();
+        clean_query(query, query_list);
+        terms.insert(query_list.begin(), query_list.end());
+    }
+    FILE *ids_fp = fopen_guarded(options.index_ids_path, "rb");
+    FILE *freqs_fp = fopen_guarded(options.index_freqs_path, "rb");
+    vector<EntryP> entries;
+    size_t n_postings = 0;
+    for (const auto &term : terms) {
+        auto it = storage_info.find(term);
+        if (it == storage_info.end()) {
+            continue;
+        }
+        auto entry = make_shared<Entry>();
+        entry->term = term;
+        options.read_index(ids_fp, freqs_fp, it->second.ids_begin, it->second.freqs_begin, it->second.doc_cnt, entry);
+        n_postings += entry->doc_ids.size();
+        entries.push_back(entry);
+    }
+    fclose(ids_fp);
+    fclose(freqs_fp);
+    printf("done\n%zu terms, %zu postings\n", entries.size(), n_postings);
+    if (n_postings == 0) {
+        return;
+    }
+
+    constexpr int N_ROUNDS = 5;
+    constexpr size_t BLOCK_SIZE = 256;
+    vector<float> reference(n_postings), scores(n_postings);
+    auto k1 = (float) (options.k + 1);
+    auto time = [&](const char *name, auto &&kernel) {
+        auto start = std::chrono::steady_clock::now();
+        for (int round = 0; round < N_ROUNDS; round++) {
+            kernel();
+        }
+        auto end = std::chrono::steady_clock::now();
+        double ns = std::chrono::duration<double, std::nano>(end - start).count() / N_ROUNDS / (double) n_postings;
+        double max_abs_error = 0, max_rel_error = 0;
+        for (size_t i = 0; i < n_postings; i++) {
+            double error = fabs((double) scores[i] - reference[i]);
+            max_abs_error = std::max(max_abs_error, error);
+            if (reference[i] != 0) {
+                max_rel_error = std::max(max_rel_error, error / fabs(reference[i]));
+            }
+        }
+        printf("%-28s %8.3f ns/posting, max abs error %.3g, max rel error %.3g\n",
+               name, ns, max_abs_error, max_rel_error);
+    };
+    size_t pos = 0;
+    for (const auto &entry : entries) {
+        for (size_t i = 0; i < entry->doc_ids.size(); i++) {
+            reference[pos++] = (float) BM25(entry->freqs[i], (unsigned) entry->doc_ids.size(),
+                                            docs_info[entry->doc_ids[i]].term_cnt, options);
+        }
+    }
+    time("original BM25", [&]() {
+        size_t pos = 0;
+        for (const auto &entry : entries) {
+            for (size_t i = 0; i < entry->doc_ids.size(); i++) {
+                scores[pos++] = (float) BM25(entry->freqs[i], (unsigned) entry->doc_ids.size(),
+                                             docs_info[entry->doc_ids[i]].term_cnt, options);
+            }
+        }
+    });
+    time("precomputed IDF and K", [&]() {
+        size_t pos = 0;
+        for (const auto &entry : entries) {
+            float idf = BM25_IDF((unsigned) entry->doc_ids.size(), options);
+            for (size_t i = 0; i < entry->doc_ids.size(); i++) {
+                scores[pos++] = BM25(entry->freqs[i], entry->doc_ids[i], idf, k1);
+            }
+        }
+    });
+#ifdef __AVX2__
+    const char *block_name = "precomputed + AVX2 blocks";
+#else
+    const char *block_name = "precomputed + scalar blocks";
+#endif
+    time(block_name, [&]() {
+        size_t pos = 0;
+        for (const auto &entry : entries) {
+            float idf = BM25_IDF((unsigned) entry->doc_ids.size(), options);
+            for (size_t begin = 0; begin < entry->doc_ids.size(); begin += BLOCK_SIZE) {
+                size_t n = min(BLOCK_SIZE, entry->doc_ids.size() - begin);
+                BM25_block(entry->doc_ids.data() + begin, entry->freqs.data() + begin, n, idf, k1, scores.data() + pos);
+                pos += n;
+            }
+        }
+    });
+}
+
 int main(int argc, char *argv[]) {
     Options options = parse_args(argc, argv);
     read_storage_info(options.storage_path);
     read_docs_info(options);
+    init_doc_norms(options);
     auto queries = read_queries(options.queries_path);
+    if (options.bench_bm25) {
+        bench_bm25(queries, options);
+        return 0;
+    }
     auto relevance = read_relevance(options.relevance_path);
-    LRUCache<string, shared_ptr<Entry>> entry_cache(options.cache_size);
+    ShardedLRUCache<Entry> entry_cache((size_t) options.cache_size << 20);
 
     auto start = std::chrono::steady_clock::now();
 
@@ -722,6 +1012,9 @@ int main(int argc, char *argv[]) {
     auto end = std::chrono::steady_clock::now();
     auto diff = std::chrono::duration<double>(end - start).count();
     printf("Time elapsed: %.2f seconds\n", diff);
+    auto stats = entry_cache.stats();
+    printf("Entry cache: %zu hits, %zu misses, %zu evictions, %zu entries in %.2f MiB\n", stats.hits, stats.misses,
+           stats.evictions, stats.items, (double) stats.bytes / (1 << 20));
 
     for (auto evaluator : evaluators) {
         delete evaluator;
@@ -0,0 +1,43 @@
+import struct
+import sys
+
+import torch
+
+# Exports embeddings to the flat file read by build_hnsw and main: two uint32 (number of embeddings, dimension),
+# then the float32 embeddings row by row, normalized to unit length so that their dot product is the cosine
+# similarity used by util.semantic_search.
+#
+# python export_embeddings.py [corpus_embeddings.pt] [corpus_embeddings.f32]
+#     exports the corpus embeddings saved by save_embeddings.ipynb
+# python export_embeddings.py --queries queries.tsv query_embeddings.f32
+#     encodes the queries of a "qid<TAB>query" file with the bi-encoder of learning_to_rank.py, for the recall
+#     of build_hnsw to be measured on real queries
+
+
+def write_embeddings(embeddings: torch.Tensor, path: str, chunk_size: int = 65536):
+    n, dim = embeddings.shape
+    with open(path, 'wb') as f:
+        f.write(struct.pack('<II', n, dim))
+        for begin in range(0, n, chunk_size):
+            chunk = embeddings[begin:begin + chunk_size].to('cpu', torch.float32)
+            chunk = torch.nn.functional.normalize(chunk, dim=1)
+            f.write(chunk.contiguous().numpy().tobytes())
+
+
+def export_corpus(src: str = 'corpus_embeddings.pt', dst: str = 'corpus_embeddings.f32'):
+    write_embeddings(torch.load(src, map_location='cpu', mmap=True), dst)
+
+
+def export_queries(src: str, dst: str):
+    from sentence_transformers import SentenceTransformer
+    bi_encoder = SentenceTransformer('multi-qa-MiniLM-L6-cos-v1')
+    with open(src, encoding='utf-8') as f:
+        queries = [line.rstrip('\n').split('\t')[-1] for line in f if line.strip()]
+    write_embeddings(bi_encoder.encode(queries, convert_to_tensor=True, show_progress_bar=True), dst)
+
+
+if __name__ == '__main__':
+    if len(sys.argv) > 1 and sys.argv[1] == '--queries':
+        export_queries(*sys.argv[2:4])
+    else:
+        export_corpus(*sys.argv[1:3])
@@ -1,6 +1,7 @@
-from sentence_transformers import SentenceTransformer, CrossEncoder, util
+from sentence_transformers import SentenceTransformer, CrossEncoder
 import torch
-from typing import List, Dict
+import numpy as np
+from typing import List, Tuple
 
 device = torch.device('cuda' if torch.cuda.is_available() else 'cpu')
 
@@ -8,6 +9,7 @@ device = torch.device('cuda' if torch.cuda.is_available() else 'cpu')
 bi_encoder = SentenceTransformer('multi-qa-MiniLM-L6-cos-v1', device=device)
 bi_encoder.max_seq_length = 256     #Truncate long passages to 256 tokens
 top_k = 32                          #Number of passages we want to retrieve with the bi-encoder
+corpus_chunk_size = 500000          #Corpus embeddings compared with the queries at once, as in util.semantic_search
 
 #The bi-encoder will retrieve 100 documents. We use a cross-encoder, to re-rank the results list to improve the quality
 cross_encoder = CrossEncoder('cross-encoder/ms-marco-MiniLM-L-6-v2', device=device)
@@ -15,13 +17,48 @@ cross_encoder = CrossEncoder('cross-encoder/ms-marco-MiniLM-L-6-v2', device=devi
 corpus_embeddings = torch.load('corpus_embeddings.pt', map_location=device, mmap=True)
 
 
-def semantic_search(query: str) -> List[Dict]:
+def search_embeddings(question_embeddings: torch.Tensor) -> Tuple[torch.Tensor, torch.Tensor]:
+    # util.semantic_search of a batch of query embeddings, but returning the corpus ids (int64) and scores (float32)
+    # of each query as two tensors, which main reads as arrays instead of one dict per result
+    if question_embeddings.dim() == 1:
+        question_embeddings = question_embeddings.unsqueeze(0)
+    question_embeddings = torch.nn.functional.normalize(question_embeddings, dim=1)
+    chunk_ids, chunk_scores = [], []
+    for begin in range(0, len(corpus_embeddings), corpus_chunk_size):
+        chunk = torch.nn.functional.normalize(corpus_embeddings[begin:begin + corpus_chunk_size], dim=1)
+        scores, ids = torch.topk(question_embeddings @ chunk.T, min(top_k, len(chunk)), dim=1)
+        chunk_ids.append(ids + begin)
+        chunk_scores.append(scores)
+    scores, order = torch.topk(torch.cat(chunk_scores, dim=1), min(top_k, len(corpus_embeddings)), dim=1)
+    ids = torch.gather(torch.cat(chunk_ids, dim=1), 1, order)
+    return ids.to('cpu', torch.int64), scores.to('cpu', torch.float32)
+
+
+def semantic_search(query: str) -> Tuple[np.ndarray, np.ndarray]:
     question_embedding = bi_encoder.encode(query, convert_to_tensor=True, device=device)
-    return util.semantic_search(question_embedding, corpus_embeddings, top_k=top_k)[0]
+    ids, scores = search_embeddings(question_embedding)
+    return ids[0].numpy(), scores[0].numpy()
+
+
+def encode_query(query: str) -> np.ndarray:
+    # float32 embedding of unit length, searched in the HNSW graph or the flat store by main
+    question_embedding = bi_encoder.encode(query, convert_to_tensor=True, device=device, normalize_embeddings=True)
+    return question_embedding.to('cpu', torch.float32).numpy()
+
+
+def semantic_search_batch(queries: List[str]) -> Tuple[np.ndarray, np.ndarray]:
+    # Queries collected by the batch executor of main, encoded and searched at once, one row per query
+    question_embeddings = bi_encoder.encode(queries, convert_to_tensor=True, device=device)
+    ids, scores = search_embeddings(question_embeddings)
+    return ids.numpy(), scores.numpy()
+
+
+def encode_queries(queries: List[str]) -> np.ndarray:
+    # Batched encode_query, one row per query
+    question_embeddings = bi_encoder.encode(queries, convert_to_tensor=True, device=device, normalize_embeddings=True)
+    return question_embeddings.to('cpu', torch.float32).numpy()
 
 
-def rerank_inplace(query_doc_pairs: List[List[str]], results: List[Dict]):
-    cross_scores = cross_encoder.predict(query_doc_pairs)
-    for result, cross_score in zip(results, cross_scores):
-        result['score'] = cross_score
-    results.sort(key=lambda x: x['score'], reverse=True)
+def rerank(query_doc_pairs: List[List[str]]) -> np.ndarray:
+    # float32 cross-encoder score of each pair, main sorts the results by them
+    return cross_encoder.predict(query_doc_pairs, convert_to_numpy=True).astype(np.float32)
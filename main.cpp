@@ -5,9 +5,40 @@
 #include <unordered_set>
 #include <list>
 #include <algorithm>
+#include <memory>
+#include <bit>
 #include <cmath>
 #include <csignal>
+#include <mutex>
+#include <thread>
+#include <atomic>
+#include <filesystem>
+#include <condition_variable>
+#include <functional>
+#include <deque>
+#include <queue>
+#include <shared_mutex>
+#include <future>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#endif
+#ifdef __linux__
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#undef BLOCK_SIZE  // defined by linux/fs.h
+#endif
 #include <Python.h>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 #include "httplib.h"
 #include "json.hpp"
 
@@ -26,6 +57,8 @@ using std::unordered_set;
 using std::list;
 using std::shared_ptr;
 using std::make_shared;
+using std::unique_ptr;
+using std::make_unique;
 using std::sort;
 using std::min;
 using std::max;
@@ -33,14 +66,30 @@ using std::max;
 #ifdef _MSC_VER
 #define ftell64 _ftelli64
 #define fseek64 _fseeki64
+#define O_BINARY_FLAG _O_BINARY
 #else
 #define ftell64 ftello64
 #define fseek64 fseeko64
+#define O_BINARY_FLAG 0
 #endif
 
+constexpr unsigned POSTING_BLOCK_SIZE = 128;
+
+// Postings kept in vbyte form, in blocks of POSTING_BLOCK_SIZE that can be skipped or decoded one at a time.
+// Gaps of doc ids restart at each block, from the last doc id of the previous block.
+struct CompressedPostings {
+    vector<unsigned> block_last_ids;
+    vector<unsigned> ids_offsets, freqs_offsets;  // where each block begins in ids_bytes and freqs_bytes
+    vector<unsigned> offsets_offsets;  // where each block begins in offsets_bytes, empty without offsets
+    vector<unsigned char> ids_bytes, freqs_bytes, offsets_bytes;
+};
+
 struct Entry {
     string term;
-    vector<unsigned> doc_ids, freqs;
+    vector<unsigned> doc_ids, freqs;  // empty if the postings are kept compressed
+    vector<unsigned> offsets;  // byte offset of the first occurrence of the term in each doc, empty without --offsets
+    unsigned doc_cnt = 0;
+    unique_ptr<CompressedPostings> compressed;
 
     bool operator<(const Entry &rhs) const {
         return term < rhs.term || (term == rhs.term && doc_ids < rhs.doc_ids);
@@ -53,9 +102,33 @@ struct Entry {
 
 using EntryP = shared_ptr<Entry>;
 
+// Word positions of every posting of a term in vbyte form, freq of them for each posting, each relative to the
+// previous one in the same doc. A posting is found by its ordinal: its block of POSTING_BLOCK_SIZE postings begins
+// at block_offsets, and the positions of the postings before it in the block are skipped using their freqs.
+struct PositionList {
+    vector<unsigned char> bytes;
+    vector<unsigned> block_offsets;
+};
+
+// A quoted phrase of a query, whose words must be adjacent and in order, or only within window words of
+// each other if the phrase is followed by ~window
+struct Phrase {
+    vector<string> terms;  // in query order, may repeat
+    int window = 0;  // 0 for an exact phrase
+
+    bool operator<(const Phrase &rhs) const {
+        return terms < rhs.terms || (terms == rhs.terms && window < rhs.window);
+    }
+
+    bool operator==(const Phrase &rhs) const = default;
+};
+
 struct StorageInfo {
     long long ids_begin = 0, freqs_begin = 0;
+    long long ids_end = 0, freqs_end = 0;  // not in the lexicon, see set_storage_ends()
     unsigned doc_cnt = 0;
+    long long offsets_begin = -1, offsets_end = -1;  // from the offsets lexicon, -1 without --offsets
+    long long positions_begin = -1, positions_end = -1;  // from the positions lexicon, -1 without --positions
 };
 
 unordered_map<string, StorageInfo> storage_info;
@@ -68,110 +141,774 @@ struct DocInfo {
 
 vector<DocInfo> docs_info;
 
-struct ResultDocInfo {
-    double score = 0;
-    shared_ptr<vector<pair<string, unsigned>>> freqs = make_shared<vector<pair<string, unsigned>>>();
+// Result of a query, kept compact since it is cached: the top docs with their scores, the number of matched docs,
+// and the freqs of the query terms in each top doc, with each term stored once and referred to by its index.
+struct ResultDocInfos {
+    vector<unsigned> doc_ids;
+    vector<float> scores;
+    vector<string> terms;  // empty if the searcher does not report freqs
+    vector<unsigned> freqs;  // freqs[i * terms.size() + t] is the freq of terms[t] in doc_ids[i], 0 if it is absent
+    size_t count = 0;  // number of matched docs, may be larger than size() if only the top ones are kept
+
+    size_t size() const {
+        return doc_ids.size();
+    }
+
+    // whether the first n results are all kept
+    bool covers(size_t n) const {
+        return size() >= n || size() == count;
+    }
+};
+
+// Everything a single query writes to, so that queries can run concurrently on the server threads.
+struct QueryContext {
+    vector<string> query_list;
+    vector<Phrase> phrases;
+    vector<EntryP> entries;
+    vector<char *> words;
+    vector<char> doc_content, tokenize_buffer;
+    vector<vector<char>> batch_contents;  // docs read by a ReadBatch
+};
+
+// Approximate memory held by a cached value, used to bound caches by bytes instead of by entry count
+size_t cache_charge(const Entry &entry) {
+    size_t charge = sizeof(Entry) + entry.term.capacity() +
+                    (entry.doc_ids.capacity() + entry.freqs.capacity() + entry.offsets.capacity()) * sizeof(unsigned);
+    if (entry.compressed) {
+        const auto &compressed = *entry.compressed;
+        charge += sizeof(CompressedPostings) + compressed.ids_bytes.capacity() + compressed.freqs_bytes.capacity() +
+                  compressed.offsets_bytes.capacity() +
+                  (compressed.block_last_ids.capacity() + compressed.ids_offsets.capacity() +
+                   compressed.freqs_offsets.capacity() + compressed.offsets_offsets.capacity()) * sizeof(unsigned);
+    }
+    return charge;
+}
+
+size_t cache_charge(const PositionList &list) {
+    return sizeof(PositionList) + list.bytes.capacity() + list.block_offsets.capacity() * sizeof(unsigned);
+}
+
+size_t cache_charge(const ResultDocInfos &infos) {
+    size_t charge = sizeof(ResultDocInfos) + (infos.doc_ids.capacity() + infos.freqs.capacity()) * sizeof(unsigned) +
+                    infos.scores.capacity() * sizeof(float) + infos.terms.capacity() * sizeof(string);
+    for (const auto &term: infos.terms) {
+        charge += term.capacity();
+    }
+    return charge;
+}
+
+// A final response with its snippets, kept by its serialized size
+struct RenderedResult {
+    json result;
+    size_t n_bytes = 0;
+};
+
+size_t cache_charge(const RenderedResult &rendered) {
+    return sizeof(RenderedResult) + rendered.n_bytes;
+}
+
+// Score of a doc for a query by the cross-encoder
+struct CrossScore {
+    float score;
+};
+
+size_t cache_charge(const CrossScore &) {
+    return sizeof(CrossScore);
+}
+
+// Embedding of a query by the bi-encoder
+struct QueryEmbedding {
+    vector<float> values;
+};
+
+size_t cache_charge(const QueryEmbedding &embedding) {
+    return sizeof(QueryEmbedding) + embedding.values.capacity() * sizeof(float);
+}
+
+struct CacheStats {
+    size_t hits = 0, misses = 0, evictions = 0, bytes = 0, items = 0;
+};
+
+NLOHMANN_DEFINE_TYPE_NON_INTRUSIVE(CacheStats, hits, misses, evictions, bytes, items)
+
+enum class CachePolicy {
+    LRU, TINY_LFU
 };
 
-using ResultDocInfos = vector<pair<unsigned, ResultDocInfo>>;
+// Count-min sketch of how often keys are requested, with 4 rows of 8-bit counters.
+// All counters are halved after every 10 * width increments, so that old popularity fades.
+class FrequencySketch {
+private:
+    static constexpr unsigned long long SEEDS[4] = {
+            0x9e3779b97f4a7c15ULL, 0xbf58476d1ce4e5b9ULL, 0x94d049bb133111ebULL, 0xd6e8feb86659fd93ULL};
+    size_t width;  // power of 2
+    vector<unsigned char> counters;  // 4 rows of width counters
+    size_t increments = 0;
+
+    size_t index(size_t hash, int row) const {
+        return row * width + (size_t) (((unsigned long long) hash * SEEDS[row]) >> 32) % width;
+    }
+
+public:
+    explicit FrequencySketch(size_t width) : width(std::bit_ceil(width)), counters(4 * this->width) {}
+
+    void increment(size_t hash) {
+        for (int row = 0; row < 4; row++) {
+            auto &counter = counters[index(hash, row)];
+            counter += counter < 255;
+        }
+        if (++increments >= 10 * width) {
+            for (auto &counter: counters) {
+                counter >>= 1;
+            }
+            increments = 0;
+        }
+    }
+
+    unsigned estimate(size_t hash) const {
+        unsigned frequency = 255;
+        for (int row = 0; row < 4; row++) {
+            frequency = min(frequency, (unsigned) counters[index(hash, row)]);
+        }
+        return frequency;
+    }
+};
 
+// Cache shared by all queries and bounded by the total cache_charge() of its values.
+// Keys are spread over shards by hash, each with its own lock and share of the budget,
+// so that concurrent queries rarely wait for each other. A hit is a single hash lookup.
+//
+// With CachePolicy::LRU, each shard is a plain LRU list. With CachePolicy::TINY_LFU (W-TinyLFU),
+// new items enter a small LRU window, and an item leaving the window is only admitted to the main LRU list
+// if its estimated frequency times its cost beats that of the main items it would evict, so one-off keys
+// cannot flush popular ones. The cost passed to put() is how expensive the value is to recompute.
 template<typename T>
-class LRUCache {
+class ShardedCache {
 private:
-    int capacity;
-    unordered_map<string, pair<shared_ptr<T>, list<string>::iterator>> cache;
-    list<string> lruList;
+    static constexpr size_t WINDOW_PERCENT = 1;
+
+    struct Item {
+        string key;
+        shared_ptr<T> value;
+        size_t charge;
+        size_t hash;
+        double cost;
+        bool in_window;
+    };
+
+    struct Shard {
+        std::mutex mutex;
+        list<Item> window, main;  // most recently used first, only window is used by LRU
+        unordered_map<string, typename list<Item>::iterator> items;
+        size_t window_bytes = 0, main_bytes = 0;
+        FrequencySketch sketch;
+
+        explicit Shard(size_t sketch_width) : sketch(sketch_width) {}
+    };
+
+    CachePolicy policy;
+    size_t shard_capacity, window_capacity;
+    vector<unique_ptr<Shard>> shards;
+    std::atomic<size_t> hits = 0, misses = 0, evictions = 0;
+
+    Shard &shard_of(size_t hash) {
+        return *shards[hash % shards.size()];
+    }
+
+    void remove(Shard &shard, typename list<Item>::iterator it) {
+        (it->in_window ? shard.window_bytes : shard.main_bytes) -= it->charge;
+        shard.items.erase(it->key);
+        (it->in_window ? shard.window : shard.main).erase(it);
+    }
+
+    // Move the least recent items of the window to the main list while the window is over its budget,
+    // each one either admitted by evicting main items of less value, or evicted itself.
+    void drain_window(Shard &shard) {
+        while (shard.window_bytes > window_capacity) {
+            auto candidate = std::prev(shard.window.end());
+            size_t main_capacity = shard_capacity - window_capacity;
+            double candidate_value = shard.sketch.estimate(candidate->hash) * candidate->cost;
+            double victims_value = 0;
+            size_t freed = 0;
+            auto victim = shard.main.end();
+            while (shard.main_bytes - freed + candidate->charge > main_capacity && victim != shard.main.begin()) {
+                --victim;
+                freed += victim->charge;
+                victims_value += shard.sketch.estimate(victim->hash) * victim->cost;
+            }
+            if (shard.main_bytes - freed + candidate->charge > main_capacity || candidate_value <= victims_value) {
+                remove(shard, candidate);
+                evictions++;
+                continue;
+            }
+            while (victim != shard.main.end()) {
+                remove(shard, victim++);
+                evictions++;
+            }
+            shard.window_bytes -= candidate->charge;
+            shard.main_bytes += candidate->charge;
+            candidate->in_window = false;
+            shard.main.splice(shard.main.begin(), shard.window, candidate);
+        }
+    }
 
 public:
-    explicit LRUCache(int capacity) : capacity(capacity) {}
+    explicit ShardedCache(size_t capacity, CachePolicy policy = CachePolicy::LRU, size_t n_shards = 16) :
+            policy(policy), shard_capacity(capacity / n_shards),
+            window_capacity(policy == CachePolicy::LRU ? shard_capacity : shard_capacity * WINDOW_PERCENT / 100) {
+        // about one counter per 4 KiB of budget, the policy does not matter much outside this range
+        size_t sketch_width = policy == CachePolicy::LRU ? 1 : std::clamp(shard_capacity >> 12, (size_t) 1024, (size_t) 1 << 20);
+        for (size_t i = 0; i < n_shards; i++) {
+            shards.push_back(make_unique<Shard>(sketch_width));
+        }
+    }
 
     shared_ptr<T> get(const string &key) {
-        if (cache.find(key) != cache.end()) {
-            lruList.erase(cache[key].second);
-            lruList.push_front(key);
-            cache[key].second = lruList.begin();
-            return cache[key].first;
-        } else {
+        size_t hash = std::hash<string>()(key);
+        Shard &shard = shard_of(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        if (policy == CachePolicy::TINY_LFU) {
+            shard.sketch.increment(hash);
+        }
+        auto it = shard.items.find(key);
+        if (it == shard.items.end()) {
+            misses++;
             return nullptr;
         }
+        hits++;
+        auto &list = it->second->in_window ? shard.window : shard.main;
+        list.splice(list.begin(), list, it->second);
+        return it->second->value;
     }
 
-    void put(const string &key, const shared_ptr<T> &value) {
-        if (cache.find(key) != cache.end()) {
-            lruList.erase(cache[key].second);
-        } else if (cache.size() >= capacity) {
-            string leastRecent = lruList.back();
-            lruList.pop_back();
-            cache.erase(leastRecent);
+    void put(const string &key, const shared_ptr<T> &value, double cost = 1) {
+        size_t charge = sizeof(Item) + key.capacity() + (value ? cache_charge(*value) : 0);
+        if (charge > shard_capacity) {  // would evict everything else in its shard
+            return;
         }
-        lruList.push_front(key);
-        cache[key] = {value, lruList.begin()};
+        size_t hash = std::hash<string>()(key);
+        Shard &shard = shard_of(hash);
+        std::lock_guard<std::mutex> lock(shard.mutex);
+        auto it = shard.items.find(key);
+        if (it != shard.items.end()) {
+            remove(shard, it->second);
+        }
+        shard.window.push_front({key, value, charge, hash, cost, true});
+        shard.items.emplace(key, shard.window.begin());
+        shard.window_bytes += charge;
+        if (policy == CachePolicy::TINY_LFU) {
+            drain_window(shard);
+            return;
+        }
+        while (shard.window_bytes > shard_capacity) {
+            remove(shard, std::prev(shard.window.end()));
+            evictions++;
+        }
+    }
+
+    void clear() {
+        for (auto &shard: shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            shard->items.clear();
+            shard->window.clear();
+            shard->main.clear();
+            shard->window_bytes = shard->main_bytes = 0;
+        }
+    }
+
+    CacheStats stats() {
+        CacheStats stats{hits, misses, evictions};
+        for (auto &shard: shards) {
+            std::lock_guard<std::mutex> lock(shard->mutex);
+            stats.bytes += shard->window_bytes + shard->main_bytes;
+            stats.items += shard->items.size();
+        }
+        return stats;
     }
 };
 
-FILE *ids_fp, *freqs_fp, *dataset_fp;
-unordered_map<unsigned, ResultDocInfo> infos;
-vector<EntryP> entries;
-char *doc_content, *tokenize_buffer, *home_page_buffer;
-size_t buf_size = 2064927;
+int ids_fd = -1, freqs_fd = -1, dataset_fd = -1;
+int offsets_fd = -1;  // first occurrence offsets, only with --offsets
+int positions_fd = -1;  // word positions, only with --positions
+// With --resident, the index files are loaded at startup into one arena and never read again
+unsigned char *resident_arena = nullptr;
+size_t resident_arena_size = 0;
+bool resident_huge_pages = false;  // if the arena was mapped on explicit huge pages
+vector<pair<int, const unsigned char *>> resident_files;  // fd and where its content begins in the arena
+char *home_page_buffer;
 class Searcher *searcher;
 httplib::Server svr;
 
-void read_index_bin(long long ids_begin, long long freqs_begin,
-                    unsigned count, EntryP &entry) {
-    fseek64(ids_fp, ids_begin, SEEK_SET);
+int open_guarded(const string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY | O_BINARY_FLAG);
+    if (fd < 0) {
+        perror(("Failed to open file " + filename).c_str());
+        exit(EXIT_FAILURE);
+    }
+    return fd;
+}
+
+// Read size bytes at offset without moving a shared file position, so that threads can read the same file.
+void pread_guarded(int fd, void *buf, size_t size, long long offset) {
+    auto p = (char *) buf;
+    while (size > 0) {
+#ifdef _MSC_VER
+        OVERLAPPED overlapped{};
+        overlapped.Offset = (DWORD) offset;
+        overlapped.OffsetHigh = (DWORD) (offset >> 32);
+        DWORD n = 0;
+        auto chunk = (DWORD) min(size, (size_t) 1 << 30);
+        if (!ReadFile((HANDLE) _get_osfhandle(fd), p, chunk, &n, &overlapped) || n == 0) {
+            cerr << "Failed to read at offset " << offset << endl;
+            exit(EXIT_FAILURE);
+        }
+#else
+        ssize_t n = pread(fd, p, size, (off_t) offset);
+        if (n <= 0) {
+            perror("Failed to read file");
+            exit(EXIT_FAILURE);
+        }
+#endif
+        p += n;
+        size -= n;
+        offset += n;
+    }
+}
+
+// Content of an index file in the resident arena, or nullptr if it is read from the file
+const unsigned char *resident_data(int fd) {
+    for (const auto &[resident_fd, data]: resident_files) {
+        if (resident_fd == fd) {
+            return data;
+        }
+    }
+    return nullptr;
+}
+
+// Read from an index file, or copy from the arena if it is resident
+void read_index_file(int fd, void *buf, size_t size, long long offset) {
+    auto data = resident_data(fd);
+    if (data != nullptr) {
+        memcpy(buf, data + offset, size);
+    } else {
+        pread_guarded(fd, buf, size, offset);
+    }
+}
+
+// How the reads of a ReadBatch are issued, chosen once at startup
+enum class IoBackend {
+    SERIAL, POOL, URING
+};
+
+IoBackend io_backend = IoBackend::SERIAL;
+
+// Threads that run tasks for all queries: blocking reads for IoBackend::POOL, and partitions of flat scans
+class ThreadPool {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::deque<std::function<void()>> tasks;
+    vector<std::thread> threads;
+    bool stopping = false;
+
+public:
+    explicit ThreadPool(int n_threads) {
+        for (int i = 0; i < n_threads; i++) {
+            threads.emplace_back([this] {
+                while (true) {
+                    std::function<void()> task;
+                    {
+                        std::unique_lock<std::mutex> lock(mutex);
+                        cv.wait(lock, [this] { return stopping || !tasks.empty(); });
+                        if (tasks.empty()) {
+                            return;
+                        }
+                        task = std::move(tasks.front());
+                        tasks.pop_front();
+                    }
+                    task();
+                }
+            });
+        }
+    }
+
+    ~ThreadPool() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_all();
+        for (auto &thread: threads) {
+            thread.join();
+        }
+    }
+
+    void post(std::function<void()> task) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            tasks.push_back(std::move(task));
+        }
+        cv.notify_one();
+    }
+};
+
+unique_ptr<ThreadPool> io_pool;
+
+#ifdef __linux__
+// A minimal io_uring on the raw system calls, so that no library is needed. Each thread has its own ring.
+class Uring {
+private:
+    int ring_fd = -1;
+    unsigned entries = 0;
+    void *sq_ptr = MAP_FAILED, *cq_ptr = MAP_FAILED;
+    size_t sq_size = 0, cq_size = 0, sqes_size = 0;
+    io_uring_sqe *sqes = (io_uring_sqe *) MAP_FAILED;
+    std::atomic<unsigned> *sq_tail = nullptr, *cq_head = nullptr, *cq_tail = nullptr;
+    unsigned *sq_mask = nullptr, *sq_array = nullptr, *cq_mask = nullptr;
+    io_uring_cqe *cqes = nullptr;
+    unsigned to_submit = 0;
+
+public:
+    static constexpr unsigned ENTRIES = 64;
+
+    Uring() {
+        io_uring_params params{};
+        ring_fd = (int) syscall(__NR_io_uring_setup, ENTRIES, &params);
+        if (ring_fd < 0) {
+            return;
+        }
+        if (!supports_read()) {
+            close(ring_fd);
+            ring_fd = -1;
+            return;
+        }
+        entries = params.sq_entries;
+        sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+        cq_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            sq_size = cq_size = max(sq_size, cq_size);
+        }
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED) {
+            return;
+        }
+        if (params.features & IORING_FEAT_SINGLE_MMAP) {
+            cq_ptr = sq_ptr;
+        } else {
+            cq_ptr = mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+            if (cq_ptr == MAP_FAILED) {
+                return;
+            }
+        }
+        sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        sqes = (io_uring_sqe *) mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                                     ring_fd, IORING_OFF_SQES);
+        auto sq = (char *) sq_ptr, cq = (char *) cq_ptr;
+        sq_tail = (std::atomic<unsigned> *) (sq + params.sq_off.tail);
+        sq_mask = (unsigned *) (sq + params.sq_off.ring_mask);
+        sq_array = (unsigned *) (sq + params.sq_off.array);
+        cq_head = (std::atomic<unsigned> *) (cq + params.cq_off.head);
+        cq_tail = (std::atomic<unsigned> *) (cq + params.cq_off.tail);
+        cq_mask = (unsigned *) (cq + params.cq_off.ring_mask);
+        cqes = (io_uring_cqe *) (cq + params.cq_off.cqes);
+    }
+
+    ~Uring() {
+        if (sqes != MAP_FAILED) {
+            munmap(sqes, sqes_size);
+        }
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr) {
+            munmap(cq_ptr, cq_size);
+        }
+        if (sq_ptr != MAP_FAILED) {
+            munmap(sq_ptr, sq_size);
+        }
+        if (ring_fd >= 0) {
+            close(ring_fd);
+        }
+    }
+
+    bool ok() const {
+        return sqes != MAP_FAILED;
+    }
+
+    // Kernels before 5.6 have io_uring but fail every IORING_OP_READ, and they cannot be probed either
+    bool supports_read() const {
+        constexpr unsigned N_OPS = 256;
+        vector<char> buf(sizeof(io_uring_probe) + N_OPS * sizeof(io_uring_probe_op));  // zeroed, as the kernel needs
+        auto probe = (io_uring_probe *) buf.data();
+        if (syscall(__NR_io_uring_register, ring_fd, IORING_REGISTER_PROBE, probe, N_OPS) < 0) {
+            return false;
+        }
+        return IORING_OP_READ <= probe->last_op && (probe->ops[IORING_OP_READ].flags & IO_URING_OP_SUPPORTED);
+    }
+
+    unsigned capacity() const {
+        return entries;
+    }
+
+    // Queue a read, which is only submitted by the next enter()
+    void prepare_read(int fd, void *buf, unsigned size, long long offset, unsigned long long user_data) {
+        unsigned tail = sq_tail->load(std::memory_order_relaxed);
+        unsigned index = tail & *sq_mask;
+        io_uring_sqe &sqe = sqes[index];
+        memset(&sqe, 0, sizeof(sqe));
+        sqe.opcode = IORING_OP_READ;
+        sqe.fd = fd;
+        sqe.addr = (unsigned long long) buf;
+        sqe.len = size;
+        sqe.off = (unsigned long long) offset;
+        sqe.user_data = user_data;
+        sq_array[index] = index;
+        sq_tail->store(tail + 1, std::memory_order_release);
+        to_submit++;
+    }
+
+    // Submit the queued reads, and wait for at least min_complete completions
+    void enter(unsigned min_complete) {
+        while (true) {
+            long ret = syscall(__NR_io_uring_enter, ring_fd, to_submit, min_complete,
+                               min_complete > 0 ? IORING_ENTER_GETEVENTS : 0, nullptr, 0);
+            if (ret >= 0) {
+                to_submit -= (unsigned) ret;
+                return;
+            }
+            if (errno != EINTR) {
+                perror("Failed to submit reads");
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+
+    // Call f(user_data, res) for every completion available
+    template<typename F>
+    void reap(F &&f) {
+        unsigned head = cq_head->load(std::memory_order_relaxed);
+        unsigned tail = cq_tail->load(std::memory_order_acquire);
+        for (; head != tail; head++) {
+            const io_uring_cqe &cqe = cqes[head & *cq_mask];
+            f(cqe.user_data, cqe.res);
+        }
+        cq_head->store(head, std::memory_order_release);
+    }
+};
+
+Uring *thread_uring() {
+    thread_local Uring uring;
+    return uring.ok() ? &uring : nullptr;
+}
+#endif
+
+// Reads that are issued at once and waited for one by one, so that a query does not wait for each of its
+// documents in turn, and works on the first ones while the others are still being read.
+// A thread must wait for its batch before it starts another one.
+class ReadBatch {
+private:
+    struct Request {
+        int fd;
+        char *buf;
+        size_t size;
+        long long offset;
+    };
+
+    vector<Request> requests;
+    unique_ptr<std::atomic<bool>[]> done;
+    size_t n_done = 0;
+    std::mutex mutex;  // for the pool threads
+    std::condition_variable cv;
+#ifdef __linux__
+    Uring *uring = nullptr;
+    size_t next_submit = 0, in_flight = 0;
+
+    void submit_more() {
+        while (next_submit < requests.size() && in_flight < uring->capacity()) {
+            auto &request = requests[next_submit];
+            uring->prepare_read(request.fd, request.buf, (unsigned) min(request.size, (size_t) 1 << 30),
+                                request.offset, next_submit);
+            next_submit++;
+            in_flight++;
+        }
+    }
+#endif
+
+    void complete(size_t i) {
+        std::lock_guard<std::mutex> lock(mutex);
+        done[i].store(true, std::memory_order_release);
+        n_done++;
+        cv.notify_all();
+    }
+
+public:
+    ReadBatch() = default;
+
+    ReadBatch(const ReadBatch &) = delete;
+
+    ~ReadBatch() {
+        // buffers must not be written after they are freed
+        for (size_t i = 0; done && i < requests.size(); i++) {
+            wait(i);
+        }
+    }
+
+    void add(int fd, void *buf, size_t size, long long offset) {
+        requests.push_back({fd, (char *) buf, size, offset});
+    }
+
+    size_t size() const {
+        return requests.size();
+    }
+
+    void submit() {
+        if (requests.empty()) {
+            return;
+        }
+        done = make_unique<std::atomic<bool>[]>(requests.size());
+        if (io_backend == IoBackend::POOL) {
+            for (size_t i = 0; i < requests.size(); i++) {
+                io_pool->post([this, i] {
+                    auto &request = requests[i];
+                    pread_guarded(request.fd, request.buf, request.size, request.offset);
+                    complete(i);
+                });
+            }
+        }
+#ifdef __linux__
+        if (io_backend == IoBackend::URING && (uring = thread_uring()) != nullptr) {
+            submit_more();
+            uring->enter(0);
+        }
+#endif
+    }
+
+    // Block until the i-th read is complete
+    void wait(size_t i) {
+        if (done[i].load(std::memory_order_acquire)) {
+            return;
+        }
+        if (io_backend == IoBackend::POOL) {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this, i] { return done[i].load(std::memory_order_acquire); });
+            return;
+        }
+#ifdef __linux__
+        if (uring != nullptr) {
+            while (!done[i].load(std::memory_order_relaxed)) {
+                uring->enter(1);
+                uring->reap([this](unsigned long long j, int res) {
+                    auto &request = requests[j];
+                    if (res < 0) {
+                        errno = -res;
+                        perror("Failed to read file");
+                        exit(EXIT_FAILURE);
+                    }
+                    if ((size_t) res < request.size) {  // short read, finish it here
+                        pread_guarded(request.fd, request.buf + res, request.size - res, request.offset + res);
+                    }
+                    in_flight--;
+                    done[j].store(true, std::memory_order_relaxed);
+                });
+                submit_more();
+            }
+            return;
+        }
+#endif
+        auto &request = requests[i];  // serial
+        pread_guarded(request.fd, request.buf, request.size, request.offset);
+        done[i].store(true, std::memory_order_relaxed);
+    }
+};
+
+// Bytes of an entry in the index files, in the resident arena or in buffers read by a ReadBatch together
+// with the other entries of a query
+struct EntryBytes {
+    const unsigned char *ids = nullptr, *freqs = nullptr, *offsets = nullptr;
+    vector<unsigned char> ids_buf, freqs_buf, offsets_buf;
+};
+
+// Point at the bytes of an entry, adding the reads of the files that are not resident to a batch.
+// The byte ranges are the same whatever the index type is.
+void add_entry_reads(ReadBatch &batch, const StorageInfo &info, EntryBytes &bytes) {
+    auto add = [&batch](int fd, long long begin, long long end, vector<unsigned char> &buf) {
+        auto data = resident_data(fd);
+        if (data != nullptr) {
+            return data + begin;
+        }
+        buf.resize(end - begin);
+        batch.add(fd, buf.data(), buf.size(), begin);
+        return (const unsigned char *) buf.data();
+    };
+    bytes.ids = add(ids_fd, info.ids_begin, info.ids_end, bytes.ids_buf);
+    bytes.freqs = add(freqs_fd, info.freqs_begin, info.freqs_end, bytes.freqs_buf);
+    if (offsets_fd >= 0 && info.offsets_begin >= 0) {
+        bytes.offsets = add(offsets_fd, info.offsets_begin, info.offsets_end, bytes.offsets_buf);
+    }
+}
+
+void decode_index_bin(const StorageInfo &info, const EntryBytes &bytes, Entry &entry) {
+    entry.doc_ids.resize(info.doc_cnt);
+    memcpy(entry.doc_ids.data(), bytes.ids, info.doc_cnt * sizeof(unsigned));
     unsigned prev_doc_id = 0;
-    unsigned doc_id = 0;
-    for (unsigned i = 0; i < count; i++) {
-        fread(&doc_id, sizeof(unsigned), 1, ids_fp);
+    for (auto &doc_id: entry.doc_ids) {
         doc_id += prev_doc_id;
-        entry->doc_ids.push_back(doc_id);
         prev_doc_id = doc_id;
     }
-    fseek64(freqs_fp, freqs_begin, SEEK_SET);
-    entry->freqs.resize(count);
-    fread(entry->freqs.data(), sizeof(unsigned), count, freqs_fp);
+    entry.freqs.resize(info.doc_cnt);
+    memcpy(entry.freqs.data(), bytes.freqs, info.doc_cnt * sizeof(unsigned));
+    if (bytes.offsets != nullptr) {
+        entry.offsets.resize(info.doc_cnt);
+        memcpy(entry.offsets.data(), bytes.offsets, info.doc_cnt * sizeof(unsigned));
+    }
 }
 
-void read_index_vbyte(long long ids_begin, long long freqs_begin,
-                      unsigned count, EntryP &entry) {
-    fseek64(ids_fp, ids_begin, SEEK_SET);
-    unsigned prev_doc_id = 0;
-    unsigned doc_id = 0;
-    unsigned shift = 0;
-    for (unsigned i = 0; i < count;) {
-        unsigned char byte;
-        fread(&byte, sizeof(unsigned char), 1, ids_fp);
-        doc_id |= (byte & 0x7f) << shift;
-        if (byte & 0x80) {
-            doc_id += prev_doc_id;
-            entry->doc_ids.push_back(doc_id);
-            prev_doc_id = doc_id;
-            doc_id = 0;
-            shift = 0;
-            i++;
-        } else {
-            shift += 7;
+void decode_index_vbyte(const StorageInfo &info, const EntryBytes &bytes, Entry &entry) {
+    auto decode = [&info](const unsigned char *column, vector<unsigned> &values, bool delta) {
+        values.reserve(info.doc_cnt);
+        unsigned prev_value = 0;
+        unsigned value = 0;
+        unsigned shift = 0;
+        size_t pos = 0;
+        for (unsigned i = 0; i < info.doc_cnt;) {
+            unsigned char byte = column[pos++];
+            value |= (byte & 0x7f) << shift;
+            if (byte & 0x80) {
+                if (delta) {
+                    value += prev_value;
+                    prev_value = value;
+                }
+                values.push_back(value);
+                value = 0;
+                shift = 0;
+                i++;
+            } else {
+                shift += 7;
+            }
         }
+    };
+    decode(bytes.ids, entry.doc_ids, true);
+    decode(bytes.freqs, entry.freqs, false);
+    if (bytes.offsets != nullptr) {
+        decode(bytes.offsets, entry.offsets, false);
     }
-    fseek64(freqs_fp, freqs_begin, SEEK_SET);
-    unsigned freq = 0;
-    shift = 0;
-    for (unsigned i = 0; i < count;) {
-        unsigned char byte;
-        fread(&byte, sizeof(unsigned char), 1, freqs_fp);
-        freq |= (byte & 0x7f) << shift;
-        if (byte & 0x80) {
-            entry->freqs.push_back(freq);
-            freq = 0;
-            shift = 0;
-            i++;
-        } else {
-            shift += 7;
+}
+
+// Position lists are kept in vbyte form in memory whatever the index type is
+void read_positions_bin(const StorageInfo &info, vector<unsigned char> &bytes) {
+    vector<unsigned> positions((info.positions_end - info.positions_begin) / sizeof(unsigned));
+    read_index_file(positions_fd, positions.data(), positions.size() * sizeof(unsigned), info.positions_begin);
+    for (auto position: positions) {
+        while (position >= 0x80) {
+            bytes.push_back(position & 0x7f);
+            position >>= 7;
         }
+        bytes.push_back(position | 0x80);
     }
 }
 
+void read_positions_vbyte(const StorageInfo &info, vector<unsigned char> &bytes) {
+    bytes.resize(info.positions_end - info.positions_begin);
+    read_index_file(positions_fd, bytes.data(), bytes.size(), info.positions_begin);
+}
+
 int get_utf8_char_len(const char *s, const char *end) {
     if ((*s & 0x80) == 0) { // 0xxxxxxx is 1 byte character
         return 1;
@@ -215,6 +952,18 @@ void print_usage(char *program_name) {
     printf("Usage: %s [-h] [-d dataset_file] [-p doc_info_file] [-s storage_info_file]\n"
            "\t[-i index_ids_file] [-f index_freqs_file] [-t index_file_type] [-c corpus_id_to_doc_id_file]\n"
            "\t[-w server_port] [-q query_type] [-n n_results] [-l snippet_len] [-m cache_size]\n"
+           "\t[--cache-policy cache_policy] [--compressed-cache compressed_cache] [--result-cache result_cache_size]\n"
+           "\t[--impact-index impact_index_file] [--impact-storage impact_storage_info_file]\n"
+           "\t[--posting-budget posting_budget] [--time-budget time_budget] [--stress n_threads]\n"
+           "\t[--offsets offsets_file] [--offsets-storage offsets_storage_info_file]\n"
+           "\t[--positions positions_file] [--positions-storage positions_storage_info_file]\n"
+           "\t[--io io_backend] [--io-threads n_threads] [--resident resident]\n"
+           "\t[--hnsw hnsw_graph_file] [--embeddings embeddings_file] [--ef-search ef_search]\n"
+           "\t[--flat flat_store_file] [--flat-threads n_threads] [--flat-sketch-keep n_candidates]\n"
+           "\t[--flat-rescore n_candidates] [--batch-size batch_size] [--batch-window batch_window]\n"
+           "\t[--workers n_workers] [--worker-timeout worker_timeout] [--worker-python python_executable]\n"
+           "\t[--passage-len passage_len] [--semantic-cache similarity_threshold]\n"
+           "\t[--cascade n_candidates] [--cascade-from query_type]\n"
            "Options:\n"
            "\t-d\tdataset file, default: fulldocs-new.trec\n"
            "\t-p\tdoc info (page table) file, default: docs.txt\n"
@@ -224,15 +973,46 @@ void print_usage(char *program_name) {
            "\t-t\tindex file type (bin|vbyte), default: vbyte\n"
            "\t-c\tcorpus id to doc id file, default: corpus_id_to_doc_id.txt\n"
            "\t-w\tserver port ([0, 65535] for web, others for cli), default: 8080\n"
-           "\t-q\tquery type for cli (conjunctive|disjunctive|semantic|reranking), default: semantic\n"
+           "\t-q\tquery type for cli (conjunctive|disjunctive|semantic|reranking|impact|hybrid|cascade), default: semantic\n"
            "\t-n\tnumber of results, default: 10\n"
            "\t-l\tsnippet length, default: 200\n"
-           "\t-m\tcache size, default: 1000\n"
+           "\t-m\tindex entry cache size in MiB, a quarter of it caches positions with --positions and another quarter impact-ordered entries with --impact-index, default: 1024\n"
+           "\t--cache-policy\tindex entry cache policy (lru|tinylfu), default: lru\n"
+           "\t--compressed-cache\tkeep cached index entries compressed and decode them during queries (true|false), default: false\n"
+           "\t--result-cache\tresult cache size in MiB for each query type, split among the caches of its searcher, default: 64\n"
+           "\t--impact-index\timpact-ordered index file, enables impact queries, default: none\n"
+           "\t--impact-storage\timpact-ordered storage info (lexicon) file, default: storage_impact.txt\n"
+           "\t--posting-budget\tmax postings scored by an impact query (0 for no limit), default: 1000000\n"
+           "\t--time-budget\tmax microseconds spent by an impact query (0 for no limit), default: 0\n"
+           "\t--stress\tin cli mode, run the queries from stdin on n threads at once and check the results, default: 0 (off)\n"
+           "\t--offsets\tfirst occurrence offsets file from merge_index -f true, snippets then read only a window of each doc, default: none\n"
+           "\t--offsets-storage\tfirst occurrence offsets storage info (lexicon) file, default: storage_offsets_vbyte.txt\n"
+           "\t--positions\tword positions file from merge_index -r true, enables \"phrase\" and \"proximity\"~N queries, default: none\n"
+           "\t--positions-storage\tword positions storage info (lexicon) file, default: storage_positions_vbyte.txt\n"
+           "\t--io\thow the postings and docs of a query are read at once (uring|pool|serial), uring falls back to pool if it is not available, default: uring\n"
+           "\t--io-threads\tnumber of threads reading files for --io pool, default: 8\n"
+           "\t--resident\tload the index files into memory at startup and never read them again (true|false), default: false\n"
+           "\t--hnsw\tHNSW graph file from build_hnsw, semantic search then searches it instead of scanning all embeddings, default: none\n"
+           "\t--embeddings\tcorpus embeddings file from export_embeddings.py that the graph was built from, default: corpus_embeddings.f32\n"
+           "\t--ef-search\tcandidates kept by an HNSW search, more for a higher recall, default: 128\n"
+           "\t--flat\tint8 or fp16 store from quantize_embeddings, semantic search then scans it in C++ instead of Python, default: none\n"
+           "\t--flat-threads\tnumber of threads scanning the flat store, default: number of logical cores\n"
+           "\t--flat-sketch-keep\tcandidates kept by the sign sketch before the quantized scan (0 to scan all), default: 32768\n"
+           "\t--flat-rescore\tcandidates of the quantized scan re-scored with the float embeddings, default: 256\n"
+           "\t--batch-size\tmax concurrent queries encoded by one Python call (1 for a call per query), default: 1\n"
+           "\t--batch-window\tmicroseconds a batch waits for more queries after its first one, default: 2000\n"
+           "\t--workers\tnumber of model_worker.py processes running the models instead of the embedded Python (0 for none), default: 0\n"
+           "\t--worker-timeout\tmilliseconds a model worker may take for a request before it is restarted, default: 30000\n"
+           "\t--worker-python\tPython executable that runs the model workers, default: python3\n"
+           "\t--passage-len\twords of each doc reranked, around the most query words (0 for whole docs), default: 256\n"
+           "\t--semantic-cache\twith --hnsw or --flat, reuse the results of a recent query whose embedding has at least this cosine similarity (0 for none), default: 0\n"
+           "\t--cascade\tBM25 candidates of a cascade query re-scored by their embeddings in --embeddings, enables cascade queries (0 for none), default: 0\n"
+           "\t--cascade-from\tquery type of the BM25 candidates of cascade queries (conjunctive|disjunctive), default: disjunctive\n"
            "\t-h\thelp\n", program_name);
 }
 
 enum class QueryType {
-    CONJUNCTIVE, DISJUNCTIVE, SEMANTIC, RERANKING
+    CONJUNCTIVE, DISJUNCTIVE, SEMANTIC, RERANKING, IMPACT, HYBRID, CASCADE
 };
 
 struct Options {
@@ -243,15 +1023,47 @@ struct Options {
     const char *index_ids_path = "merged_index.vbyte";
     const char *index_freqs_path = "freqs.vbyte";
     const char *corpus_id_to_doc_id_path = "corpus_id_to_doc_id.txt";
-    // func pointer for read_index
-    decltype(read_index_vbyte) *read_index = read_index_vbyte;
+    // func pointer for decode_index
+    decltype(decode_index_vbyte) *decode_index = decode_index_vbyte;
+    decltype(read_positions_vbyte) *read_positions = read_positions_vbyte;
     int total_doc_cnt = 3213835;
     double avg_doc_len = 1172.448644;
     double k = 0.9, b = 0.4;
     QueryType query_type = QueryType::SEMANTIC;
     int n_results = 10;
     int snippet_len = 200;
-    int cache_size = 1000;
+    int cache_size = 1024;  // in MiB
+    CachePolicy cache_policy = CachePolicy::LRU;
+    bool compressed_cache = false;
+    int result_cache_size = 64;  // in MiB
+    const char *impact_index_path = nullptr;  // impact queries are disabled without it
+    const char *impact_storage_path = "storage_impact.txt";
+    long long posting_budget = 1000000;
+    long long time_budget = 0;  // in microseconds
+    int stress_threads = 0;
+    const char *offsets_path = nullptr;  // snippets read whole docs without it
+    const char *offsets_storage_path = "storage_offsets_vbyte.txt";
+    const char *positions_path = nullptr;  // phrases are searched as separate words without it
+    const char *positions_storage_path = "storage_positions_vbyte.txt";
+    IoBackend io_backend = IoBackend::URING;
+    int io_threads = 8;
+    bool resident = false;
+    const char *hnsw_path = nullptr;  // semantic search scans all embeddings in Python without it
+    const char *embeddings_path = "corpus_embeddings.f32";
+    int ef_search = 128;
+    const char *flat_path = nullptr;  // semantic search scans all embeddings in Python without it
+    int flat_threads = max((int) std::thread::hardware_concurrency(), 1);  // 0 if it is unknown
+    int flat_sketch_keep = 32768;
+    int flat_rescore = 256;
+    int batch_size = 1;  // queries are encoded on their own threads without batching
+    int batch_window = 2000;
+    int workers = 0;  // the models run in the embedded Python without workers
+    int worker_timeout = 30000;
+    const char *worker_python = "python3";
+    int passage_len = 256;
+    float semantic_cache = 0;  // only identical normalized queries share results without it
+    int cascade = 0;  // cascade queries are disabled without it
+    QueryType cascade_from = QueryType::DISJUNCTIVE;
 };
 
 Options parse_args(int argc, char *argv[]) {
@@ -270,11 +1082,19 @@ Options parse_args(int argc, char *argv[]) {
             else if (strcmp(option, "-i") == 0) options.index_ids_path = value;
             else if (strcmp(option, "-f") == 0) options.index_freqs_path = value;
             else if (strcmp(option, "-c") == 0) options.corpus_id_to_doc_id_path = value;
+            else if (strcmp(option, "--impact-index") == 0) options.impact_index_path = value;
+            else if (strcmp(option, "--impact-storage") == 0) options.impact_storage_path = value;
+            else if (strcmp(option, "--offsets") == 0) options.offsets_path = value;
+            else if (strcmp(option, "--offsets-storage") == 0) options.offsets_storage_path = value;
+            else if (strcmp(option, "--positions") == 0) options.positions_path = value;
+            else if (strcmp(option, "--positions-storage") == 0) options.positions_storage_path = value;
             else if (strcmp(option, "-t") == 0) {
                 if (strcmp(value, "bin") == 0) {
-                    options.read_index = read_index_bin;
+                    options.decode_index = decode_index_bin;
+                    options.read_positions = read_positions_bin;
                 } else if (strcmp(value, "vbyte") == 0) {
-                    options.read_index = read_index_vbyte;
+                    options.decode_index = decode_index_vbyte;
+                    options.read_positions = read_positions_vbyte;
                 } else {
                     cerr << "Invalid value for option -t: " << value << endl;
                     print_usage(argv[0]);
@@ -302,6 +1122,12 @@ Options parse_args(int argc, char *argv[]) {
                     options.query_type = QueryType::SEMANTIC;
                 } else if (strncmp(value, "reranking", strlen(value)) == 0) {
                     options.query_type = QueryType::RERANKING;
+                } else if (strncmp(value, "impact", strlen(value)) == 0) {
+                    options.query_type = QueryType::IMPACT;
+                } else if (strncmp(value, "hybrid", strlen(value)) == 0) {
+                    options.query_type = QueryType::HYBRID;
+                } else if (strncmp(value, "cascade", strlen(value)) == 0) {
+                    options.query_type = QueryType::CASCADE;
                 } else {
                     cerr << "Invalid value for option -q: " << value << endl;
                     print_usage(argv[0]);
@@ -321,37 +1147,289 @@ Options parse_args(int argc, char *argv[]) {
                     print_usage(argv[0]);
                     exit(EXIT_FAILURE);
                 }
-            } else {
-                cerr << "Unknown option: " << option << endl;
-                print_usage(argv[0]);
-                exit(EXIT_FAILURE);
-            }
-        } else {
-            cerr << "Missing value for option: " << argv[i] << endl;
-            print_usage(argv[0]);
-            exit(EXIT_FAILURE);
-        }
-    }
-    return options;
-}
-
-void read_storage_info(const char *filename) {
-    printf("Reading storage info from %s...", filename);
-    fflush(stdout);
-    ifstream fin(filename);
-    if (!fin.is_open()) {
-        cerr << "Failed to open file " << filename << endl;
-        exit(EXIT_FAILURE);
-    }
-    string term;
-    StorageInfo info;
-    while (fin >> term >> info.ids_begin >> info.freqs_begin >> info.doc_cnt) {
-        storage_info[term] = info;
+            } else if (strcmp(option, "--cache-policy") == 0) {
+                if (strcmp(value, "lru") == 0) {
+                    options.cache_policy = CachePolicy::LRU;
+                } else if (strcmp(value, "tinylfu") == 0) {
+                    options.cache_policy = CachePolicy::TINY_LFU;
+                } else {
+                    cerr << "Invalid value for option --cache-policy: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--compressed-cache") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.compressed_cache = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.compressed_cache = false;
+                } else {
+                    cerr << "Invalid value for option --compressed-cache: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--result-cache") == 0) {
+                options.result_cache_size = atoi(value);
+                if (options.result_cache_size <= 0) {
+                    cerr << "Invalid value for option --result-cache: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--posting-budget") == 0) {
+                options.posting_budget = atoll(value);
+                if (options.posting_budget < 0) {
+                    cerr << "Invalid value for option --posting-budget: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--time-budget") == 0) {
+                options.time_budget = atoll(value);
+                if (options.time_budget < 0) {
+                    cerr << "Invalid value for option --time-budget: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--io") == 0) {
+                if (strcmp(value, "uring") == 0) {
+                    options.io_backend = IoBackend::URING;
+                } else if (strcmp(value, "pool") == 0) {
+                    options.io_backend = IoBackend::POOL;
+                } else if (strcmp(value, "serial") == 0) {
+                    options.io_backend = IoBackend::SERIAL;
+                } else {
+                    cerr << "Invalid value for option --io: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--io-threads") == 0) {
+                options.io_threads = atoi(value);
+                if (options.io_threads <= 0) {
+                    cerr << "Invalid value for option --io-threads: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--hnsw") == 0) {
+                options.hnsw_path = value;
+            } else if (strcmp(option, "--embeddings") == 0) {
+                options.embeddings_path = value;
+            } else if (strcmp(option, "--ef-search") == 0) {
+                options.ef_search = atoi(value);
+                if (options.ef_search <= 0) {
+                    cerr << "Invalid value for option --ef-search: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--flat") == 0) {
+                options.flat_path = value;
+            } else if (strcmp(option, "--flat-threads") == 0) {
+                options.flat_threads = atoi(value);
+                if (options.flat_threads <= 0) {
+                    cerr << "Invalid value for option --flat-threads: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--flat-sketch-keep") == 0) {
+                options.flat_sketch_keep = atoi(value);
+                if (options.flat_sketch_keep < 0) {
+                    cerr << "Invalid value for option --flat-sketch-keep: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--flat-rescore") == 0) {
+                options.flat_rescore = atoi(value);
+                if (options.flat_rescore <= 0) {
+                    cerr << "Invalid value for option --flat-rescore: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--batch-size") == 0) {
+                options.batch_size = atoi(value);
+                if (options.batch_size <= 0) {
+                    cerr << "Invalid value for option --batch-size: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--batch-window") == 0) {
+                options.batch_window = atoi(value);
+                if (options.batch_window < 0) {
+                    cerr << "Invalid value for option --batch-window: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--workers") == 0) {
+                options.workers = atoi(value);
+                if (options.workers < 0) {
+                    cerr << "Invalid value for option --workers: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--worker-timeout") == 0) {
+                options.worker_timeout = atoi(value);
+                if (options.worker_timeout <= 0) {
+                    cerr << "Invalid value for option --worker-timeout: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--worker-python") == 0) {
+                options.worker_python = value;
+            } else if (strcmp(option, "--passage-len") == 0) {
+                options.passage_len = atoi(value);
+                if (options.passage_len < 0) {
+                    cerr << "Invalid value for option --passage-len: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--semantic-cache") == 0) {
+                options.semantic_cache = (float) atof(value);
+                if (options.semantic_cache < 0 || options.semantic_cache > 1) {
+                    cerr << "Invalid value for option --semantic-cache: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--cascade") == 0) {
+                options.cascade = atoi(value);
+                if (options.cascade < 0) {
+                    cerr << "Invalid value for option --cascade: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--cascade-from") == 0) {
+                if (strcmp(value, "conjunctive") == 0) {
+                    options.cascade_from = QueryType::CONJUNCTIVE;
+                } else if (strcmp(value, "disjunctive") == 0) {
+                    options.cascade_from = QueryType::DISJUNCTIVE;
+                } else {
+                    cerr << "Invalid value for option --cascade-from: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--resident") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.resident = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.resident = false;
+                } else {
+                    cerr << "Invalid value for option --resident: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "--stress") == 0) {
+                options.stress_threads = atoi(value);
+                if (options.stress_threads <= 0) {
+                    cerr << "Invalid value for option --stress: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                cerr << "Unknown option: " << option << endl;
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            cerr << "Missing value for option: " << argv[i] << endl;
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.hnsw_path != nullptr && options.flat_path != nullptr) {
+        cerr << "Options --hnsw and --flat cannot be used together" << endl;
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options.workers > 0 && options.batch_size > 1) {
+        cerr << "Options --workers and --batch-size cannot be used together" << endl;
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    if (options.semantic_cache > 0 && options.hnsw_path == nullptr && options.flat_path == nullptr) {
+        cerr << "Option --semantic-cache needs the query embeddings of --hnsw or --flat" << endl;
+        print_usage(argv[0]);
+        exit(EXIT_FAILURE);
+    }
+#ifdef _MSC_VER
+    if (options.workers > 0) {
+        cerr << "Option --workers needs Unix-domain sockets and is not supported on this platform" << endl;
+        exit(EXIT_FAILURE);
+    }
+#endif
+    return options;
+}
+
+void read_storage_info(const char *filename) {
+    printf("Reading storage info from %s...", filename);
+    fflush(stdout);
+    ifstream fin(filename);
+    if (!fin.is_open()) {
+        cerr << "Failed to open file " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    string term;
+    StorageInfo info;
+    while (fin >> term >> info.ids_begin >> info.freqs_begin >> info.doc_cnt) {
+        storage_info[term] = info;
+    }
+    fin.close();
+    printf("done\n");
+}
+
+// The offsets and the positions have lexicons of their own, "term begin" on each line
+void read_column_storage_info(const char *filename, long long StorageInfo::*column_begin) {
+    printf("Reading storage info from %s...", filename);
+    fflush(stdout);
+    ifstream fin(filename);
+    if (!fin.is_open()) {
+        cerr << "Failed to open file " << filename << endl;
+        exit(EXIT_FAILURE);
+    }
+    string term;
+    long long begin;
+    while (fin >> term >> begin) {
+        auto it = storage_info.find(term);
+        if (it != storage_info.end()) {
+            it->second.*column_begin = begin;
+        }
     }
     fin.close();
     printf("done\n");
 }
 
+// The lexicon only keeps where each entry begins. Entries are written one after another,
+// so an entry ends where the next one begins, and the last one ends at the end of the file.
+void set_storage_ends(const Options &options) {
+    vector<StorageInfo *> infos;
+    infos.reserve(storage_info.size());
+    for (auto &[term, info]: storage_info) {
+        infos.push_back(&info);
+    }
+    sort(infos.begin(), infos.end(), [](const StorageInfo *lhs, const StorageInfo *rhs) {
+        return lhs->ids_begin < rhs->ids_begin;
+    });
+    auto ids_size = (long long) std::filesystem::file_size(options.index_ids_path);
+    for (size_t i = 0; i < infos.size(); i++) {
+        infos[i]->ids_end = i + 1 < infos.size() ? infos[i + 1]->ids_begin : ids_size;
+    }
+    sort(infos.begin(), infos.end(), [](const StorageInfo *lhs, const StorageInfo *rhs) {
+        return lhs->freqs_begin < rhs->freqs_begin;
+    });
+    auto freqs_size = (long long) std::filesystem::file_size(options.index_freqs_path);
+    for (size_t i = 0; i < infos.size(); i++) {
+        infos[i]->freqs_end = i + 1 < infos.size() ? infos[i + 1]->freqs_begin : freqs_size;
+    }
+    auto set_column_ends = [&](const char *path, long long StorageInfo::*begin, long long StorageInfo::*end) {
+        if (path == nullptr) {
+            return;
+        }
+        sort(infos.begin(), infos.end(), [begin](const StorageInfo *lhs, const StorageInfo *rhs) {
+            return lhs->*begin < rhs->*begin;
+        });
+        auto size = (long long) std::filesystem::file_size(path);
+        for (size_t i = 0; i < infos.size(); i++) {
+            infos[i]->*end = i + 1 < infos.size() ? infos[i + 1]->*begin : size;
+        }
+    };
+    set_column_ends(options.offsets_path, &StorageInfo::offsets_begin, &StorageInfo::offsets_end);
+    set_column_ends(options.positions_path, &StorageInfo::positions_begin, &StorageInfo::positions_end);
+}
+
 void read_docs_info(Options &options) {
     printf("Reading docs info from %s...", options.doc_info_path);
     fflush(stdout);
@@ -372,6 +1450,91 @@ void read_docs_info(Options &options) {
     printf("done\n");
 }
 
+// Load the index files into one arena, on explicit huge pages if some are reserved, otherwise on transparent
+// huge pages where the system allows them, so that postings are decoded from memory with few TLB misses.
+// The lexicon and the page table are already in memory.
+void load_resident(const Options &options) {
+    printf("Loading the index into memory...");
+    fflush(stdout);
+    auto start = std::chrono::steady_clock::now();
+    vector<pair<int, size_t>> files = {{ids_fd, std::filesystem::file_size(options.index_ids_path)},
+                                       {freqs_fd, std::filesystem::file_size(options.index_freqs_path)}};
+    if (offsets_fd >= 0) {
+        files.emplace_back(offsets_fd, std::filesystem::file_size(options.offsets_path));
+    }
+    if (positions_fd >= 0) {
+        files.emplace_back(positions_fd, std::filesystem::file_size(options.positions_path));
+    }
+    constexpr size_t FILE_ALIGNMENT = 64;  // each file begins on a cache line
+    auto aligned = [](size_t size) { return (size + FILE_ALIGNMENT - 1) / FILE_ALIGNMENT * FILE_ALIGNMENT; };
+    size_t size = 0;
+    for (const auto &file: files) {
+        size += aligned(file.second);
+    }
+#ifdef __linux__
+    constexpr size_t HUGE_PAGE_SIZE = 2 << 20;
+    resident_arena_size = max((size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE, HUGE_PAGE_SIZE);
+    void *arena = mmap(nullptr, resident_arena_size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+    resident_huge_pages = arena != MAP_FAILED;
+    if (!resident_huge_pages) {
+        arena = mmap(nullptr, resident_arena_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (arena == MAP_FAILED) {
+            perror("Failed to allocate memory for the index");
+            exit(EXIT_FAILURE);
+        }
+        madvise(arena, resident_arena_size, MADV_HUGEPAGE);  // before the pages are touched
+    }
+    resident_arena = (unsigned char *) arena;
+#else
+    resident_arena_size = max(size, (size_t) 1);
+    resident_arena = (unsigned char *) malloc(resident_arena_size);
+    if (resident_arena == nullptr) {
+        cerr << "Failed to allocate memory for the index" << endl;
+        exit(EXIT_FAILURE);
+    }
+#endif
+    size_t pos = 0;
+    for (const auto &[fd, file_size]: files) {
+        pread_guarded(fd, resident_arena + pos, file_size, 0);
+        resident_files.emplace_back(fd, resident_arena + pos);
+        pos += aligned(file_size);
+    }
+    auto stop = std::chrono::steady_clock::now();
+    printf("done in %.2f seconds, %.1f MiB on %s pages", std::chrono::duration<double>(stop - start).count(),
+           (double) resident_arena_size / (1 << 20), resident_huge_pages ? "huge" : "normal or transparent huge");
+#ifdef __linux__
+    long long resident_pages = 0;
+    FILE *fp = fopen("/proc/self/statm", "r");
+    if (fp != nullptr) {
+        if (fscanf(fp, "%*d %lld", &resident_pages) != 1) {
+            resident_pages = 0;
+        }
+        fclose(fp);
+    }
+    printf(", resident size of the process %.1f MiB", (double) resident_pages * sysconf(_SC_PAGESIZE) / (1 << 20));
+#endif
+    printf(" (%zu terms in the lexicon, %zu docs in the page table)\n", storage_info.size(), docs_info.size());
+}
+
+// Reads of a batch go through io_uring if the kernel allows it, otherwise through a pool of threads
+void init_io(const Options &options) {
+    io_backend = options.io_backend;
+#ifdef __linux__
+    if (io_backend == IoBackend::URING && thread_uring() == nullptr) {
+        printf("io_uring is not available, reading docs on a thread pool instead\n");
+        io_backend = IoBackend::POOL;
+    }
+#else
+    if (io_backend == IoBackend::URING) {
+        io_backend = IoBackend::POOL;
+    }
+#endif
+    if (io_backend == IoBackend::POOL) {
+        io_pool = make_unique<ThreadPool>(options.io_threads);
+    }
+}
+
 FILE *fopen_guarded(const string &filename, const char *mode) {
     FILE *fp = fopen(filename.c_str(), mode);
     if (fp == nullptr) {
@@ -381,25 +1544,117 @@ FILE *fopen_guarded(const string &filename, const char *mode) {
     return fp;
 }
 
-void *realloc_guarded(void *ptr, size_t size) {
-    void *tmp = realloc(ptr, size);
-    if (tmp == nullptr) {
-        perror("Failed to allocate memory");
-        exit(EXIT_FAILURE);
+// Split text into lowercase words in order, as the index is tokenized
+void split_words(string text, vector<string> &words) {
+    char *begin_p = text.data();
+    char *end_p = text.data() + text.size();
+    while (begin_p < end_p) {
+        char *word_begin = begin_p;
+        int len = get_utf8_char_len(begin_p, end_p);
+        while (is_al_num(begin_p, len)) {
+            if (len == 1) {
+                *begin_p = (char) tolower(*begin_p);
+            }
+            begin_p += len;
+            len = get_utf8_char_len(begin_p, end_p);
+        }
+        if (begin_p > word_begin) {
+            *begin_p = '\0';
+            words.emplace_back(word_begin);
+        }
+        begin_p += len;
+    }
+}
+
+// The words of a query in order and lowercase, so that queries differing only in case, spacing or punctuation share
+// the cached results of the Transformer, whose models are uncased
+string normalize_query(const string &query) {
+    vector<string> words;
+    split_words(query, words);
+    string normalized;
+    for (const auto &word: words) {
+        normalized += word + ' ';
+    }
+    if (!normalized.empty()) {
+        normalized.pop_back();
     }
-    return tmp;
+    return normalized;
 }
 
-string clean_query(const string &query, vector<string> &query_list) {
+string clean_query(const string &query, vector<string> &query_list, vector<Phrase> &phrases) {
     // Split query by space
     // - Omit leading and trailing spaces
     // - Omit duplicate words
     // - Treat consecutive spaces as one
     // - Convert to lowercase
+    // - Take "..." as a phrase and "..."~N as words within N words of each other, whose words are query words too
+    string words_text;
+    for (size_t i = 0; i < query.size(); i++) {
+        size_t close = query[i] == '"' ? query.find('"', i + 1) : string::npos;
+        if (close == string::npos) {
+            words_text += query[i];
+            continue;
+        }
+        Phrase phrase;
+        string phrase_text = query.substr(i + 1, close - i - 1);
+        split_words(phrase_text, phrase.terms);
+        size_t last = close;  // the closing quote, or the last digit of ~N
+        if (close + 2 < query.size() && query[close + 1] == '~' && isdigit((unsigned char) query[close + 2])) {
+            last = close + 2;
+            while (last + 1 < query.size() && isdigit((unsigned char) query[last + 1])) {
+                last++;
+            }
+            phrase.window = atoi(query.substr(close + 2, min(last - close - 1, (size_t) 9)).c_str());
+        }
+        if (phrase.terms.size() > 1) {  // a single word is only a word
+            phrases.push_back(std::move(phrase));
+        }
+        words_text += ' ' + phrase_text + ' ';
+        i = last;
+    }
+    vector<string> words;
+    split_words(words_text, words);
     unordered_set<string> query_set;
-    string cleaned_query = query;
-    char *begin_p = cleaned_query.data();
-    char *end_p = cleaned_query.data() + cleaned_query.size();
+    for (auto &word: words) {
+        if (query_set.find(word) == query_set.end()) {
+            query_set.emplace(word);
+            query_list.push_back(std::move(word));
+        }
+    }
+    sort(query_list.begin(), query_list.end());
+    sort(phrases.begin(), phrases.end());
+    phrases.erase(std::unique(phrases.begin(), phrases.end()), phrases.end());
+    string cleaned_query;
+    for (const auto &word: query_list) {
+        cleaned_query += word + " ";
+    }
+    for (const auto &phrase: phrases) {
+        cleaned_query += '"';
+        for (const auto &term: phrase.terms) {
+            cleaned_query += term + " ";
+        }
+        cleaned_query.back() = '"';
+        cleaned_query += phrase.window > 0 ? "~" + std::to_string(phrase.window) + " " : " ";
+    }
+    if (!cleaned_query.empty()) {
+        cleaned_query.pop_back();
+    }
+    return cleaned_query;
+}
+
+// The passage of passage_len words of a doc with the most occurrences of query words, the earliest one on ties,
+// which is all the cross-encoder reads of the doc instead of truncating it after its first words.
+// content must be null-terminated at size, as the tokenizer writes a null after the last word.
+std::string_view select_passage(const char *content, size_t size, const vector<string> &query_list,
+                                int passage_len, vector<char> &tokenize_buffer) {
+    if (passage_len == 0) {
+        return {content, size};
+    }
+    tokenize_buffer.assign(content, content + size + 1);  // with the null
+    vector<pair<size_t, size_t>> spans;  // begin and end of each word
+    vector<unsigned char> hits;  // whether each word is a query word
+    char *begin_p = tokenize_buffer.data();
+    char *end_p = tokenize_buffer.data() + size;
     while (begin_p < end_p) {
         char *word_begin = begin_p;
         int len = get_utf8_char_len(begin_p, end_p);
@@ -411,92 +1666,787 @@ string clean_query(const string &query, vector<string> &query_list) {
             len = get_utf8_char_len(begin_p, end_p);
         }
         if (begin_p > word_begin) {
+            spans.emplace_back(word_begin - tokenize_buffer.data(), begin_p - tokenize_buffer.data());
             *begin_p = '\0';
-            if (query_set.find(word_begin) == query_set.end()) {
-                query_set.emplace(word_begin);
-                query_list.emplace_back(word_begin);
+            bool hit = false;
+            for (const auto &term: query_list) {
+                if (strcmp(word_begin, term.c_str()) == 0) {
+                    hit = true;
+                    break;
+                }
             }
+            hits.push_back(hit);
         }
         begin_p += len;
     }
-    sort(query_list.begin(), query_list.end());
-    cleaned_query.clear();
-    for (const auto &word: query_list) {
-        cleaned_query += word + " ";
+    if (spans.size() <= (size_t) passage_len) {
+        return {content, size};
     }
-    if (!cleaned_query.empty()) {
-        cleaned_query.pop_back();
+    // Slide the window over the words, counting the query words in it
+    unsigned cnt = 0, best_cnt = 0;
+    size_t best_begin = 0;
+    for (size_t i = 0; i < spans.size(); i++) {
+        cnt += hits[i];
+        if (i >= (size_t) passage_len) {
+            cnt -= hits[i - passage_len];
+        }
+        if (i + 1 >= (size_t) passage_len && cnt > best_cnt) {
+            best_cnt = cnt;
+            best_begin = i + 1 - passage_len;
+        }
     }
-    return cleaned_query;
+    size_t begin = spans[best_begin].first, end = spans[best_begin + passage_len - 1].second;
+    return {content + begin, end - begin};
+}
+
+// Bytes read on each side of the snippet around a query word, beyond snippet_len / 2, before widening the window
+constexpr long long SNIPPET_WINDOW_PAD = 64;
+
+// Read bytes [begin, end) of a doc, where begin and end are relative to the doc
+void read_doc_window(unsigned doc_id, long long begin, long long end, QueryContext &ctx) {
+    ctx.doc_content.resize(end - begin + 1);
+    pread_guarded(dataset_fd, ctx.doc_content.data(), end - begin, docs_info[doc_id].begin + begin);
+    ctx.doc_content[end - begin] = '\0';
+}
+
+// Cut the snippet around the query word at q_pos, from content holding bytes [window_begin, window_end)
+// of a doc of doc_size bytes. Return false if the snippet needs bytes outside the window.
+bool cut_snippet(const char *content, long long window_begin, long long window_end, long long doc_size,
+                 long long q_pos, int snippet_len, string &snippet) {
+    long long begin_pos = max(q_pos - snippet_len / 2, 0LL);
+    if (begin_pos < window_begin) {
+        return false;
+    }
+    while (begin_pos > 0 && (content[begin_pos - window_begin] & 0x80) != 0) {  // keep complete utf-8 characters
+        if (--begin_pos < window_begin) {
+            return false;
+        }
+    }
+    long long end_pos = min(q_pos + snippet_len / 2, doc_size);
+    long long original_end_pos = end_pos;
+    while (end_pos < doc_size) {  // keep complete utf-8 characters
+        if (end_pos >= window_end) {
+            return false;
+        }
+        if ((content[end_pos - window_begin] & 0x80) == 0) {
+            break;
+        }
+        end_pos++;
+    }
+    // include the last byte if the last character is an utf-8 character
+    end_pos += (end_pos + 1 < doc_size && end_pos != original_end_pos);
+    snippet.assign(content + (begin_pos - window_begin), content + (end_pos - window_begin));
+    return true;
 }
 
-size_t read_doc(unsigned doc_id) {
-    fseek64(dataset_fp, docs_info[doc_id].begin, SEEK_SET);
-    size_t new_size = docs_info[doc_id].end - docs_info[doc_id].begin;
-    if (new_size + 1 > buf_size) {
-        buf_size = new_size;
-        doc_content = (char *) realloc_guarded(doc_content, buf_size + 1);
-        tokenize_buffer = (char *) realloc_guarded(tokenize_buffer, buf_size + 1);
+// BM25 is split into parts that are computed once: the length normalization K of each doc at startup,
+// and the IDF of each term once per query. Only TF is left for each posting.
+vector<float> doc_norms;
+
+// Header of the impact-ordered index: the BM25 score of an impact of 1, then the doc count, average doc length,
+// k and b the impacts were computed with by merge_index
+constexpr size_t IMPACT_HEADER_LEN = 5;
+
+// Take the BM25 normalization from the header of the impact-ordered index, so that impact and BM25 queries rank
+// with the same one, and exit if it was built from another page table or with other parameters
+void read_impact_header(Options &options) {
+    int fd = open_guarded(options.impact_index_path);
+    double header[IMPACT_HEADER_LEN];
+    pread_guarded(fd, header, sizeof(header), 0);
+    close(fd);
+    if ((int) header[1] != options.total_doc_cnt || header[3] != options.k || header[4] != options.b) {
+        cerr << "The impact-ordered index " << options.impact_index_path << " was not built from "
+             << options.doc_info_path << " with the same k and b, rebuild it with merge_index -a true" << endl;
+        exit(EXIT_FAILURE);
     }
-    fread(doc_content, sizeof(char), new_size, dataset_fp);
-    doc_content[new_size] = '\0';
-    return new_size;
+    options.avg_doc_len = header[2];
 }
 
-double BM25(unsigned freq, unsigned doc_cnt, unsigned doc_len, Options &options) {
-    double K = options.k * ((1 - options.b) + options.b * doc_len / options.avg_doc_len);
-    return log((options.total_doc_cnt - doc_cnt + 0.5) / (doc_cnt + 0.5)) *
-           (freq * (options.k + 1)) / (freq + K);
+void init_doc_norms(const Options &options) {
+    doc_norms.resize(docs_info.size());
+    for (size_t i = 0; i < docs_info.size(); i++) {
+        doc_norms[i] = (float) (options.k * ((1 - options.b) + options.b * docs_info[i].term_cnt / options.avg_doc_len));
+    }
 }
 
-class Searcher {
-protected:
-    LRUCache<ResultDocInfos> result_cache;
+float BM25_IDF(unsigned doc_cnt, const Options &options) {
+    return (float) log((options.total_doc_cnt - doc_cnt + 0.5) / (doc_cnt + 0.5));
+}
 
-    virtual shared_ptr<ResultDocInfos>
-    collect_and_rank_docs(const string &query, const string &cleaned_query, vector<string> &query_list,
-                          LRUCache<Entry> &entry_cache, Options &options, json &result) = 0;
+float BM25(unsigned freq, unsigned doc_id, float idf, float k1) {
+    return idf * ((float) freq * k1) / ((float) freq + doc_norms[doc_id]);
+}
+
+// Score n postings of a term into scores, 8 at a time with AVX2. k1 is k + 1.
+void BM25_block(const unsigned *doc_ids, const unsigned *freqs, size_t n, float idf, float k1, float *scores) {
+    size_t i = 0;
+#ifdef __AVX2__
+    __m256 weight_v = _mm256_set1_ps(idf * k1);
+    for (; i + 8 <= n; i += 8) {
+        // freqs and doc ids are less than 2^31, so signed conversion and indexing are fine
+        __m256 freq_v = _mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *) (freqs + i)));
+        __m256i id_v = _mm256_loadu_si256((const __m256i *) (doc_ids + i));
+        __m256 norm_v = _mm256_i32gather_ps(doc_norms.data(), id_v, sizeof(float));
+        __m256 score_v = _mm256_div_ps(_mm256_mul_ps(weight_v, freq_v), _mm256_add_ps(freq_v, norm_v));
+        _mm256_storeu_ps(scores + i, score_v);
+    }
+#endif
+    for (; i < n; i++) {
+        scores[i] = BM25(freqs[i], doc_ids[i], idf, k1);
+    }
+}
+
+// Bounded min-heap keeping the k best (doc id, score) pairs seen so far.
+// If `after` is given, only pairs ranked after it are kept, which continues a ranking from a previous top k.
+class TopKHeap {
+private:
+    size_t k;
+    const pair<unsigned, float> *after;
+    vector<pair<unsigned, float>> heap;  // heap top is the worst result kept so far
+
+    static bool better(const pair<unsigned, float> &lhs, const pair<unsigned, float> &rhs) {
+        return lhs.second > rhs.second || (lhs.second == rhs.second && lhs.first < rhs.first);
+    }
 
 public:
-    explicit Searcher(int cache_size) : result_cache(cache_size) {}
+    explicit TopKHeap(size_t k, const pair<unsigned, float> *after = nullptr) : k(k), after(after) {}
 
-    virtual ~Searcher() = default;
+    void push(unsigned doc_id, float score) {
+        if (after && !better(*after, {doc_id, score})) {
+            return;
+        }
+        if (heap.size() < k) {
+            heap.emplace_back(doc_id, score);
+            push_heap(heap.begin(), heap.end(), better);
+        } else if (k > 0 && better({doc_id, score}, heap.front())) {
+            pop_heap(heap.begin(), heap.end(), better);
+            heap.back() = {doc_id, score};
+            push_heap(heap.begin(), heap.end(), better);
+        }
+    }
 
-    json search(const string &query, Options &options) {
-        static LRUCache<Entry> entry_cache(options.cache_size);
-        static vector<char *> words;
-        static vector<string> query_list;
+    // Sorted by score descending and then doc id ascending. The heap is emptied.
+    vector<pair<unsigned, float>> take_sorted() {
+        sort_heap(heap.begin(), heap.end(), better);
+        return std::move(heap);
+    }
+};
 
-        // Clean query
-        query_list.clear();
-        const string &cleaned_query = clean_query(query, query_list);
+// Dense score array for term-at-a-time scoring, indexed by doc id.
+// Docs are grouped into pages, and only the pages touched by the last query are cleared on reset().
+class ScoreAccumulator {
+private:
+    static constexpr unsigned PAGE_BITS = 12;  // 4096 docs per page, must be >= 6
+    vector<float> scores;
+    vector<unsigned long long> touched;  // one bit per doc
+    vector<bool> page_dirty;
+    vector<unsigned> dirty_pages;
+    size_t touched_cnt = 0;
 
-        // Collect and rank docs
-        json result;
-        auto start = std::chrono::steady_clock::now();
-        auto sorted_infos = collect_and_rank_docs(query, cleaned_query, query_list, entry_cache, options, result);
+public:
+    explicit ScoreAccumulator(size_t n_docs) :
+            scores(n_docs), touched((n_docs + 63) / 64), page_dirty((n_docs >> PAGE_BITS) + 1) {}
 
-        // Generate results
-        auto stop = std::chrono::steady_clock::now();
-        auto diff = std::chrono::duration<double, std::micro>(stop - start).count();
-        result["time"] = diff;
-        if (!sorted_infos) {
-            result["count"] = 0;
-            return result;
+    void add(unsigned doc_id, float score) {
+        unsigned page = doc_id >> PAGE_BITS;
+        if (!page_dirty[page]) {
+            page_dirty[page] = true;
+            dirty_pages.push_back(page);
         }
-        result["count"] = sorted_infos->size();
-        result["data"] = json::array();
-        for (int i = 0; i < options.n_results && i < sorted_infos->size(); i++) {
-            auto &[doc_id, info] = sorted_infos->at(i);
-            json item;
-            item["rank"] = i + 1;
-            item["score"] = info.score;
-            if (info.freqs) {  // transformer does not have freqs
-                item["freqs"] = *info.freqs;
-            }
+        unsigned long long &word = touched[doc_id >> 6];
+        unsigned long long bit = 1ULL << (doc_id & 63);
+        if (!(word & bit)) {
+            word |= bit;
+            touched_cnt++;
+        }
+        scores[doc_id] += score;
+    }
+
+    // number of docs that have been added since the last reset()
+    size_t size() const {
+        return touched_cnt;
+    }
+
+    // Select the k highest scores, sorted by score descending and then doc id ascending.
+    vector<pair<unsigned, float>> top_k(size_t k, const pair<unsigned, float> *after = nullptr) const {
+        TopKHeap heap(k, after);
+        for (auto page: dirty_pages) {
+            size_t word_begin = (size_t) page << (PAGE_BITS - 6);
+            size_t word_end = min(word_begin + (1 << (PAGE_BITS - 6)), touched.size());
+            for (size_t w = word_begin; w < word_end; w++) {
+                for (unsigned long long word = touched[w]; word != 0; word &= word - 1) {
+                    auto doc_id = (unsigned) (w * 64 + std::countr_zero(word));
+                    heap.push(doc_id, scores[doc_id]);
+                }
+            }
+        }
+        return heap.take_sorted();
+    }
+
+    void reset() {
+        for (auto page: dirty_pages) {
+            size_t doc_begin = (size_t) page << PAGE_BITS;
+            size_t doc_end = min(doc_begin + (1 << PAGE_BITS), scores.size());
+            std::fill(scores.begin() + (long long) doc_begin, scores.begin() + (long long) doc_end, 0.f);
+            size_t word_begin = doc_begin >> 6;
+            size_t word_end = min(word_begin + (1 << (PAGE_BITS - 6)), touched.size());
+            std::fill(touched.begin() + (long long) word_begin, touched.begin() + (long long) word_end, 0ULL);
+            page_dirty[page] = false;
+        }
+        dirty_pages.clear();
+        touched_cnt = 0;
+    }
+};
+
+// Accumulators are reused across queries, one per thread since each is as large as the corpus.
+ScoreAccumulator &thread_accumulator() {
+    thread_local ScoreAccumulator accumulator(docs_info.size());
+    return accumulator;
+}
+
+// Find the first position >= pos whose doc id is >= target in a sorted list.
+// It gallops from pos with doubling steps, binary searches the last step,
+// and finishes with a linear scan of at most GALLOP_SCAN_LEN doc ids, compared 8 at a time with AVX2.
+constexpr size_t GALLOP_SCAN_LEN = 32;
+
+size_t gallop_to(const unsigned *doc_ids, size_t size, size_t pos, unsigned target) {
+    if (pos >= size || doc_ids[pos] >= target) {
+        return pos;
+    }
+    // invariant: doc_ids[lo] < target, and doc_ids[hi] >= target if hi < size
+    size_t lo = pos, hi = pos + 1, step = 1;
+    while (hi < size && doc_ids[hi] < target) {
+        lo = hi;
+        step <<= 1;
+        hi = lo + step;
+    }
+    hi = min(hi, size);
+    while (hi - lo > GALLOP_SCAN_LEN) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (doc_ids[mid] < target) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    lo++;
+#ifdef __AVX2__
+    // doc ids are less than 2^31, so the signed comparison is fine
+    __m256i target_v = _mm256_set1_epi32((int) target);
+    while (lo + 8 <= hi) {
+        __m256i ids_v = _mm256_loadu_si256((const __m256i *) (doc_ids + lo));
+        auto less_mask = (unsigned) _mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(target_v, ids_v)));
+        if (less_mask != 0xff) {
+            return lo + std::popcount(less_mask);
+        }
+        lo += 8;
+    }
+#endif
+    while (lo < hi && doc_ids[lo] < target) {
+        lo++;
+    }
+    return lo;
+}
+
+void write_vbyte(unsigned value, vector<unsigned char> &bytes) {
+    while (value >= 0x80) {
+        bytes.push_back(value & 0x7f);
+        value >>= 7;
+    }
+    bytes.push_back(value | 0x80);
+}
+
+// Move the decoded postings of an entry into blocks of vbyte, about a quarter of their decoded size.
+void compress_postings(Entry &entry) {
+    auto compressed = make_unique<CompressedPostings>();
+    bool has_offsets = !entry.offsets.empty();
+    unsigned prev_doc_id = 0;
+    for (size_t i = 0; i < entry.doc_ids.size(); i++) {
+        if (i % POSTING_BLOCK_SIZE == 0) {
+            compressed->ids_offsets.push_back((unsigned) compressed->ids_bytes.size());
+            compressed->freqs_offsets.push_back((unsigned) compressed->freqs_bytes.size());
+            if (has_offsets) {
+                compressed->offsets_offsets.push_back((unsigned) compressed->offsets_bytes.size());
+            }
+        }
+        write_vbyte(entry.doc_ids[i] - prev_doc_id, compressed->ids_bytes);
+        write_vbyte(entry.freqs[i], compressed->freqs_bytes);
+        if (has_offsets) {
+            write_vbyte(entry.offsets[i], compressed->offsets_bytes);
+        }
+        prev_doc_id = entry.doc_ids[i];
+        if ((i + 1) % POSTING_BLOCK_SIZE == 0 || i + 1 == entry.doc_ids.size()) {
+            compressed->block_last_ids.push_back(prev_doc_id);
+        }
+    }
+    compressed->ids_bytes.shrink_to_fit();
+    compressed->freqs_bytes.shrink_to_fit();
+    compressed->offsets_bytes.shrink_to_fit();
+    entry.compressed = std::move(compressed);
+    entry.doc_ids = vector<unsigned>();
+    entry.freqs = vector<unsigned>();
+    entry.offsets = vector<unsigned>();
+}
+
+// Traverses the postings of an entry a block at a time. Decoded postings are a single block,
+// while compressed ones are decoded block by block when they are reached, and blocks that
+// advance_to() jumps over are never decoded. The freqs and offsets of a block are only decoded when asked for.
+class PostingCursor {
+private:
+    const Entry &entry;
+    const CompressedPostings *compressed;
+    size_t block = 0, n_blocks, pos = 0, size = 0;
+    bool freqs_loaded = false, offsets_loaded = false;
+    unsigned ids_buffer[POSTING_BLOCK_SIZE], freqs_buffer[POSTING_BLOCK_SIZE], offsets_buffer[POSTING_BLOCK_SIZE];
+
+    static const unsigned char *decode(const unsigned char *p, unsigned &value) {
+        unsigned shift = 0;
+        value = 0;
+        while (!(*p & 0x80)) {
+            value |= (*p++ & 0x7f) << shift;
+            shift += 7;
+        }
+        value |= (*p++ & 0x7f) << shift;
+        return p;
+    }
+
+    void load_block(size_t b) {
+        block = b;
+        pos = 0;
+        if (block >= n_blocks) {
+            return;
+        }
+        if (!compressed) {
+            size = entry.doc_cnt;
+            return;
+        }
+        size = min((size_t) POSTING_BLOCK_SIZE, entry.doc_cnt - block * POSTING_BLOCK_SIZE);
+        const unsigned char *p = compressed->ids_bytes.data() + compressed->ids_offsets[block];
+        unsigned doc_id = block > 0 ? compressed->block_last_ids[block - 1] : 0, gap;
+        for (size_t i = 0; i < size; i++) {
+            p = decode(p, gap);
+            doc_id += gap;
+            ids_buffer[i] = doc_id;
+        }
+        freqs_loaded = false;
+        offsets_loaded = false;
+    }
+
+    const unsigned *ids() const {
+        return compressed ? ids_buffer : entry.doc_ids.data();
+    }
+
+public:
+    explicit PostingCursor(const Entry &entry) : entry(entry), compressed(entry.compressed.get()) {
+        n_blocks = compressed ? compressed->block_last_ids.size() : entry.doc_cnt > 0;
+        load_block(0);
+    }
+
+    bool at_end() const {
+        return block >= n_blocks;
+    }
+
+    unsigned doc_id() const {
+        return ids()[pos];
+    }
+
+    unsigned freq() {
+        return block_freqs()[pos];
+    }
+
+    bool has_offsets() const {
+        return compressed ? !compressed->offsets_offsets.empty() : !entry.offsets.empty();
+    }
+
+    // Byte offset of the first occurrence of the term in the current doc, only if has_offsets()
+    unsigned offset() {
+        if (!compressed) {
+            return entry.offsets[pos];
+        }
+        if (!offsets_loaded) {
+            const unsigned char *p = compressed->offsets_bytes.data() + compressed->offsets_offsets[block];
+            for (size_t i = 0; i < size; i++) {
+                p = decode(p, offsets_buffer[i]);
+            }
+            offsets_loaded = true;
+        }
+        return offsets_buffer[pos];
+    }
+
+    void next() {
+        if (++pos >= size) {
+            load_block(block + 1);
+        }
+    }
+
+    // Move to the first posting whose doc id is >= target, return false if there is none.
+    // The cursor never moves backwards.
+    bool advance_to(unsigned target) {
+        if (at_end()) {
+            return false;
+        }
+        if (ids()[size - 1] < target) {
+            if (!compressed) {
+                load_block(n_blocks);
+                return false;
+            }
+            load_block(gallop_to(compressed->block_last_ids.data(), n_blocks, block + 1, target));
+            if (at_end()) {
+                return false;
+            }
+        }
+        pos = gallop_to(ids(), size, pos, target);
+        return true;
+    }
+
+    // The current block, from its beginning regardless of the position in it
+    const unsigned *block_doc_ids() const {
+        return ids();
+    }
+
+    const unsigned *block_freqs() {
+        if (!compressed) {
+            return entry.freqs.data();
+        }
+        if (!freqs_loaded) {
+            const unsigned char *p = compressed->freqs_bytes.data() + compressed->freqs_offsets[block];
+            for (size_t i = 0; i < size; i++) {
+                p = decode(p, freqs_buffer[i]);
+            }
+            freqs_loaded = true;
+        }
+        return freqs_buffer;
+    }
+
+    size_t block_size() const {
+        return size;
+    }
+
+    // Ordinals of the first posting of the current block and of the current posting in the entry
+    size_t block_begin() const {
+        return compressed ? block * POSTING_BLOCK_SIZE : 0;
+    }
+
+    size_t ordinal() const {
+        return block_begin() + pos;
+    }
+
+    // Decode the word positions of the current posting from the position list of its term
+    void positions(const PositionList &list, vector<unsigned> &out) {
+        size_t ordinal = this->ordinal(), base = block_begin();
+        size_t first = ordinal / POSTING_BLOCK_SIZE * POSTING_BLOCK_SIZE;
+        const unsigned *freqs = block_freqs();
+        size_t skip = 0;
+        for (size_t i = first; i < ordinal; i++) {
+            skip += freqs[i - base];
+        }
+        const unsigned char *p = list.bytes.data() + list.block_offsets[ordinal / POSTING_BLOCK_SIZE];
+        while (skip > 0) {
+            skip -= (*p++ & 0x80) != 0;
+        }
+        out.resize(freqs[ordinal - base]);
+        unsigned position = 0, gap;
+        for (auto &value: out) {
+            p = decode(p, gap);
+            position += gap;
+            value = position;
+        }
+    }
+
+    void next_block() {
+        load_block(block + 1);
+    }
+};
+
+// Whether the words of a phrase are adjacent and in order in a doc, or within phrase.window words of each other,
+// given the sorted positions of each word of the phrase in the doc
+bool phrase_matches(const Phrase &phrase, vector<const vector<unsigned> *> positions) {
+    if (phrase.window == 0) {
+        for (auto first: *positions[0]) {
+            bool found = true;
+            for (size_t i = 1; i < positions.size() && found; i++) {
+                found = std::binary_search(positions[i]->begin(), positions[i]->end(), first + (unsigned) i);
+            }
+            if (found) {
+                return true;
+            }
+        }
+        return false;
+    }
+    // Move through the positions of all words at once, always advancing the word at the smallest position,
+    // so every smallest span that covers all words is checked
+    sort(positions.begin(), positions.end());
+    positions.erase(std::unique(positions.begin(), positions.end()), positions.end());
+    vector<size_t> next(positions.size(), 0);
+    while (true) {
+        size_t lowest = 0;
+        unsigned lo = UINT_MAX, hi = 0;
+        for (size_t i = 0; i < positions.size(); i++) {
+            unsigned position = (*positions[i])[next[i]];
+            if (position < lo) {
+                lo = position;
+                lowest = i;
+            }
+            hi = max(hi, position);
+        }
+        if (hi - lo <= (unsigned) phrase.window) {
+            return true;
+        }
+        if (++next[lowest] == positions[lowest]->size()) {
+            return false;
+        }
+    }
+}
+
+// Append the top docs to the results, looking up the freqs of each query term.
+void append_results(ResultDocInfos &infos, const vector<pair<unsigned, float>> &top, const vector<EntryP> &entries) {
+    if (infos.terms.empty()) {
+        for (const auto &entry: entries) {
+            infos.terms.push_back(entry->term);
+        }
+    }
+    for (auto [doc_id, score]: top) {
+        infos.doc_ids.push_back(doc_id);
+        infos.scores.push_back(score);
+        for (const auto &entry: entries) {
+            PostingCursor cursor(*entry);
+            bool found = cursor.advance_to(doc_id) && cursor.doc_id() == doc_id;
+            infos.freqs.push_back(found ? cursor.freq() : 0);
+        }
+    }
+}
+
+// Searchers only hold shared caches, and all per-query state lives in a QueryContext,
+// so search() can be called from several threads at once.
+class Searcher {
+protected:
+    ShardedCache<Entry> &entry_cache;  // shared by all searchers
+    size_t result_cache_bytes;  // of each cache of this searcher, which share --result-cache
+    ShardedCache<ResultDocInfos> result_cache;
+    ShardedCache<RenderedResult> rendered_cache;  // responses with snippets, so repeated queries read no docs
+
+    virtual shared_ptr<ResultDocInfos>
+    collect_and_rank_docs(const string &query, const string &cleaned_query, QueryContext &ctx,
+                          const Options &options, json &result) = 0;
+
+    // The query as the results depend on it, the cleaned query unless the searcher needs the original one
+    virtual string result_key(const string &, const string &cleaned_query) {
+        return cleaned_query;
+    }
+
+    // Get the entries of the query terms into ctx.entries, from the cache or from the index.
+    // The entries that are not cached are read in one batch, and decoded from the shortest one on as their
+    // reads complete, so that the long lists are still being read while the short ones are decoded.
+    void collect_entries(QueryContext &ctx, const Options &options) {
+        ctx.entries.clear();
+        struct Miss {
+            size_t index;  // in ctx.entries
+            const string *term;
+            const StorageInfo *info;
+            size_t first_read, n_reads;
+            EntryBytes bytes;
+        };
+        vector<Miss> misses;
+        ReadBatch batch;
+        for (const auto &term: ctx.query_list) {
+            auto it = storage_info.find(term);
+            if (it == storage_info.end()) {
+                continue;
+            }
+            // Check if entry is in cache
+            auto entry = entry_cache.get(term);
+            if (!entry) {
+                misses.push_back({ctx.entries.size(), &term, &it->second, batch.size(), 0, {}});
+                add_entry_reads(batch, it->second, misses.back().bytes);
+                misses.back().n_reads = batch.size() - misses.back().first_read;
+            }
+            ctx.entries.push_back(entry);
+        }
+        if (misses.empty()) {
+            return;
+        }
+        batch.submit();
+        sort(misses.begin(), misses.end(), [](const Miss &lhs, const Miss &rhs) {
+            return lhs.info->doc_cnt < rhs.info->doc_cnt;
+        });
+        for (auto &miss: misses) {
+            for (size_t i = miss.first_read; i < miss.first_read + miss.n_reads; i++) {
+                batch.wait(i);
+            }
+            auto entry = make_shared<Entry>();
+            entry->term = *miss.term;
+            entry->doc_cnt = miss.info->doc_cnt;
+            options.decode_index(*miss.info, miss.bytes, *entry);
+            miss.bytes = {};
+            if (options.compressed_cache) {
+                compress_postings(*entry);
+            }
+            // Cache entry, the cost of reading it again grows with its length
+            entry_cache.put(*miss.term, entry, miss.info->doc_cnt);
+            ctx.entries[miss.index] = entry;
+        }
+    }
+
+    // Get the entries of the query terms into ctx.entries only if all of them are cached, to place the snippets of
+    // results that were found without them, so that showing those results reads no postings
+    void collect_cached_entries(QueryContext &ctx) {
+        ctx.entries.clear();
+        for (const auto &term: ctx.query_list) {
+            if (storage_info.find(term) == storage_info.end()) {
+                continue;
+            }
+            auto entry = entry_cache.get(term);
+            if (!entry) {
+                ctx.entries.clear();  // the snippets are placed by tokenizing the docs instead
+                return;
+            }
+            ctx.entries.push_back(entry);
+        }
+    }
+
+    // Offset of the first occurrence in a doc of the first query word it contains, as the snippet is cut
+    // around it, or -1 if the offsets are unknown and the doc has to be read and tokenized to find it.
+    static long long first_query_offset(unsigned doc_id, QueryContext &ctx) {
+        const string *first_term = nullptr;
+        long long q_pos = -1;
+        for (const auto &entry: ctx.entries) {  // query_list is sorted, so the first word is the smallest
+            PostingCursor cursor(*entry);
+            if (!cursor.has_offsets()) {
+                return -1;
+            }
+            if (cursor.advance_to(doc_id) && cursor.doc_id() == doc_id &&
+                (first_term == nullptr || entry->term < *first_term)) {
+                first_term = &entry->term;
+                q_pos = cursor.offset();
+            }
+        }
+        return q_pos;
+    }
+
+public:
+    // A searcher with more caches than the results and the responses gives their number, to split the budget among
+    Searcher(ShardedCache<Entry> &entry_cache, const Options &options, unsigned n_caches = 2) :
+            entry_cache(entry_cache), result_cache_bytes(((size_t) options.result_cache_size << 20) / n_caches),
+            result_cache(result_cache_bytes), rendered_cache(result_cache_bytes) {}
+
+    virtual ~Searcher() = default;
+
+    virtual void clear_caches() {
+        entry_cache.clear();
+        result_cache.clear();
+        rendered_cache.clear();
+    }
+
+    // hit/miss/eviction counters and sizes of the caches of this searcher, except the shared entry cache
+    virtual json cache_stats() {
+        return {{"results", result_cache.stats()}, {"rendered", rendered_cache.stats()}};
+    }
+
+    // The ranked docs of a cleaned query without snippets, from the result cache if it holds them,
+    // for a searcher that combines the results of others
+    shared_ptr<ResultDocInfos> rank(const string &query, const string &cleaned_query, QueryContext &ctx,
+                                    const Options &options, bool &cached) {
+        json result;
+        auto sorted_infos = collect_and_rank_docs(query, cleaned_query, ctx, options, result);
+        cached = result.value("cached", false);
+        return sorted_infos;
+    }
+
+    json search(const string &query, const Options &options) {
+        QueryContext ctx;
+
+        // Clean query
+        const string &cleaned_query = clean_query(query, ctx.query_list, ctx.phrases);
+
+        // Check if the response is in cache
+        auto start = std::chrono::steady_clock::now();
+        string rendered_key = std::to_string((int) options.query_type) + '\t' + std::to_string(options.n_results) + '\t' +
+                              std::to_string(options.snippet_len) + '\t' + result_key(query, cleaned_query);
+        if (auto rendered = rendered_cache.get(rendered_key)) {
+            json result = rendered->result;
+            result["cached"] = true;
+            result["time"] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            return result;
+        }
+
+        // Collect and rank docs
+        json result;
+        auto sorted_infos = collect_and_rank_docs(query, cleaned_query, ctx, options, result);
+
+        // Generate results
+        auto stop = std::chrono::steady_clock::now();
+        auto diff = std::chrono::duration<double, std::micro>(stop - start).count();
+        result["time"] = diff;
+        if (!sorted_infos) {
+            result["count"] = 0;
+            return result;
+        }
+        result["count"] = sorted_infos->count;
+        result["data"] = json::array();
+        if (offsets_fd >= 0 && ctx.entries.empty()) {  // cached results, or a searcher that does not use the entries
+            collect_cached_entries(ctx);
+        }
+        // Read the docs of all shown results at once, only a window around the query word if its offset is known,
+        // and form the snippet of each doc as soon as it is read
+        struct DocRead {
+            long long q_pos, begin, end;
+        };
+        size_t n_shown = min((size_t) options.n_results, sorted_infos->size());
+        vector<DocRead> doc_reads(n_shown);
+        ctx.batch_contents.resize(n_shown);
+        ReadBatch batch;
+        for (size_t i = 0; i < n_shown; i++) {
+            unsigned doc_id = sorted_infos->doc_ids[i];
+            auto size = docs_info[doc_id].end - docs_info[doc_id].begin;
+            auto &read = doc_reads[i];
+            read.q_pos = first_query_offset(doc_id, ctx);
+            read.begin = read.q_pos >= 0 ? max(read.q_pos - options.snippet_len / 2 - SNIPPET_WINDOW_PAD, 0LL) : 0;
+            read.end = read.q_pos >= 0 ? min(read.q_pos + options.snippet_len / 2 + SNIPPET_WINDOW_PAD, size) : size;
+            auto &content = ctx.batch_contents[i];
+            content.resize(read.end - read.begin + 1);
+            content.back() = '\0';
+            batch.add(dataset_fd, content.data(), read.end - read.begin, docs_info[doc_id].begin + read.begin);
+        }
+        batch.submit();
+        size_t n_terms = sorted_infos->terms.size();
+        for (size_t i = 0; i < n_shown; i++) {
+            unsigned doc_id = sorted_infos->doc_ids[i];
+            json item;
+            item["rank"] = i + 1;
+            item["score"] = sorted_infos->scores[i];
+            if (n_terms > 0) {  // transformer and impact-ordered index do not have freqs
+                item["freqs"] = json::array();
+                for (size_t t = 0; t < n_terms; t++) {
+                    if (unsigned freq = sorted_infos->freqs[i * n_terms + t]) {
+                        item["freqs"].push_back({sorted_infos->terms[t], freq});
+                    }
+                }
+            }
             item["url"] = docs_info[doc_id].url;
-            size_t size = read_doc(doc_id);
-            memcpy(tokenize_buffer, doc_content, size + 1);
+            string snippet;
+            batch.wait(i);
+            ctx.doc_content.swap(ctx.batch_contents[i]);
+            const auto &read = doc_reads[i];
+            if (read.q_pos >= 0) {
+                // The window is widened until the snippet fits in it
+                auto size = docs_info[doc_id].end - docs_info[doc_id].begin;
+                long long window_begin = read.begin, window_end = read.end;
+                for (long long pad = SNIPPET_WINDOW_PAD * 2;
+                     !cut_snippet(ctx.doc_content.data(), window_begin, window_end, size, read.q_pos,
+                                  options.snippet_len, snippet); pad *= 2) {
+                    window_begin = max(read.q_pos - options.snippet_len / 2 - pad, 0LL);
+                    window_end = min(read.q_pos + options.snippet_len / 2 + pad, size);
+                    read_doc_window(doc_id, window_begin, window_end, ctx);
+                }
+                item["snippet"] = snippet;
+                result["data"].push_back(item);
+                continue;
+            }
+            auto size = (size_t) read.end;
+            ctx.tokenize_buffer.assign(ctx.doc_content.begin(), ctx.doc_content.end());
+            char *doc_content = ctx.doc_content.data();
+            char *tokenize_buffer = ctx.tokenize_buffer.data();
+            auto &words = ctx.words;
             words.clear();
             words.reserve(docs_info[doc_id].term_cnt);
             char *begin_p = tokenize_buffer;
@@ -518,7 +2468,7 @@ public:
                 begin_p += len;
             }
             // Find first occurrence of each query word
-            for (const auto &term: query_list) {
+            for (const auto &term: ctx.query_list) {
                 char *q_pos = nullptr;
                 for (const auto word: words) {
                     if (strcmp(word, term.c_str()) == 0) {
@@ -528,19 +2478,9 @@ public:
                 }
                 if (q_pos != nullptr) {
                     // Form snippet
-                    long long begin_pos = max((long long) (q_pos - tokenize_buffer) - options.snippet_len / 2, 0LL);
-                    while (begin_pos >= 0 && (doc_content[begin_pos] & 0x80) != 0) {  // keep complete utf-8 characters
-                        begin_pos--;
-                    }
-                    size_t end_pos = min((long long) (q_pos - tokenize_buffer) + options.snippet_len / 2, (long long) size);
-                    size_t original_end_pos = end_pos;
-                    while (end_pos < size && (doc_content[end_pos] & 0x80) != 0) {  // keep complete utf-8 characters
-                        end_pos++;
-                    }
-                    // include the last byte if the last character is an utf-8 character
-                    end_pos += (end_pos + 1 < size && end_pos != original_end_pos);
-                    doc_content[end_pos] = '\0';
-                    item["snippet"] = doc_content + begin_pos;
+                    cut_snippet(doc_content, 0, (long long) size, (long long) size, q_pos - tokenize_buffer,
+                                options.snippet_len, snippet);
+                    item["snippet"] = snippet;
                     result["data"].push_back(item);
                     break;
                 }
@@ -549,85 +2489,218 @@ public:
         if (result["data"].empty()) {
             result["count"] = 0;
         }
+
+        // Cache the response without its timing
+        auto rendered = make_shared<RenderedResult>();
+        rendered->result = result;
+        rendered->result.erase("time");
+        rendered->result.erase("cached");
+        rendered->n_bytes = rendered->result.dump().size();
+        rendered_cache.put(rendered_key, rendered);
         return result;
     }
 };
 
-class ConjunctiveSearcher : public Searcher {
+// BM25 searchers over the index, whose results can be extended: when more results are asked for than are cached,
+// only the docs ranked after the cached ones are selected and appended.
+class BM25Searcher : public Searcher {
 public:
-    explicit ConjunctiveSearcher(int cache_size) : Searcher(cache_size) {}
+    BM25Searcher(ShardedCache<Entry> &entry_cache, ShardedCache<PositionList> &position_cache, const Options &options) :
+            Searcher(entry_cache, options), position_cache(position_cache) {}
+
+    void clear_caches() override {
+        Searcher::clear_caches();
+        position_cache.clear();
+    }
+
+    json cache_stats() override {
+        json stats = Searcher::cache_stats();
+        stats["positions"] = position_cache.stats();
+        return stats;
+    }
+
+protected:
+    // Select the k best docs ranked after `after` (all of them if null), and count the matched docs.
+    virtual vector<pair<unsigned, float>>
+    rank_docs(const vector<EntryP> &entries, const Options &options, size_t k, const pair<unsigned, float> *after,
+              size_t &count) = 0;
+
+    // whether a doc has to contain every query word to match
+    virtual bool requires_all_terms() const = 0;
 
 private:
-    shared_ptr<ResultDocInfos>
-    collect_and_rank_docs(const string &, const string &cleaned_query, vector<string> &query_list,
-                          LRUCache<Entry> &entry_cache, Options &options, json &result) override {
-        // Check if query is in cache
-        auto sorted_infos = result_cache.get(cleaned_query);
-        if (sorted_infos) {
-            result["cached"] = true;
-            return sorted_infos;
-        }
-        result["cached"] = false;
+    ShardedCache<PositionList> &position_cache;  // shared by all BM25 searchers, only read by phrase queries
 
-        // Search query in storage_info
-        entries.clear();
-        for (const auto &term: query_list) {
-            if (storage_info.find(term) != storage_info.end()) {
-                // Check if entry is in cache
-                auto entry = entry_cache.get(term);
-                if (!entry) {
-                    entry = make_shared<Entry>();
-                    entry->term = term;
-                    entry->doc_ids.reserve(storage_info[term].doc_cnt);
-                    entry->freqs.reserve(storage_info[term].doc_cnt);
-                    // Read entry from file
-                    options.read_index(storage_info[term].ids_begin,
-                                       storage_info[term].freqs_begin,
-                                       storage_info[term].doc_cnt, entry);
-                    // Cache entry
-                    entry_cache.put(term, entry);
-                }
-                entries.push_back(entry);
-            }
-        }
-        if (entries.empty()) {
-            return sorted_infos;
+    shared_ptr<PositionList> get_positions(const Entry &entry, const StorageInfo &info, const Options &options) {
+        auto list = position_cache.get(entry.term);
+        if (list) {
+            return list;
         }
+        list = make_shared<PositionList>();
+        options.read_positions(info, list->bytes);
+        // Record where each block of postings begins, skipping freq positions for each posting
+        const unsigned char *p = list->bytes.data();
+        size_t ordinal = 0;
+        for (PostingCursor cursor(entry); !cursor.at_end(); cursor.next_block()) {
+            const unsigned *freqs = cursor.block_freqs();
+            for (size_t i = 0; i < cursor.block_size(); i++, ordinal++) {
+                if (ordinal % POSTING_BLOCK_SIZE == 0) {
+                    list->block_offsets.push_back((unsigned) (p - list->bytes.data()));
+                }
+                for (unsigned n = freqs[i]; n > 0;) {
+                    n -= (*p++ & 0x80) != 0;
+                }
+            }
+        }
+        position_cache.put(entry.term, list, entry.doc_cnt);
+        return list;
+    }
 
-        // Calculate infos and sort by score
-        infos.clear();
-        auto last_intersection = entries[0]->doc_ids;  // if not pointer, use & to avoid copy
-        vector<unsigned> current_intersection;
-        for (int i = 1; i < entries.size(); i++) {
-            set_intersection(last_intersection.begin(), last_intersection.end(),
-                             entries[i]->doc_ids.begin(), entries[i]->doc_ids.end(),
-                             back_inserter(current_intersection));
-            swap(last_intersection, current_intersection);
-            current_intersection.clear();
+    // Find the docs that match every phrase of the query, in doc id order. The lists of the phrase words are
+    // intersected first, and positions are only decoded for the docs in the intersection.
+    // Return false if the positions of a phrase word are unknown, and the phrases cannot be checked.
+    bool match_phrases(const QueryContext &ctx, const Options &options, vector<unsigned> &matches) {
+        vector<const Entry *> words;  // distinct phrase words
+        vector<shared_ptr<PositionList>> lists;
+        unordered_map<string, size_t> word_index;
+        for (const auto &phrase: ctx.phrases) {
+            for (const auto &term: phrase.terms) {
+                if (word_index.find(term) != word_index.end()) {
+                    continue;
+                }
+                auto it = std::find_if(ctx.entries.begin(), ctx.entries.end(), [&term](const EntryP &entry) {
+                    return entry->term == term;
+                });
+                if (it == ctx.entries.end()) {  // the word is in no doc, so neither is the phrase
+                    return true;
+                }
+                const auto &info = storage_info.at(term);
+                if (info.positions_begin < 0) {
+                    return false;
+                }
+                word_index[term] = words.size();
+                words.push_back(it->get());
+                lists.push_back(get_positions(**it, info, options));
+            }
+        }
+        vector<PostingCursor> cursors;
+        cursors.reserve(words.size());
+        size_t shortest = 0;
+        for (size_t j = 0; j < words.size(); j++) {
+            cursors.emplace_back(*words[j]);
+            if (words[j]->doc_cnt < words[shortest]->doc_cnt) {
+                shortest = j;
+            }
+        }
+        vector<vector<unsigned>> positions(words.size());
+        vector<vector<const vector<unsigned> *>> phrase_positions;
+        for (const auto &phrase: ctx.phrases) {
+            auto &pointers = phrase_positions.emplace_back();
+            for (const auto &term: phrase.terms) {
+                pointers.push_back(&positions[word_index[term]]);
+            }
+        }
+        while (!cursors[shortest].at_end()) {
+            unsigned doc_id = cursors[shortest].doc_id();
+            bool matched = true;
+            for (size_t j = 0; j < cursors.size(); j++) {
+                if (j == shortest) {
+                    continue;
+                }
+                if (!cursors[j].advance_to(doc_id)) {  // this list is exhausted, so is the intersection
+                    return true;
+                }
+                if (cursors[j].doc_id() != doc_id) {
+                    cursors[shortest].advance_to(cursors[j].doc_id());
+                    matched = false;
+                    break;
+                }
+            }
+            if (!matched) {
+                continue;
+            }
+            for (size_t j = 0; j < cursors.size(); j++) {
+                cursors[j].positions(*lists[j], positions[j]);
+            }
+            bool all_phrases = true;
+            for (size_t i = 0; i < ctx.phrases.size() && all_phrases; i++) {
+                all_phrases = phrase_matches(ctx.phrases[i], phrase_positions[i]);
+            }
+            if (all_phrases) {
+                matches.push_back(doc_id);
+            }
+            cursors[shortest].next();
         }
+        return true;
+    }
+
+    // Score the docs that match the phrases one at a time, in the same way as rank_docs()
+    vector<pair<unsigned, float>>
+    rank_matches(const vector<unsigned> &matches, const vector<EntryP> &entries, const Options &options, size_t k,
+                 const pair<unsigned, float> *after, size_t &count) {
+        vector<PostingCursor> cursors;
+        vector<float> idfs;
+        cursors.reserve(entries.size());
         for (const auto &entry: entries) {
-            for (auto doc_id: last_intersection) {
-                auto it = lower_bound(entry->doc_ids.begin(), entry->doc_ids.end(), doc_id);
-                if (it != entry->doc_ids.end() && *it == doc_id) {
-                    auto freq = entry->freqs[it - entry->doc_ids.begin()];
-                    infos[doc_id].score += BM25(freq, (unsigned) entry->doc_ids.size(),
-                                                docs_info[doc_id].term_cnt, options);
-                    infos[doc_id].freqs->emplace_back(entry->term, freq);
+            cursors.emplace_back(*entry);
+            idfs.push_back(BM25_IDF(entry->doc_cnt, options));
+        }
+        auto k1 = (float) (options.k + 1);
+        bool all_terms = requires_all_terms();
+        TopKHeap heap(k, after);
+        for (auto doc_id: matches) {
+            float score = 0;
+            bool matched = true;
+            for (size_t j = 0; j < cursors.size() && matched; j++) {
+                if (cursors[j].advance_to(doc_id) && cursors[j].doc_id() == doc_id) {
+                    score += BM25(cursors[j].freq(), doc_id, idfs[j], k1);
+                } else {
+                    matched = !all_terms;
                 }
             }
+            if (matched) {
+                count++;
+                heap.push(doc_id, score);
+            }
         }
+        return heap.take_sorted();
+    }
 
-        // Sort by score
-        sorted_infos = make_shared<ResultDocInfos>();
-        sorted_infos->reserve(infos.size());
-        for (const auto &info: infos) {
-            sorted_infos->emplace_back(info);
+    shared_ptr<ResultDocInfos>
+    collect_and_rank_docs(const string &, const string &cleaned_query, QueryContext &ctx,
+                          const Options &options, json &result) override {
+        // Check if query is in cache, and if enough results are kept
+        auto cached = result_cache.get(cleaned_query);
+        if (cached && cached->covers(options.n_results)) {
+            result["cached"] = true;
+            return cached;
         }
-        sort(sorted_infos->begin(), sorted_infos->end(),
-             [](const pair<unsigned, ResultDocInfo> &lhs, const pair<unsigned, ResultDocInfo> &rhs) {
-                 return lhs.second.score > rhs.second.score ||
-                        (lhs.second.score == rhs.second.score && lhs.first < rhs.first);
-             });
+        result["cached"] = false;
+
+        // Search query in storage_info
+        collect_entries(ctx, options);
+        if (ctx.entries.empty()) {
+            return nullptr;
+        }
+
+        auto sorted_infos = make_shared<ResultDocInfos>();
+        size_t k = options.n_results;
+        pair<unsigned, float> last;
+        const pair<unsigned, float> *after = nullptr;
+        if (cached) {
+            // Continue after the cached results, and at least double them so that paging does not rank every time
+            *sorted_infos = *cached;
+            last = {cached->doc_ids.back(), cached->scores.back()};
+            after = &last;
+            k = max(k, 2 * cached->size()) - cached->size();
+        }
+        size_t count = 0;
+        vector<unsigned> matches;
+        auto top = !ctx.phrases.empty() && positions_fd >= 0 && match_phrases(ctx, options, matches) ?
+                   rank_matches(matches, ctx.entries, options, k, after, count) :
+                   rank_docs(ctx.entries, options, k, after, count);
+        sorted_infos->count = count;
+        append_results(*sorted_infos, top, ctx.entries);
 
         // Cache result
         result_cache.put(cleaned_query, sorted_infos);
@@ -635,88 +2708,1351 @@ private:
     }
 };
 
-class DisjunctiveSearcher : public Searcher {
+class ConjunctiveSearcher : public BM25Searcher {
 public:
-    explicit DisjunctiveSearcher(int cache_size) : Searcher(cache_size) {}
+    ConjunctiveSearcher(ShardedCache<Entry> &entry_cache, ShardedCache<PositionList> &position_cache,
+                        const Options &options) : BM25Searcher(entry_cache, position_cache, options) {}
 
 private:
-    shared_ptr<ResultDocInfos>
-    collect_and_rank_docs(const string &, const string &cleaned_query, vector<string> &query_list,
-                          LRUCache<Entry> &entry_cache, Options &options, json &result) override {
-        // Check if query is in cache
-        auto sorted_infos = result_cache.get(cleaned_query);
-        if (sorted_infos) {
-            result["cached"] = true;
-            return sorted_infos;
-        }
-        result["cached"] = false;
+    bool requires_all_terms() const override {
+        return true;
+    }
 
-        // Search query in storage_info
-        entries.clear();
-        for (const auto &term: query_list) {
-            if (storage_info.find(term) != storage_info.end()) {
-                // Check if entry is in cache
-                auto entry = entry_cache.get(term);
-                if (!entry) {
-                    entry = make_shared<Entry>();
-                    entry->term = term;
-                    entry->doc_ids.reserve(storage_info[term].doc_cnt);
-                    entry->freqs.reserve(storage_info[term].doc_cnt);
-                    // Read entry from file
-                    options.read_index(storage_info[term].ids_begin,
-                                       storage_info[term].freqs_begin,
-                                       storage_info[term].doc_cnt, entry);
-                    // Cache entry
-                    entry_cache.put(term, entry);
-                }
-                entries.push_back(entry);
-            }
-        }
-        if (entries.empty()) {
+    vector<pair<unsigned, float>>
+    rank_docs(const vector<EntryP> &entries, const Options &options, size_t k, const pair<unsigned, float> *after,
+              size_t &count) override {
+        // Intersect from the shortest list, scoring each match in the same pass
+        vector<const Entry *> lists;
+        for (const auto &entry: entries) {
+            lists.push_back(entry.get());
+        }
+        sort(lists.begin(), lists.end(), [](const Entry *lhs, const Entry *rhs) {
+            return lhs->doc_cnt < rhs->doc_cnt;
+        });
+        vector<PostingCursor> cursors;
+        vector<float> idfs;
+        cursors.reserve(lists.size());
+        for (auto list: lists) {
+            cursors.emplace_back(*list);
+            idfs.push_back(BM25_IDF(list->doc_cnt, options));
+        }
+        auto k1 = (float) (options.k + 1);
+        TopKHeap heap(k, after);
+        PostingCursor &shortest = cursors[0];
+        bool exhausted = false;
+        while (!exhausted && !shortest.at_end()) {
+            unsigned doc_id = shortest.doc_id();
+            bool matched = true;
+            for (size_t j = 1; j < cursors.size(); j++) {
+                if (!cursors[j].advance_to(doc_id)) {  // this list is exhausted, so is the intersection
+                    exhausted = true;
+                    matched = false;
+                    break;
+                }
+                if (cursors[j].doc_id() != doc_id) {
+                    // skip the shortest list forward to the candidate of the longer list
+                    shortest.advance_to(cursors[j].doc_id());
+                    matched = false;
+                    break;
+                }
+            }
+            if (!matched) {
+                continue;
+            }
+            count++;
+            float score = 0;
+            for (size_t j = 0; j < cursors.size(); j++) {
+                score += BM25(cursors[j].freq(), doc_id, idfs[j], k1);
+            }
+            heap.push(doc_id, score);
+            shortest.next();
+        }
+        return heap.take_sorted();
+    }
+};
+
+class DisjunctiveSearcher : public BM25Searcher {
+public:
+    DisjunctiveSearcher(ShardedCache<Entry> &entry_cache, ShardedCache<PositionList> &position_cache,
+                        const Options &options) : BM25Searcher(entry_cache, position_cache, options) {}
+
+private:
+    bool requires_all_terms() const override {
+        return false;
+    }
+
+    vector<pair<unsigned, float>>
+    rank_docs(const vector<EntryP> &entries, const Options &options, size_t k, const pair<unsigned, float> *after,
+              size_t &count) override {
+        // Accumulate scores term by term, a block of postings at a time, and select the top ones
+        constexpr size_t BLOCK_SIZE = 256;
+        float scores[BLOCK_SIZE];
+        auto &accumulator = thread_accumulator();
+        auto k1 = (float) (options.k + 1);
+        for (const auto &entry: entries) {
+            float idf = BM25_IDF(entry->doc_cnt, options);
+            for (PostingCursor cursor(*entry); !cursor.at_end(); cursor.next_block()) {
+                const unsigned *doc_ids = cursor.block_doc_ids(), *freqs = cursor.block_freqs();
+                for (size_t begin = 0; begin < cursor.block_size(); begin += BLOCK_SIZE) {
+                    size_t n = min(BLOCK_SIZE, cursor.block_size() - begin);
+                    BM25_block(doc_ids + begin, freqs + begin, n, idf, k1, scores);
+                    for (size_t i = 0; i < n; i++) {
+                        accumulator.add(doc_ids[begin + i], scores[i]);
+                    }
+                }
+            }
+        }
+        auto top = accumulator.top_k(k, after);
+        count = accumulator.size();
+        accumulator.reset();
+        return top;
+    }
+};
+
+struct ImpactStorageInfo {
+    long long begin = 0, n_bytes = 0;
+    unsigned doc_cnt = 0;
+};
+
+// Postings of a term in the impact-ordered index, grouped into segments from the highest impact to the lowest.
+struct ImpactEntry {
+    vector<unsigned char> impacts;
+    vector<unsigned> segment_ends;  // segment i is doc_ids[segment_ends[i - 1], segment_ends[i])
+    vector<unsigned> doc_ids;
+};
+
+size_t cache_charge(const ImpactEntry &entry) {
+    return sizeof(ImpactEntry) + entry.impacts.capacity() +
+           (entry.segment_ends.capacity() + entry.doc_ids.capacity()) * sizeof(unsigned);
+}
+
+// Score-at-a-time search over the impact-ordered index built by merge_index -a true.
+// Segments of all query terms are processed from the highest impact to the lowest,
+// and the search stops early when the posting budget or the time budget runs out.
+class ImpactSearcher : public Searcher {
+private:
+    int impact_fd;
+    double impact_scale = 1;  // BM25 score of an impact of 1
+    unordered_map<string, ImpactStorageInfo> impact_storage_info;
+    ShardedCache<ImpactEntry> impact_entry_cache;
+
+    static shared_ptr<ImpactEntry> decode_impact_entry(const ImpactStorageInfo &info,
+                                                       const vector<unsigned char> &bytes) {
+        auto entry = make_shared<ImpactEntry>();
+        entry->doc_ids.reserve(info.doc_cnt);
+        size_t pos = 0;
+        auto next_vbyte = [&bytes, &pos]() {
+            unsigned value = 0, shift = 0;
+            while (!(bytes[pos] & 0x80)) {
+                value |= (bytes[pos++] & 0x7f) << shift;
+                shift += 7;
+            }
+            return value | ((bytes[pos++] & 0x7f) << shift);
+        };
+        while (pos < bytes.size()) {
+            entry->impacts.push_back(bytes[pos++]);
+            unsigned cnt = next_vbyte();
+            unsigned doc_id = 0;
+            for (unsigned i = 0; i < cnt; i++) {
+                doc_id += next_vbyte();
+                entry->doc_ids.push_back(doc_id);
+            }
+            entry->segment_ends.push_back((unsigned) entry->doc_ids.size());
+        }
+        return entry;
+    }
+
+    shared_ptr<ResultDocInfos>
+    collect_and_rank_docs(const string &, const string &cleaned_query, QueryContext &ctx,
+                          const Options &options, json &result) override {
+        // Check if query is in cache, and if enough results are kept
+        auto sorted_infos = result_cache.get(cleaned_query);
+        if (sorted_infos && sorted_infos->covers(options.n_results)) {
+            result["cached"] = true;
+            return sorted_infos;
+        }
+        sorted_infos = nullptr;
+        result["cached"] = false;
+
+        // Collect segments of all query terms
+        struct Segment {
+            unsigned char impact;
+            const unsigned *begin, *end;
+        };
+        vector<shared_ptr<ImpactEntry>> impact_entries;
+        vector<Segment> segments;
+        // The entries that are not cached are read in one batch
+        struct Miss {
+            size_t index;  // in impact_entries
+            const string *term;
+            const ImpactStorageInfo *info;
+            vector<unsigned char> bytes;
+        };
+        vector<Miss> misses;
+        ReadBatch batch;
+        for (const auto &term: ctx.query_list) {
+            auto it = impact_storage_info.find(term);
+            if (it == impact_storage_info.end()) {
+                continue;
+            }
+            auto entry = impact_entry_cache.get(term);
+            if (!entry) {
+                misses.push_back({impact_entries.size(), &term, &it->second,
+                                  vector<unsigned char>(it->second.n_bytes)});
+                batch.add(impact_fd, misses.back().bytes.data(), it->second.n_bytes, it->second.begin);
+            }
+            impact_entries.push_back(entry);
+        }
+        batch.submit();
+        for (size_t i = 0; i < misses.size(); i++) {
+            batch.wait(i);
+            auto entry = decode_impact_entry(*misses[i].info, misses[i].bytes);
+            misses[i].bytes = {};
+            impact_entry_cache.put(*misses[i].term, entry);
+            impact_entries[misses[i].index] = entry;
+        }
+        for (const auto &entry: impact_entries) {
+            unsigned segment_begin = 0;
+            for (size_t i = 0; i < entry->impacts.size(); i++) {
+                segments.push_back({entry->impacts[i], entry->doc_ids.data() + segment_begin,
+                                    entry->doc_ids.data() + entry->segment_ends[i]});
+                segment_begin = entry->segment_ends[i];
+            }
+        }
+        if (segments.empty()) {
             return sorted_infos;
         }
+        stable_sort(segments.begin(), segments.end(), [](const Segment &lhs, const Segment &rhs) {
+            return lhs.impact > rhs.impact;
+        });
+
+        // Accumulate impacts from the highest segments until a budget runs out
+        constexpr long long TIME_CHECK_INTERVAL = 4096;  // postings between two clock reads
+        auto &accumulator = thread_accumulator();
+        auto start = std::chrono::steady_clock::now();
+        long long n_postings = 0;
+        bool complete = true;
+        for (const auto &segment: segments) {
+            for (auto p = segment.begin; p < segment.end;) {
+                if ((options.posting_budget > 0 && n_postings >= options.posting_budget) ||
+                    (options.time_budget > 0 && std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - start).count() >= (double) options.time_budget)) {
+                    complete = false;
+                    break;
+                }
+                long long n = min((long long) (segment.end - p), TIME_CHECK_INTERVAL);
+                if (options.posting_budget > 0) {
+                    n = min(n, options.posting_budget - n_postings);
+                }
+                for (auto end = p + n; p < end; p++) {
+                    accumulator.add(*p, segment.impact);
+                }
+                n_postings += n;
+            }
+            if (!complete) {
+                break;
+            }
+        }
+        result["complete"] = complete;
+        result["postings"] = n_postings;
+
+        sorted_infos = make_shared<ResultDocInfos>();
+        sorted_infos->count = accumulator.size();
+        for (auto [doc_id, impact_sum]: accumulator.top_k(options.n_results)) {
+            sorted_infos->doc_ids.push_back(doc_id);
+            sorted_infos->scores.push_back((float) (impact_sum * impact_scale));
+        }
+        accumulator.reset();
+
+        // Cache result
+        result_cache.put(cleaned_query, sorted_infos);
+        return sorted_infos;
+    }
+
+public:
+    ImpactSearcher(ShardedCache<Entry> &entry_cache, size_t impact_cache_bytes, const Options &options) :
+            Searcher(entry_cache, options), impact_entry_cache(impact_cache_bytes) {
+        printf("Reading impact storage info from %s...", options.impact_storage_path);
+        fflush(stdout);
+        ifstream fin(options.impact_storage_path);
+        if (!fin.is_open()) {
+            cerr << "Failed to open file " << options.impact_storage_path << endl;
+            exit(EXIT_FAILURE);
+        }
+        string term;
+        ImpactStorageInfo info;
+        while (fin >> term >> info.begin >> info.n_bytes >> info.doc_cnt) {
+            impact_storage_info[term] = info;
+        }
+        fin.close();
+        impact_fd = open_guarded(options.impact_index_path);
+        pread_guarded(impact_fd, &impact_scale, sizeof(double), 0);  // first in the header
+        printf("done\n");
+    }
+
+    void clear_caches() override {
+        Searcher::clear_caches();
+        impact_entry_cache.clear();
+    }
+
+    json cache_stats() override {
+        json stats = Searcher::cache_stats();
+        stats["impact_entries"] = impact_entry_cache.stats();
+        return stats;
+    }
+
+    ~ImpactSearcher() override {
+        close(impact_fd);
+    }
+};
+
+// Corpus embeddings exported by export_embeddings.py: two unsigned (n, dim), then n rows of dim floats of unit
+// length, so that the dot product of two rows is their cosine similarity
+struct Embeddings {
+    unsigned n = 0, dim = 0;
+    const float *data = nullptr;
+
+    const float *row(unsigned i) const {
+        return data + (size_t) i * dim;
+    }
+};
+
+// Header of the graph file written by build_hnsw, see there for the layout of the sections after it
+struct GraphHeader {
+    char magic[8];
+    unsigned n, dim, m, max_level, entry_point, reserved;
+    unsigned long long levels_begin, level0_begin, upper_offsets_begin, upper_begin, size;
+};
+
+constexpr char GRAPH_MAGIC[8] = "HNSW v1";
+constexpr unsigned SEMANTIC_TOP_K = 32;  // top_k of learning_to_rank.py
+
+float dot(const float *a, const float *b, unsigned dim) {
+    unsigned i = 0;
+    float sum = 0;
+#ifdef __AVX2__
+    __m256 sum_v = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        sum_v = _mm256_add_ps(sum_v, _mm256_mul_ps(_mm256_loadu_ps(a + i), _mm256_loadu_ps(b + i)));
+    }
+    __m128 sum_4 = _mm_add_ps(_mm256_castps256_ps128(sum_v), _mm256_extractf128_ps(sum_v, 1));
+    sum_4 = _mm_hadd_ps(sum_4, sum_4);
+    sum_4 = _mm_hadd_ps(sum_4, sum_4);
+    sum = _mm_cvtss_f32(sum_4);
+#endif
+    for (; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+// Map a whole file to memory read-only, or read it into memory where mmap is not used
+const char *map_file(const char *path, size_t &size) {
+    int fd = open_guarded(path);
+    size = (size_t) std::filesystem::file_size(path);
+#ifdef __linux__
+    void *data = mmap(nullptr, max(size, (size_t) 1), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror((string("Failed to map file ") + path).c_str());
+        exit(EXIT_FAILURE);
+    }
+#else
+    auto data = (char *) malloc(max(size, (size_t) 1));
+    if (data == nullptr) {
+        cerr << "Failed to allocate memory for " << path << endl;
+        exit(EXIT_FAILURE);
+    }
+    pread_guarded(fd, data, size, 0);
+#endif
+    close(fd);
+    return (const char *) data;
+}
+
+Embeddings load_embeddings(const char *path) {
+    size_t size;
+    const char *data = map_file(path, size);
+    Embeddings embeddings;
+    if (size >= 2 * sizeof(unsigned)) {
+        memcpy(&embeddings.n, data, sizeof(unsigned));
+        memcpy(&embeddings.dim, data + sizeof(unsigned), sizeof(unsigned));
+    }
+    if (size < 2 * sizeof(unsigned) ||
+        size != 2 * sizeof(unsigned) + (size_t) embeddings.n * embeddings.dim * sizeof(float)) {
+        cerr << "Invalid embeddings file " << path << ", export it with export_embeddings.py" << endl;
+        exit(EXIT_FAILURE);
+    }
+    embeddings.data = (const float *) (data + 2 * sizeof(unsigned));
+    return embeddings;
+}
+
+// HNSW graph built by build_hnsw over the corpus embeddings, both mapped to memory and searched in place by any
+// number of threads at once, without the GIL
+class HnswIndex {
+private:
+    using Candidate = pair<float, unsigned>;  // distance (negative similarity) and corpus id
+
+    Embeddings embeddings;
+    const GraphHeader *header = nullptr;
+    const unsigned *level0 = nullptr;
+    const unsigned long long *upper_offsets = nullptr;
+    const unsigned *upper = nullptr;
+
+    const unsigned *links(unsigned node, unsigned level) const {
+        if (level == 0) {
+            return level0 + (size_t) node * (1 + 2 * header->m);
+        }
+        return upper + (upper_offsets[node] + level - 1) * (1 + header->m);
+    }
+
+    // Best-first search of one level from entry, keeping the ef nearest nodes, returned from the nearest
+    vector<Candidate> search_level(const float *query, Candidate entry, unsigned ef, unsigned level) const {
+        // a node is visited if its tag is the epoch of the current search on this thread
+        thread_local vector<unsigned> tags;
+        thread_local unsigned epoch = 0;
+        if (tags.size() != embeddings.n) {
+            tags.assign(embeddings.n, 0);
+            epoch = 0;
+        }
+        if (++epoch == 0) {
+            std::fill(tags.begin(), tags.end(), 0);
+            epoch = 1;
+        }
+        tags[entry.second] = epoch;
+        std::priority_queue<Candidate, vector<Candidate>, std::greater<>> candidates;  // nearest on top
+        std::priority_queue<Candidate> nearest;  // farthest on top
+        candidates.push(entry);
+        nearest.push(entry);
+        while (!candidates.empty()) {
+            Candidate candidate = candidates.top();
+            if (candidate.first > nearest.top().first) {
+                break;  // all the remaining candidates are farther than the ef nearest nodes
+            }
+            candidates.pop();
+            const unsigned *node_links = links(candidate.second, level);
+            for (unsigned i = 1; i <= node_links[0]; i++) {
+                unsigned neighbor = node_links[i];
+                if (tags[neighbor] == epoch) {
+                    continue;
+                }
+                tags[neighbor] = epoch;
+                float distance = -dot(query, embeddings.row(neighbor), embeddings.dim);
+                if (nearest.size() < ef || distance < nearest.top().first) {
+                    candidates.emplace(distance, neighbor);
+                    nearest.emplace(distance, neighbor);
+                    if (nearest.size() > ef) {
+                        nearest.pop();
+                    }
+                }
+            }
+        }
+        vector<Candidate> result(nearest.size());
+        for (size_t i = result.size(); i-- > 0; nearest.pop()) {
+            result[i] = nearest.top();
+        }
+        return result;
+    }
+
+public:
+    explicit HnswIndex(const Options &options) {
+        printf("Mapping HNSW graph %s and embeddings %s...", options.hnsw_path, options.embeddings_path);
+        fflush(stdout);
+        embeddings = load_embeddings(options.embeddings_path);
+        size_t size;
+        const char *data = map_file(options.hnsw_path, size);
+        header = (const GraphHeader *) data;
+        if (size < sizeof(GraphHeader) || memcmp(header->magic, GRAPH_MAGIC, sizeof(GRAPH_MAGIC)) != 0 ||
+            header->size != size) {
+            cerr << "Invalid HNSW graph file " << options.hnsw_path << ", build it with build_hnsw" << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (header->n != embeddings.n || header->dim != embeddings.dim || embeddings.n == 0) {
+            cerr << "The HNSW graph " << options.hnsw_path << " was not built from " << options.embeddings_path
+                 << endl;
+            exit(EXIT_FAILURE);
+        }
+        level0 = (const unsigned *) (data + header->level0_begin);
+        upper_offsets = (const unsigned long long *) (data + header->upper_offsets_begin);
+        upper = (const unsigned *) (data + header->upper_begin);
+        printf("done, %u embeddings of %u dimensions\n", embeddings.n, embeddings.dim);
+    }
+
+    unsigned dim() const {
+        return embeddings.dim;
+    }
+
+    // The k nearest corpus ids with their cosine similarities, found by descending the levels greedily and
+    // searching level 0 with ef candidates
+    vector<pair<unsigned, float>> search(const float *query, unsigned k, unsigned ef) const {
+        unsigned entry_point = header->entry_point;
+        Candidate entry{-dot(query, embeddings.row(entry_point), embeddings.dim), entry_point};
+        for (unsigned l = header->max_level; l > 0; l--) {
+            entry = search_level(query, entry, 1, l)[0];
+        }
+        auto nearest = search_level(query, entry, max(ef, k), 0);
+        vector<pair<unsigned, float>> results;
+        for (size_t i = 0; i < min((size_t) k, nearest.size()); i++) {
+            results.emplace_back(nearest[i].second, -nearest[i].first);
+        }
+        return results;
+    }
+};
+
+enum class FlatType : unsigned {
+    INT8, FP16
+};
+
+// Header of the flat store written by quantize_embeddings, see there for the layout of the sections after it
+struct FlatHeader {
+    char magic[8];
+    unsigned n, dim;
+    FlatType type;
+    unsigned has_sketch;
+    unsigned long long scales_begin, vectors_begin, sketch_begin, size;
+};
+
+constexpr char FLAT_MAGIC[8] = "FLAT v1";
+
+// Dot product of int8 vectors with components in [-127, 127]
+int dot_int8(const signed char *a, const signed char *b, unsigned dim) {
+    unsigned i = 0;
+    int sum = 0;
+#ifdef __AVX2__
+    __m256i sum_v = _mm256_setzero_si256();
+    const __m256i ones = _mm256_set1_epi16(1);
+    for (; i + 32 <= dim; i += 32) {
+        __m256i a_v = _mm256_loadu_si256((const __m256i *) (a + i));
+        __m256i b_v = _mm256_loadu_si256((const __m256i *) (b + i));
+        // maddubs multiplies unsigned bytes by signed ones, so the sign of a is moved to b,
+        // and the sum of two products is at most 2 * 127 * 127, which does not saturate
+        __m256i products = _mm256_maddubs_epi16(_mm256_abs_epi8(a_v), _mm256_sign_epi8(b_v, a_v));
+        sum_v = _mm256_add_epi32(sum_v, _mm256_madd_epi16(products, ones));
+    }
+    __m128i sum_4 = _mm_add_epi32(_mm256_castsi256_si128(sum_v), _mm256_extracti128_si256(sum_v, 1));
+    sum_4 = _mm_hadd_epi32(sum_4, sum_4);
+    sum_4 = _mm_hadd_epi32(sum_4, sum_4);
+    sum = _mm_cvtsi128_si32(sum_4);
+#endif
+    for (; i < dim; i++) {
+        sum += a[i] * b[i];
+    }
+    return sum;
+}
+
+float half_to_float(unsigned short half) {
+    unsigned sign = (unsigned) (half & 0x8000) << 16;
+    unsigned exponent = (half >> 10) & 0x1f;
+    unsigned mantissa = half & 0x3ff;
+    float value;
+    if (exponent == 0) {
+        value = std::ldexp((float) mantissa, -24);
+    } else if (exponent == 31) {
+        value = mantissa ? NAN : INFINITY;
+    } else {
+        value = std::ldexp((float) (mantissa | 0x400), (int) exponent - 25);
+    }
+    unsigned bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits |= sign;
+    memcpy(&value, &bits, sizeof(bits));
+    return value;
+}
+
+// Dot product of fp16 components with float ones, converted 8 at a time with F16C
+float dot_fp16(const unsigned short *a, const float *b, unsigned dim) {
+    unsigned i = 0;
+    float sum = 0;
+#if defined(__AVX2__) && (defined(__F16C__) || defined(_MSC_VER))
+    __m256 sum_v = _mm256_setzero_ps();
+    for (; i + 8 <= dim; i += 8) {
+        __m256 a_v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *) (a + i)));
+        sum_v = _mm256_add_ps(sum_v, _mm256_mul_ps(a_v, _mm256_loadu_ps(b + i)));
+    }
+    __m128 sum_4 = _mm_add_ps(_mm256_castps256_ps128(sum_v), _mm256_extractf128_ps(sum_v, 1));
+    sum_4 = _mm_hadd_ps(sum_4, sum_4);
+    sum_4 = _mm_hadd_ps(sum_4, sum_4);
+    sum = _mm_cvtss_f32(sum_4);
+#endif
+    for (; i < dim; i++) {
+        sum += half_to_float(a[i]) * b[i];
+    }
+    return sum;
+}
+
+// Exact semantic search over the quantized flat store of quantize_embeddings, scanned in partitions on a pool of
+// threads without the GIL. Candidates may first be narrowed by the Hamming distance of their sign sketch to the
+// query's, then the best ones by quantized dot product are re-scored with the float embeddings.
+class FlatIndex {
+private:
+    using Candidate = pair<float, unsigned>;  // approximate similarity and corpus id
+
+    Embeddings embeddings;  // only read for the re-scored candidates
+    const FlatHeader *header = nullptr;
+    const float *scales = nullptr;
+    const char *vectors = nullptr;
+    const unsigned long long *sketch = nullptr;  // null without a sketch or with --flat-sketch-keep 0
+    unsigned sketch_keep, rescore;
+    int n_partitions;
+    unique_ptr<ThreadPool> pool;
+
+    // The rescore most similar vectors of a partition, with the sketch prefilter if any
+    vector<Candidate> scan_partition(unsigned begin, unsigned end, const float *query,
+                                     const signed char *query_int8, float query_scale,
+                                     const unsigned long long *query_sketch) const {
+        unsigned dim = header->dim;
+        vector<unsigned> ids;  // to be scored, all of the partition without the sketch
+        if (sketch != nullptr) {
+            // Keep the vectors whose signs differ least from the query's, a share of sketch_keep as large as the
+            // partition, found by a histogram of the distances
+            size_t words = dim / 64;
+            vector<unsigned short> distances(end - begin);
+            vector<unsigned> histogram(dim + 1);
+            for (unsigned i = begin; i < end; i++) {
+                unsigned distance = 0;
+                for (size_t w = 0; w < words; w++) {
+                    distance += std::popcount(sketch[i * words + w] ^ query_sketch[w]);
+                }
+                distances[i - begin] = (unsigned short) distance;
+                histogram[distance]++;
+            }
+            size_t keep = ((size_t) sketch_keep * (end - begin) + header->n - 1) / header->n;
+            unsigned threshold = 0;
+            for (size_t cnt = 0; threshold <= dim && cnt + histogram[threshold] <= keep; threshold++) {
+                cnt += histogram[threshold];
+            }
+            size_t n_at_threshold = keep;  // vectors at the threshold distance still kept
+            for (unsigned d = 0; d < threshold; d++) {
+                n_at_threshold -= histogram[d];
+            }
+            for (unsigned i = begin; i < end; i++) {
+                unsigned distance = distances[i - begin];
+                if (distance < threshold || (distance == threshold && n_at_threshold > 0 && n_at_threshold--)) {
+                    ids.push_back(i);
+                }
+            }
+        } else {
+            ids.resize(end - begin);
+            for (unsigned i = begin; i < end; i++) {
+                ids[i - begin] = i;
+            }
+        }
+        std::priority_queue<Candidate, vector<Candidate>, std::greater<>> best;  // least similar on top
+        for (unsigned i: ids) {
+            float similarity;
+            if (header->type == FlatType::INT8) {
+                similarity = (float) dot_int8((const signed char *) vectors + (size_t) i * dim, query_int8, dim) *
+                             scales[i] * query_scale;
+            } else {
+                similarity = dot_fp16((const unsigned short *) vectors + (size_t) i * dim, query, dim) * scales[i];
+            }
+            if (best.size() < rescore) {
+                best.emplace(similarity, i);
+            } else if (similarity > best.top().first) {
+                best.pop();
+                best.emplace(similarity, i);
+            }
+        }
+        vector<Candidate> result;
+        for (; !best.empty(); best.pop()) {
+            result.push_back(best.top());
+        }
+        return result;
+    }
+
+public:
+    explicit FlatIndex(const Options &options) : sketch_keep((unsigned) options.flat_sketch_keep),
+                                                 rescore(max((unsigned) options.flat_rescore, SEMANTIC_TOP_K)),
+                                                 n_partitions(options.flat_threads) {
+        printf("Mapping flat store %s and embeddings %s...", options.flat_path, options.embeddings_path);
+        fflush(stdout);
+        embeddings = load_embeddings(options.embeddings_path);
+        size_t size;
+        const char *data = map_file(options.flat_path, size);
+        header = (const FlatHeader *) data;
+        if (size < sizeof(FlatHeader) || memcmp(header->magic, FLAT_MAGIC, sizeof(FLAT_MAGIC)) != 0 ||
+            header->size != size) {
+            cerr << "Invalid flat store file " << options.flat_path << ", write it with quantize_embeddings" << endl;
+            exit(EXIT_FAILURE);
+        }
+        if (header->n != embeddings.n || header->dim != embeddings.dim || embeddings.n == 0) {
+            cerr << "The flat store " << options.flat_path << " was not written from " << options.embeddings_path
+                 << endl;
+            exit(EXIT_FAILURE);
+        }
+        scales = (const float *) (data + header->scales_begin);
+        vectors = data + header->vectors_begin;
+        if (header->has_sketch && sketch_keep > 0 && sketch_keep < header->n) {
+            sketch = (const unsigned long long *) (data + header->sketch_begin);
+        }
+        n_partitions = (int) min((unsigned) n_partitions, header->n);
+        pool = make_unique<ThreadPool>(n_partitions);
+        printf("done, %u %s embeddings of %u dimensions%s, %.1f MiB\n", header->n,
+               header->type == FlatType::INT8 ? "int8" : "fp16", header->dim,
+               header->has_sketch ? " with sign sketches" : "", (double) size / (1 << 20));
+    }
+
+    unsigned dim() const {
+        return embeddings.dim;
+    }
+
+    // The k most similar corpus ids with their cosine similarities
+    vector<pair<unsigned, float>> search(const float *query, unsigned k) const {
+        unsigned dim = header->dim;
+        float max_abs = 0;
+        for (unsigned d = 0; d < dim; d++) {
+            max_abs = max(max_abs, std::fabs(query[d]));
+        }
+        float query_scale = max_abs > 0 ? max_abs / 127 : 1;
+        vector<signed char> query_int8(dim);
+        for (unsigned d = 0; d < dim; d++) {
+            query_int8[d] = (signed char) std::lround(query[d] / query_scale);
+        }
+        vector<unsigned long long> query_sketch(dim / 64);
+        for (unsigned d = 0; d < query_sketch.size() * 64; d++) {
+            if (query[d] < 0) {
+                query_sketch[d / 64] |= 1ULL << (d % 64);
+            }
+        }
+
+        // Scan all partitions at once and wait for the last one
+        vector<vector<Candidate>> partition_results(n_partitions);
+        std::mutex mutex;
+        std::condition_variable cv;
+        int remaining = n_partitions;
+        for (int t = 0; t < n_partitions; t++) {
+            pool->post([&, t] {
+                auto begin = (unsigned) ((unsigned long long) header->n * t / n_partitions);
+                auto end = (unsigned) ((unsigned long long) header->n * (t + 1) / n_partitions);
+                partition_results[t] = scan_partition(begin, end, query, query_int8.data(), query_scale,
+                                                      query_sketch.data());
+                std::lock_guard<std::mutex> lock(mutex);
+                remaining--;
+                cv.notify_one();  // under the lock, as the waiting query may return as soon as it is released
+            });
+        }
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&remaining] { return remaining == 0; });
+        }
+
+        // Re-score the best candidates of all partitions with the float embeddings
+        vector<Candidate> candidates;
+        for (const auto &partition_result: partition_results) {
+            candidates.insert(candidates.end(), partition_result.begin(), partition_result.end());
+        }
+        size_t n_rescored = min((size_t) rescore, candidates.size());
+        std::partial_sort(candidates.begin(), candidates.begin() + (long) n_rescored, candidates.end(),
+                          std::greater<>());
+        candidates.resize(n_rescored);
+        for (auto &candidate: candidates) {
+            candidate.first = dot(query, embeddings.row(candidate.second), dim);
+        }
+        sort(candidates.begin(), candidates.end(), std::greater<>());
+        vector<pair<unsigned, float>> results;
+        for (size_t i = 0; i < min((size_t) k, candidates.size()); i++) {
+            results.emplace_back(candidates[i].second, candidates[i].first);
+        }
+        return results;
+    }
+};
+
+// The items of a C-contiguous buffer returned by Python, such as a numpy array, read in bulk without a PyObject per
+// item. T is long long for int64 arrays, or float for float32 arrays, which may also be given as raw bytes.
+// Exits if the buffer holds anything else, as on other errors of the Python functions.
+template<typename T>
+class PyBufferView {
+private:
+    Py_buffer view{};
+
+public:
+    PyBufferView(PyObject *pObject, const char *function) {
+        if (PyObject_GetBuffer(pObject, &view, PyBUF_C_CONTIGUOUS | PyBUF_FORMAT) < 0) {
+            PyErr_Print();
+            cerr << function << " must return contiguous arrays" << endl;
+            exit(EXIT_FAILURE);
+        }
+        char format = view.format != nullptr ? view.format[strlen(view.format) - 1] : 'B';  // without a byte order
+        bool valid = std::is_same_v<T, float> ? (format == 'f' && view.itemsize == 4) ||
+                                                (format == 'B' && view.len % sizeof(float) == 0)
+                                              : (format == 'q' || format == 'l') && view.itemsize == 8;
+        if (!valid) {
+            cerr << function << " must return " << (std::is_same_v<T, float> ? "float32" : "int64") << " arrays"
+                 << endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    ~PyBufferView() {
+        PyBuffer_Release(&view);
+    }
+
+    const T *data() const {
+        return (const T *) view.buf;
+    }
+
+    size_t size() const {
+        return view.len / sizeof(T);
+    }
+};
+
+// Corpus ids and scores of n_rows queries, returned by semantic_search or semantic_search_batch as an int64 and a
+// float32 array of one row per query
+vector<vector<pair<unsigned, float>>> from_py_results(PyObject *pResults, size_t n_rows, const char *function) {
+    if (!PyTuple_Check(pResults) || PyTuple_Size(pResults) != 2) {
+        cerr << function << " must return a tuple of corpus ids and scores" << endl;
+        exit(EXIT_FAILURE);
+    }
+    PyBufferView<long long> ids(PyTuple_GetItem(pResults, 0), function);  // borrowed reference
+    PyBufferView<float> scores(PyTuple_GetItem(pResults, 1), function);  // borrowed reference
+    if (ids.size() != scores.size() || ids.size() % n_rows != 0) {
+        cerr << function << " must return as many corpus ids as scores for each query" << endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t n_cols = ids.size() / n_rows;
+    vector<vector<pair<unsigned, float>>> results(n_rows);
+    for (size_t i = 0; i < n_rows; i++) {
+        results[i].resize(n_cols);
+        for (size_t j = 0; j < n_cols; j++) {
+            results[i][j] = {(unsigned) ids.data()[i * n_cols + j], scores.data()[i * n_cols + j]};
+        }
+    }
+    return results;
+}
+
+// Runs the Python encoder for concurrent semantic queries on one thread, which collects the queries arriving within
+// --batch-window of the first one, up to --batch-size, and encodes them with one call instead of each query taking
+// the GIL for its own. With --hnsw or --flat, only the embeddings are returned and searched by the query threads.
+class QueryBatcher {
+public:
+    struct Request {
+        const string &query;
+        vector<pair<unsigned, float>> results{};  // corpus ids and scores, without --hnsw or --flat
+        vector<float> embedding{};  // with --hnsw or --flat
+        bool done = false;
+    };
+
+private:
+    PyObject *pfnBatch;  // semantic_search_batch, or encode_queries with --hnsw or --flat
+    unsigned dim;  // of the embeddings returned by encode_queries, 0 for semantic_search_batch
+    size_t max_batch;
+    std::chrono::microseconds window;
+    std::mutex mutex;
+    std::condition_variable cv, done_cv;
+    std::deque<pair<Request *, std::chrono::steady_clock::time_point>> queue;  // with arrival times
+    bool stopping = false;
+    std::thread thread;
+
+    // Encode a batch with the GIL, exit on any Python error as the queries do
+    void process(const vector<Request *> &batch) {
+        auto gstate = PyGILState_Ensure();
+        PyObject *pQueries = PyList_New((Py_ssize_t) batch.size());  // new reference, but will be borrowed by pArgs
+        for (size_t i = 0; i < batch.size(); i++) {
+            PyList_SetItem(pQueries, (Py_ssize_t) i, PyUnicode_FromString(batch[i]->query.c_str()));  // steals reference
+        }
+        PyObject *pArgs = PyTuple_New(1);  // new reference
+        PyTuple_SetItem(pArgs, 0, pQueries);  // steals reference
+        PyObject *pResults = PyObject_CallObject(pfnBatch, pArgs);  // new reference
+        if (!pResults) {
+            PyErr_Print();
+            exit(EXIT_FAILURE);
+        }
+        if (dim > 0) {
+            PyBufferView<float> embeddings(pResults, "encode_queries");
+            if (embeddings.size() != batch.size() * dim) {
+                cerr << "encode_queries must return " << dim << " float32 per query" << endl;
+                exit(EXIT_FAILURE);
+            }
+            for (size_t i = 0; i < batch.size(); i++) {
+                batch[i]->embedding.assign(embeddings.data() + i * dim, embeddings.data() + (i + 1) * dim);
+            }
+        } else {
+            auto results = from_py_results(pResults, batch.size(), "semantic_search_batch");
+            for (size_t i = 0; i < batch.size(); i++) {
+                batch[i]->results = std::move(results[i]);
+            }
+        }
+        Py_DECREF(pResults);
+        Py_DECREF(pArgs);  // also DECREFs pQueries
+        PyGILState_Release(gstate);
+    }
+
+    void run() {
+        std::unique_lock<std::mutex> lock(mutex);
+        while (true) {
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (queue.empty()) {
+                return;  // stopping, after all queued queries are done
+            }
+            cv.wait_until(lock, queue.front().second + window,
+                          [this] { return stopping || queue.size() >= max_batch; });
+            vector<Request *> batch;
+            while (!queue.empty() && batch.size() < max_batch) {
+                batch.push_back(queue.front().first);
+                queue.pop_front();
+            }
+            lock.unlock();
+            process(batch);
+            lock.lock();
+            for (auto request: batch) {
+                request->done = true;
+            }
+            done_cv.notify_all();
+        }
+    }
+
+public:
+    QueryBatcher(PyObject *pfnBatch, unsigned dim, const Options &options) :
+            pfnBatch(pfnBatch), dim(dim), max_batch(options.batch_size), window(options.batch_window) {
+        thread = std::thread(&QueryBatcher::run, this);
+    }
+
+    ~QueryBatcher() {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            stopping = true;
+        }
+        cv.notify_one();
+        thread.join();
+    }
+
+    // Wait for the batch of the request to be encoded, without holding the GIL
+    void submit(Request &request) {
+        std::unique_lock<std::mutex> lock(mutex);
+        queue.emplace_back(&request, std::chrono::steady_clock::now());
+        if (queue.size() == 1 || queue.size() >= max_batch) {
+            cv.notify_one();
+        }
+        done_cv.wait(lock, [&request] { return request.done; });
+    }
+};
+
+#ifndef _MSC_VER
+
+// Processes of model_worker.py that run the models instead of the embedded Python, each reached over its own
+// Unix-domain socket with the framing described there. A request goes to any idle worker, and a worker that fails
+// or exceeds --worker-timeout is killed and restarted in the background while the others keep serving.
+class WorkerPool {
+private:
+    enum Operation : unsigned {
+        SEMANTIC_SEARCH = 1, ENCODE_QUERY = 2, RERANK = 3
+    };
+
+    struct Worker {
+        pid_t pid = -1;
+        int fd = -1;
+        string socket_path;
+        std::thread restarter;
+    };
+
+    vector<Worker> workers;
+    const char *python;
+    int timeout;  // in milliseconds
+    std::mutex mutex;
+    std::condition_variable cv;
+    vector<Worker *> idle;
+    int n_alive;  // workers idle, busy, or being restarted
+
+    void spawn(Worker &worker) {
+        unlink(worker.socket_path.c_str());
+        worker.pid = fork();
+        if (worker.pid < 0) {
+            perror("Failed to start model worker");
+            exit(EXIT_FAILURE);
+        }
+        if (worker.pid == 0) {
+            execlp(python, python, "model_worker.py", worker.socket_path.c_str(), (char *) nullptr);
+            perror("Failed to run model_worker.py");
+            _exit(127);
+        }
+    }
+
+    // Wait for the worker to load the models and listen, false if it exits first
+    bool connect_worker(Worker &worker) {
+        sockaddr_un addr{};
+        addr.sun_family = AF_UNIX;
+        strncpy(addr.sun_path, worker.socket_path.c_str(), sizeof(addr.sun_path) - 1);
+        while (true) {
+            int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+            if (fd < 0) {
+                perror("Failed to create socket");
+                exit(EXIT_FAILURE);
+            }
+            if (connect(fd, (sockaddr *) &addr, sizeof(addr)) == 0) {
+                worker.fd = fd;
+                return true;
+            }
+            close(fd);
+            if (waitpid(worker.pid, nullptr, WNOHANG) != 0) {
+                worker.pid = -1;
+                return false;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        }
+    }
+
+    void stop(Worker &worker) {
+        if (worker.fd >= 0) {
+            close(worker.fd);
+            worker.fd = -1;
+        }
+        if (worker.pid > 0) {
+            kill(worker.pid, SIGKILL);
+            waitpid(worker.pid, nullptr, 0);
+            worker.pid = -1;
+        }
+        unlink(worker.socket_path.c_str());
+    }
+
+    void release(Worker *worker) {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            idle.push_back(worker);
+        }
+        cv.notify_one();
+    }
+
+    // Kill a failed worker and start another on its own thread, the pool shrinks if it cannot start
+    void restart(Worker *worker) {
+        stop(*worker);
+        if (worker->restarter.joinable()) {
+            worker->restarter.join();  // its last restart, which is done as the worker has been busy since
+        }
+        worker->restarter = std::thread([this, worker] {
+            spawn(*worker);
+            if (connect_worker(*worker)) {
+                release(worker);
+            } else {
+                cerr << "Model worker " << worker->socket_path << " exited while starting" << endl;
+                std::lock_guard<std::mutex> lock(mutex);
+                n_alive--;
+                cv.notify_all();
+            }
+        });
+    }
+
+    // Send or receive all bytes before the deadline
+    static bool transfer(int fd, char *data, size_t size, bool sending,
+                         std::chrono::steady_clock::time_point deadline) {
+        while (size > 0) {
+            auto remaining = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    deadline - std::chrono::steady_clock::now()).count();
+            pollfd pfd{fd, (short) (sending ? POLLOUT : POLLIN), 0};
+            if (remaining <= 0 || poll(&pfd, 1, (int) remaining) <= 0) {
+                return false;
+            }
+#ifdef MSG_NOSIGNAL
+            ssize_t n = sending ? send(fd, data, size, MSG_NOSIGNAL) : recv(fd, data, size, 0);
+#else
+            ssize_t n = sending ? send(fd, data, size, 0) : recv(fd, data, size, 0);
+#endif
+            if (n <= 0) {
+                return false;
+            }
+            data += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    static void append_unsigned(string &buf, unsigned value) {
+        buf.append((const char *) &value, sizeof(value));
+    }
+
+    // Run a request on an idle worker, false if no worker is left, or if it failed or timed out and is restarted
+    bool call(Operation op, const vector<std::string_view> &texts, vector<pair<unsigned, float>> &results,
+              vector<float> *floats) {
+        string request;
+        append_unsigned(request, op);
+        append_unsigned(request, (unsigned) texts.size());
+        append_unsigned(request, (unsigned) results.size());
+        for (auto text: texts) {
+            append_unsigned(request, (unsigned) text.size());
+            request.append(text);
+        }
+        for (const auto &[corpus_id, score]: results) {
+            append_unsigned(request, corpus_id);
+            request.append((const char *) &score, sizeof(score));
+        }
+
+        Worker *worker;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return !idle.empty() || n_alive == 0; });
+            if (idle.empty()) {
+                cerr << "No model worker is left" << endl;
+                return false;
+            }
+            worker = idle.back();
+            idle.pop_back();
+        }
+        auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeout);
+        unsigned header[3];  // status, number of results, number of floats
+        bool ok = transfer(worker->fd, request.data(), request.size(), true, deadline) &&
+                  transfer(worker->fd, (char *) header, sizeof(header), false, deadline);
+        if (ok && header[0] == 0) {
+            vector<pair<unsigned, float>> received(header[1]);
+            static_assert(sizeof(received[0]) == 2 * sizeof(unsigned));
+            ok = transfer(worker->fd, (char *) received.data(), received.size() * sizeof(received[0]), false,
+                          deadline);
+            vector<float> received_floats(header[2]);
+            ok = ok && transfer(worker->fd, (char *) received_floats.data(), received_floats.size() * sizeof(float),
+                                false, deadline);
+            if (ok) {
+                results = std::move(received);
+                if (floats != nullptr) {
+                    *floats = std::move(received_floats);
+                }
+                release(worker);
+                return true;
+            }
+        } else if (ok) {
+            release(worker);  // Python raised an exception, which the worker has printed
+            return false;
+        }
+        cerr << "Model worker " << worker->socket_path << " failed or timed out, restarting it" << endl;
+        restart(worker);
+        return false;
+    }
+
+public:
+    explicit WorkerPool(const Options &options) : workers(options.workers), python(options.worker_python),
+                                                  timeout(options.worker_timeout), n_alive(options.workers) {
+        printf("Starting %d model workers...", options.workers);
+        fflush(stdout);
+        for (int i = 0; i < options.workers; i++) {
+            workers[i].socket_path = "/tmp/model_worker." + std::to_string(getpid()) + "." + std::to_string(i);
+            spawn(workers[i]);
+        }
+        for (auto &worker: workers) {
+            if (!connect_worker(worker)) {
+                cerr << "Model worker " << worker.socket_path << " exited while starting" << endl;
+                exit(EXIT_FAILURE);
+            }
+            idle.push_back(&worker);
+        }
+        printf("done\n");
+    }
+
+    ~WorkerPool() {
+        for (auto &worker: workers) {
+            if (worker.restarter.joinable()) {
+                worker.restarter.join();
+            }
+            stop(worker);
+        }
+    }
+
+    bool semantic_search(const string &query, vector<pair<unsigned, float>> &results) {
+        results.clear();
+        return call(SEMANTIC_SEARCH, {query}, results, nullptr);
+    }
+
+    bool encode_query(const string &query, vector<float> &embedding) {
+        vector<pair<unsigned, float>> results;
+        return call(ENCODE_QUERY, {query}, results, &embedding);
+    }
+
+    // Rerank the results in place with their docs
+    bool rerank(const string &query, const vector<std::string_view> &docs, vector<pair<unsigned, float>> &results) {
+        vector<std::string_view> texts{query};
+        texts.insert(texts.end(), docs.begin(), docs.end());
+        return call(RERANK, texts, results, nullptr);
+    }
+};
+
+#endif
+
+// Results of the most recent queries by their embeddings, reused for a query whose embedding has a cosine similarity
+// of at least --semantic-cache with one of theirs, as paraphrases of a query mostly find the same docs
+class SemanticCache {
+private:
+    static constexpr size_t N_ENTRIES = 4096;
+
+    unsigned dim;
+    float threshold;
+    std::shared_mutex mutex;
+    vector<float> embeddings;  // N_ENTRIES rows of dim
+    vector<shared_ptr<ResultDocInfos>> results;  // null for unused entries
+    size_t next = 0;  // the oldest entry, replaced next
+    std::atomic<size_t> hits = 0, misses = 0, evictions = 0;
+
+public:
+    SemanticCache(unsigned dim, float threshold) : dim(dim), threshold(threshold),
+                                                   embeddings(N_ENTRIES * dim), results(N_ENTRIES) {}
 
-        // Calculate infos and sort by score
-        infos.clear();
-        for (const auto &entry: entries) {
-            for (int i = 0; i < entry->doc_ids.size(); i++) {
-                unsigned doc_id = entry->doc_ids[i];
-                infos[doc_id].score += BM25(entry->freqs[i], (unsigned) entry->doc_ids.size(), docs_info[doc_id].term_cnt, options);
-                infos[doc_id].freqs->emplace_back(entry->term, entry->freqs[i]);
+    // The results of the most similar cached query above the threshold, or null
+    shared_ptr<ResultDocInfos> get(const float *embedding) {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        float best_similarity = threshold;
+        shared_ptr<ResultDocInfos> best_results;
+        for (size_t i = 0; i < N_ENTRIES; i++) {
+            if (!results[i]) {
+                continue;
+            }
+            float similarity = dot(embedding, embeddings.data() + i * dim, dim);
+            if (similarity >= best_similarity) {
+                best_similarity = similarity;
+                best_results = results[i];
             }
         }
+        (best_results ? hits : misses)++;
+        return best_results;
+    }
 
-        // Sort by score
-        sorted_infos = make_shared<ResultDocInfos>();
-        sorted_infos->reserve(infos.size());
-        for (const auto &info: infos) {
-            sorted_infos->emplace_back(info);
+    void put(const float *embedding, const shared_ptr<ResultDocInfos> &sorted_infos) {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        if (results[next]) {
+            evictions++;
         }
-        sort(sorted_infos->begin(), sorted_infos->end(),
-             [](const pair<unsigned, ResultDocInfo> &lhs, const pair<unsigned, ResultDocInfo> &rhs) {
-                 return lhs.second.score > rhs.second.score ||
-                        (lhs.second.score == rhs.second.score && lhs.first < rhs.first);
-             });
+        memcpy(embeddings.data() + next * dim, embedding, dim * sizeof(float));
+        results[next] = sorted_infos;
+        next = (next + 1) % N_ENTRIES;
+    }
 
-        // Cache result
-        result_cache.put(cleaned_query, sorted_infos);
-        return sorted_infos;
+    void clear() {
+        std::unique_lock<std::shared_mutex> lock(mutex);
+        std::fill(results.begin(), results.end(), nullptr);
+        next = 0;
+    }
+
+    CacheStats stats() {
+        std::shared_lock<std::shared_mutex> lock(mutex);
+        CacheStats stats{hits, misses, evictions};
+        for (const auto &sorted_infos: results) {
+            if (sorted_infos) {
+                stats.items++;
+                stats.bytes += dim * sizeof(float) + cache_charge(*sorted_infos);
+            }
+        }
+        return stats;
     }
 };
 
+constexpr unsigned NO_CORPUS_ID = ~0u;
+
 class TransformerSearcher : public Searcher {
-    PyObject *pModule, *pfnSemanticSearch, *pfnRerank;
-    LRUCache<ResultDocInfos> reranking_result_cache;
+    PyObject *pModule = nullptr, *pfnSemanticSearch = nullptr, *pfnRerank = nullptr;  // only without --workers
+    PyObject *pfnEncodeQuery = nullptr;  // only with --hnsw, --flat or --cascade
+    PyObject *pfnBatch = nullptr;  // only with --batch-size above 1
+    PyThreadState *main_thread_state;
+    unique_ptr<HnswIndex> hnsw;
+    unique_ptr<FlatIndex> flat;
+    unique_ptr<QueryBatcher> batcher;
+#ifndef _MSC_VER
+    unique_ptr<WorkerPool> workers;
+#endif
+    ShardedCache<ResultDocInfos> reranking_result_cache;
+    ShardedCache<CrossScore> cross_score_cache;  // by normalized query and doc id, shared by overlapping candidates
+    ShardedCache<QueryEmbedding> embedding_cache;  // by normalized query, only with --hnsw, --flat or --cascade
+    unique_ptr<SemanticCache> semantic_result_cache, semantic_reranking_result_cache;  // only with --semantic-cache
     vector<unsigned> doc_ids;
+    Embeddings cascade_embeddings;  // only with --cascade
+    vector<unsigned> corpus_ids;  // by doc id, NO_CORPUS_ID for docs without an embedding, only with --cascade
+    unsigned embedding_dim = 0;  // of the query embeddings
 
 public:
-    explicit TransformerSearcher(Options &options) : Searcher(options.cache_size), reranking_result_cache(options.cache_size) {
+    TransformerSearcher(ShardedCache<Entry> &entry_cache, const Options &options) :
+            Searcher(entry_cache, options, 5), reranking_result_cache(result_cache_bytes),
+            cross_score_cache(result_cache_bytes), embedding_cache(result_cache_bytes) {
         FILE *fp = fopen_guarded(options.corpus_id_to_doc_id_path, "r");
         unsigned corpus_id = 0, doc_id;
         while (fscanf(fp, "%u", &doc_id) != EOF) {
             doc_ids.push_back(doc_id);
             corpus_id++;
         }
+#ifndef _MSC_VER
+        if (options.workers > 0) {
+            workers = make_unique<WorkerPool>(options);
+        }
+#endif
+        if (options.workers == 0) {
+            init_python(options);
+        }
+        if (options.hnsw_path != nullptr) {
+            hnsw = make_unique<HnswIndex>(options);
+            embedding_dim = hnsw->dim();
+        } else if (options.flat_path != nullptr) {
+            flat = make_unique<FlatIndex>(options);
+            embedding_dim = flat->dim();
+        }
+        if (options.cascade > 0) {
+            init_cascade(options);
+        }
+        if (pfnBatch) {
+            batcher = make_unique<QueryBatcher>(pfnBatch, hnsw ? hnsw->dim() : flat ? flat->dim() : 0, options);
+        }
+        if (options.semantic_cache > 0) {
+            semantic_result_cache = make_unique<SemanticCache>(embedding_dim, options.semantic_cache);
+            semantic_reranking_result_cache = make_unique<SemanticCache>(embedding_dim, options.semantic_cache);
+        }
+    }
+
+    void clear_caches() override {
+        Searcher::clear_caches();
+        reranking_result_cache.clear();
+        cross_score_cache.clear();
+        embedding_cache.clear();
+        if (semantic_result_cache) {
+            semantic_result_cache->clear();
+            semantic_reranking_result_cache->clear();
+        }
+    }
+
+    string result_key(const string &query, const string &) override {
+        return normalize_query(query);
+    }
+
+    json cache_stats() override {
+        json stats = Searcher::cache_stats();
+        stats["reranking_results"] = reranking_result_cache.stats();
+        stats["cross_scores"] = cross_score_cache.stats();
+        stats["embeddings"] = embedding_cache.stats();
+        if (semantic_result_cache) {
+            stats["semantic_results"] = semantic_result_cache->stats();
+            stats["semantic_reranking_results"] = semantic_reranking_result_cache->stats();
+        }
+        return stats;
+    }
+
+    // The embedding of a query for cascade queries, see encode_query
+    bool embed(const string &query, vector<float> &embedding) {
+        return encode_query(query, normalize_query(query), embedding);
+    }
+
+    // Score the first n BM25 candidates of a cascade query by the cosine similarity of their corpus embeddings with
+    // the query embedding, as (index of the candidate, score) from the best one, the first ones first on ties.
+    // Candidates without an embedding are left out.
+    void rescore(const vector<float> &embedding, const ResultDocInfos &candidates, size_t n,
+                 vector<pair<unsigned, float>> &results) const {
+        results.clear();
+        results.reserve(n);
+        for (size_t i = 0; i < n; i++) {
+            unsigned doc_id = candidates.doc_ids[i];
+            unsigned corpus_id = doc_id < corpus_ids.size() ? corpus_ids[doc_id] : NO_CORPUS_ID;
+            if (corpus_id != NO_CORPUS_ID) {
+                results.emplace_back(i, dot(embedding.data(), cascade_embeddings.row(corpus_id), embedding_dim));
+            }
+        }
+        std::stable_sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
+            return a.second > b.second;
+        });
+    }
+
+    ~TransformerSearcher() override {
+        batcher.reset();  // finishes the queued queries with the GIL
+        if (!pModule) {
+            return;  // the models ran in workers, stopped by their pool
+        }
+        PyEval_RestoreThread(main_thread_state);
+        Py_DECREF(pModule);
+        Py_DECREF(pfnSemanticSearch);
+        Py_DECREF(pfnRerank);
+        Py_XDECREF(pfnEncodeQuery);
+        Py_XDECREF(pfnBatch);
+        Py_Finalize();
+    }
+
+private:
+    void init_python(const Options &options) {
         printf("Initializing Python for Transformer...");
         fflush(stdout);
         Py_Initialize();
@@ -735,109 +4071,490 @@ public:
             PyErr_Print();
             exit(EXIT_FAILURE);
         }
-        pfnRerank = PyObject_GetAttrString(pModule, "rerank_inplace");
+        pfnRerank = PyObject_GetAttrString(pModule, "rerank");
         if (!pfnRerank) {
             PyErr_Print();
             exit(EXIT_FAILURE);
         }
+        if (options.hnsw_path != nullptr || options.flat_path != nullptr || options.cascade > 0) {
+            pfnEncodeQuery = PyObject_GetAttrString(pModule, "encode_query");
+            if (!pfnEncodeQuery) {
+                PyErr_Print();
+                exit(EXIT_FAILURE);
+            }
+        }
+        if (options.batch_size > 1) {
+            bool has_index = options.hnsw_path != nullptr || options.flat_path != nullptr;
+            pfnBatch = PyObject_GetAttrString(pModule, has_index ? "encode_queries" : "semantic_search_batch");
+            if (!pfnBatch) {
+                PyErr_Print();
+                exit(EXIT_FAILURE);
+            }
+        }
+        // Release the GIL taken by Py_Initialize, queries take it with PyGILState_Ensure on their own threads
+        main_thread_state = PyEval_SaveThread();
         printf("done\n");
     }
 
-    ~TransformerSearcher() override {
-        Py_DECREF(pModule);
-        Py_DECREF(pfnSemanticSearch);
-        Py_DECREF(pfnRerank);
-        Py_Finalize();
+    // Map the corpus embeddings re-scored by cascade queries, and invert corpus_id_to_doc_id.txt to find them
+    void init_cascade(const Options &options) {
+        printf("Mapping embeddings %s for cascade queries...", options.embeddings_path);
+        fflush(stdout);
+        cascade_embeddings = load_embeddings(options.embeddings_path);
+        if (cascade_embeddings.n != doc_ids.size() || (embedding_dim > 0 && cascade_embeddings.dim != embedding_dim)) {
+            cerr << "The embeddings " << options.embeddings_path << " do not match " << options.corpus_id_to_doc_id_path
+                 << endl;
+            exit(EXIT_FAILURE);
+        }
+        embedding_dim = cascade_embeddings.dim;
+        corpus_ids.assign(docs_info.size(), NO_CORPUS_ID);
+        for (unsigned corpus_id = 0; corpus_id < doc_ids.size(); corpus_id++) {
+            if (doc_ids[corpus_id] < corpus_ids.size()) {
+                corpus_ids[doc_ids[corpus_id]] = corpus_id;
+            }
+        }
+        printf("done\n");
     }
 
-private:
-    shared_ptr<ResultDocInfos>
-    collect_and_rank_docs(const string &query, const string &, vector<string> &,
-                          LRUCache<Entry> &, Options &options, json &result) override {
-        // Check if query is in cache
-        shared_ptr<ResultDocInfos> sorted_infos;
-        if (options.query_type == QueryType::RERANKING) {
-            sorted_infos = reranking_result_cache.get(query);
+    // The embedding of a query for --hnsw, --flat or --cascade, cached by its normalized text. Only the query is
+    // encoded in Python, the embedding is searched without the GIL. Returns false if a model worker failed.
+    bool encode_query(const string &query, const string &key, vector<float> &embedding) {
+        if (auto cached = embedding_cache.get(key)) {
+            embedding = cached->values;
+            return true;
+        }
+        unsigned dim = embedding_dim;
+#ifndef _MSC_VER
+        if (workers) {
+            if (!workers->encode_query(query, embedding)) {
+                return false;
+            }
+        } else
+#endif
+        if (batcher && (hnsw || flat)) {  // otherwise the batches are searched in Python
+            QueryBatcher::Request request{query};
+            batcher->submit(request);
+            embedding = std::move(request.embedding);
         } else {
-            sorted_infos = result_cache.get(query);
+            auto gstate = PyGILState_Ensure();
+            PyObject *pArgs = PyTuple_New(1);  // new reference
+            PyTuple_SetItem(pArgs, 0, PyUnicode_FromString(query.c_str()));  // steals reference
+            PyObject *pEmbedding = PyObject_CallObject(pfnEncodeQuery, pArgs);  // new reference
+            if (!pEmbedding) {
+                PyErr_Print();
+                exit(EXIT_FAILURE);
+            }
+            {
+                PyBufferView<float> values(pEmbedding, "encode_query");
+                embedding.assign(values.data(), values.data() + values.size());
+            }
+            Py_DECREF(pEmbedding);
+            Py_DECREF(pArgs);
+            PyGILState_Release(gstate);
         }
-        if (sorted_infos) {
-            result["cached"] = true;
-            return sorted_infos;
+        if (embedding.size() != dim) {
+            cerr << "encode_query must return " << dim << " float32" << endl;
+            exit(EXIT_FAILURE);
         }
-        result["cached"] = false;
+        embedding_cache.put(key, make_shared<QueryEmbedding>(QueryEmbedding{embedding}));
+        return true;
+    }
 
-        Py_BEGIN_ALLOW_THREADS
+    // Semantic search of the whole corpus in Python, without --hnsw or --flat. Returns false if a model worker failed.
+    bool semantic_search(const string &query, vector<pair<unsigned, float>> &results) {
+#ifndef _MSC_VER
+        if (workers) {
+            return workers->semantic_search(query, results);
+        }
+#endif
+        if (batcher) {
+            QueryBatcher::Request request{query};
+            batcher->submit(request);
+            results = std::move(request.results);
+            return true;
+        }
         auto gstate = PyGILState_Ensure();
-        // Get semantic search results
         PyObject *pArgs = PyTuple_New(1);  // new reference
-        PyObject *pQuery = PyUnicode_FromString(query.c_str());  // new reference, but will be borrowed by pArgs
-        PyTuple_SetItem(pArgs, 0, pQuery);  // steals reference, pQuery will be DECREFed when pArgs is DECREFed
-        Py_INCREF(pQuery);
-        PyObject *pResults = PyObject_CallObject(pfnSemanticSearch, pArgs);  // new reference, but may be borrowed by pArgs
+        PyTuple_SetItem(pArgs, 0, PyUnicode_FromString(query.c_str()));  // steals reference
+        PyObject *pResults = PyObject_CallObject(pfnSemanticSearch, pArgs);  // new reference
         if (!pResults) {
             PyErr_Print();
             exit(EXIT_FAILURE);
         }
-        Py_DECREF(pArgs);  // also DECREFs pQuery
-
-        auto size = PyList_Size(pResults);
-        if (size > 0 && options.query_type == QueryType::RERANKING) {
-            // Get docs according to doc ids
-            PyObject *pQueryDocPairs = PyList_New(size);  // new reference, but will be borrowed by pArgs
-            for (Py_ssize_t i = 0; i < size; i++) {
-                PyObject *pResult = PyList_GetItem(pResults, i);  // borrowed reference
-                PyObject *pCorpusId = PyDict_GetItemString(pResult, "corpus_id");  // borrowed reference
-                read_doc(doc_ids[PyLong_AsUnsignedLong(pCorpusId)]);
-                PyObject *pDoc = PyUnicode_FromString(doc_content);  // new reference, but will be borrowed by pQueryDocPair
-
-                PyObject *pQueryDocPair = PyList_New(2);  // new reference, but will be borrowed by pQueryDocPairs
-                PyList_SetItem(pQueryDocPair, 0, pQuery);  // steals reference, pQuery will be DECREFed when pQueryDocPair is DECREFed
-                Py_INCREF(pQuery);
-                PyList_SetItem(pQueryDocPair, 1, pDoc);  // steals reference, pDoc will be DECREFed when pQueryDocPair is DECREFed
-                PyList_SetItem(pQueryDocPairs, i, pQueryDocPair);  // steals reference, pQueryDocPair will be DECREFed when pDocs is DECREFed
-            }
-            Py_DECREF(pQuery);  // pQuery will be DECREFed when all pQueryDocPairs are DECREFed
-
-            // Get reranked results
-            pArgs = PyTuple_New(2);  // new reference
-            PyTuple_SetItem(pArgs, 0, pQueryDocPairs);  // steals reference, pQueryDocPairs will be DECREFed when pArgs is DECREFed
-            PyTuple_SetItem(pArgs, 1, pResults);  // steals reference, pResults will be DECREFed when pArgs is DECREFed
-            PyObject *pNone = PyObject_CallObject(pfnRerank, pArgs);  // new reference
-            if (!pNone) {
-                PyErr_Print();
+        results = std::move(from_py_results(pResults, 1, "semantic_search")[0]);
+        Py_DECREF(pResults);
+        Py_DECREF(pArgs);
+        PyGILState_Release(gstate);
+        return true;
+    }
+
+    // Rerank the results with the passages of their docs by the cross-encoder, in place, in any order.
+    // Returns false if a model worker failed.
+    bool rerank(const string &query, const vector<std::string_view> &passages, vector<pair<unsigned, float>> &results) {
+#ifndef _MSC_VER
+        if (workers) {
+            return workers->rerank(query, passages, results);
+        }
+#endif
+        auto gstate = PyGILState_Ensure();
+        PyObject *pQuery = PyUnicode_FromString(query.c_str());  // new reference, but will be borrowed by pQueryDocPairs
+        auto size = (Py_ssize_t) results.size();
+        PyObject *pQueryDocPairs = PyList_New(size);  // new reference, but will be borrowed by pArgs
+        for (Py_ssize_t i = 0; i < size; i++) {
+            PyObject *pDoc = PyUnicode_FromStringAndSize(passages[i].data(), (Py_ssize_t) passages[i].size());  // new reference, but will be borrowed by pQueryDocPair
+
+            PyObject *pQueryDocPair = PyList_New(2);  // new reference, but will be borrowed by pQueryDocPairs
+            PyList_SetItem(pQueryDocPair, 0, pQuery);  // steals reference, pQuery will be DECREFed when pQueryDocPair is DECREFed
+            Py_INCREF(pQuery);
+            PyList_SetItem(pQueryDocPair, 1, pDoc);  // steals reference, pDoc will be DECREFed when pQueryDocPair is DECREFed
+            PyList_SetItem(pQueryDocPairs, i, pQueryDocPair);  // steals reference, pQueryDocPair will be DECREFed when pDocs is DECREFed
+        }
+        Py_DECREF(pQuery);  // pQuery will be DECREFed when all pQueryDocPairs are DECREFed
+
+        // Get cross-encoder scores
+        PyObject *pArgs = PyTuple_New(1);  // new reference
+        PyTuple_SetItem(pArgs, 0, pQueryDocPairs);  // steals reference, pQueryDocPairs will be DECREFed when pArgs is DECREFed
+        PyObject *pScores = PyObject_CallObject(pfnRerank, pArgs);  // new reference
+        if (!pScores) {
+            PyErr_Print();
+            exit(EXIT_FAILURE);
+        }
+        {
+            PyBufferView<float> scores(pScores, "rerank");
+            if (scores.size() != results.size()) {
+                cerr << "rerank must return a score for each pair" << endl;
                 exit(EXIT_FAILURE);
             }
-            Py_DECREF(pNone);
+            for (size_t i = 0; i < results.size(); i++) {
+                results[i].second = scores.data()[i];
+            }
         }
+        Py_DECREF(pScores);
+        Py_DECREF(pArgs);  // also DECREFs pQueryDocPairs
+        PyGILState_Release(gstate);
+        return true;
+    }
 
-        if (size > 0) {
-            sorted_infos = make_shared<ResultDocInfos>();
-            sorted_infos->reserve(size);
-            for (Py_ssize_t i = 0; i < size; i++) {
-                PyObject *pResult = PyList_GetItem(pResults, i);  // borrowed reference
-                PyObject *pCorpusId = PyDict_GetItemString(pResult, "corpus_id");  // borrowed reference
-                PyObject *pScore = PyDict_GetItemString(pResult, "score");  // borrowed reference
-                sorted_infos->emplace_back(doc_ids[PyLong_AsUnsignedLong(pCorpusId)],
-                                           ResultDocInfo{PyFloat_AsDouble(pScore), nullptr});
-            }
-            if (options.query_type == QueryType::RERANKING) {
-                Py_DECREF(pArgs);  // also DECREFs pQuery, pDocs, and pResults
+    vector<pair<unsigned, float>> search_embedding(const float *embedding, const Options &options) const {
+        return hnsw ? hnsw->search(embedding, SEMANTIC_TOP_K, options.ef_search)
+                    : flat->search(embedding, SEMANTIC_TOP_K);
+    }
+
+    // Read the docs of the corpus ids into ctx.batch_contents, null-terminated, all at once
+    void read_docs(QueryContext &ctx, const vector<unsigned> &corpus_ids) {
+        ctx.batch_contents.resize(corpus_ids.size());
+        ReadBatch batch;
+        for (size_t i = 0; i < corpus_ids.size(); i++) {
+            const auto &info = docs_info[doc_ids[corpus_ids[i]]];
+            auto &content = ctx.batch_contents[i];
+            content.resize(info.end - info.begin + 1);
+            content.back() = '\0';
+            batch.add(dataset_fd, content.data(), info.end - info.begin, info.begin);
+        }
+        batch.submit();
+        for (size_t i = 0; i < corpus_ids.size(); i++) {
+            batch.wait(i);
+        }
+    }
+
+    // The passages of the docs read by read_docs that the cross-encoder reranks
+    vector<std::string_view> select_passages(QueryContext &ctx, const Options &options) {
+        vector<std::string_view> passages;
+        for (const auto &content: ctx.batch_contents) {
+            // up to the first null, as the docs were read by PyUnicode_FromString
+            passages.push_back(select_passage(content.data(), strlen(content.data()), ctx.query_list,
+                                              options.passage_len, ctx.tokenize_buffer));
+        }
+        return passages;
+    }
+
+    // The cross-encoder reads the words in order, so the scores are keyed by the normalized query, not the cleaned one
+    string cross_score_key(const string &key, unsigned corpus_id) const {
+        return key + '\t' + std::to_string(doc_ids[corpus_id]);
+    }
+
+    // Take the cached cross-encoder scores of the results, and return the indices of those still to be reranked
+    vector<size_t> lookup_cross_scores(const string &key, vector<pair<unsigned, float>> &results) {
+        vector<size_t> missing;
+        for (size_t i = 0; i < results.size(); i++) {
+            auto cross_score = cross_score_cache.get(cross_score_key(key, results[i].first));
+            if (cross_score) {
+                results[i].second = cross_score->score;
+            } else {
+                missing.push_back(i);
             }
-        } else {
-            Py_DECREF(pQuery);
-            Py_DECREF(pResults);
         }
+        return missing;
+    }
 
-        // Cache result
+    // Sort reranked results by their cross-encoder scores, the first ones first on ties, and cache them
+    shared_ptr<ResultDocInfos> rank_and_cache(const string &query, vector<pair<unsigned, float>> &results,
+                                              const Options &options) {
+        if (options.query_type == QueryType::RERANKING) {
+            std::stable_sort(results.begin(), results.end(), [](const auto &a, const auto &b) {
+                return a.second > b.second;
+            });
+        }
+        shared_ptr<ResultDocInfos> sorted_infos;
+        if (!results.empty()) {
+            sorted_infos = make_shared<ResultDocInfos>();
+            sorted_infos->count = results.size();
+            sorted_infos->doc_ids.reserve(results.size());
+            sorted_infos->scores.reserve(results.size());
+            for (const auto &[corpus_id, score]: results) {
+                sorted_infos->doc_ids.push_back(doc_ids[corpus_id]);
+                sorted_infos->scores.push_back(score);
+            }
+        }
         if (options.query_type == QueryType::RERANKING) {
             reranking_result_cache.put(query, sorted_infos);
         } else {
             result_cache.put(query, sorted_infos);
         }
+        return sorted_infos;
+    }
 
-        PyGILState_Release(gstate);
-        Py_END_ALLOW_THREADS
+    shared_ptr<ResultDocInfos>
+    collect_and_rank_docs(const string &query, const string &, QueryContext &ctx,
+                          const Options &options, json &result) override {
+        // Check if query is in cache
+        string key = normalize_query(query);
+        shared_ptr<ResultDocInfos> sorted_infos;
+        if (options.query_type == QueryType::RERANKING) {
+            sorted_infos = reranking_result_cache.get(key);
+        } else {
+            sorted_infos = result_cache.get(key);
+        }
+        if (sorted_infos) {
+            result["cached"] = true;
+            return sorted_infos;
+        }
+        result["cached"] = false;
+
+        // Get semantic search results, or those of a similar query
+        vector<float> embedding;  // only with --hnsw or --flat
+        vector<pair<unsigned, float>> results;  // corpus ids and scores
+        auto &semantic_cache = options.query_type == QueryType::RERANKING ? semantic_reranking_result_cache
+                                                                          : semantic_result_cache;
+        if (hnsw || flat) {
+            if (!encode_query(query, key, embedding)) {
+                return nullptr;
+            }
+            if (semantic_cache && (sorted_infos = semantic_cache->get(embedding.data()))) {
+                result["cached"] = true;
+                return sorted_infos;
+            }
+            results = search_embedding(embedding.data(), options);
+        } else if (!semantic_search(query, results)) {
+            return nullptr;
+        }
+
+        if (!results.empty() && options.query_type == QueryType::RERANKING) {
+            // Get docs according to doc ids, all read at once, and rerank those without a cached cross-encoder score
+            vector<size_t> missing = lookup_cross_scores(key, results);
+            if (!missing.empty()) {
+                vector<unsigned> corpus_ids;
+                vector<pair<unsigned, float>> reranked;
+                for (auto i: missing) {
+                    corpus_ids.push_back(results[i].first);
+                    reranked.push_back(results[i]);
+                }
+                read_docs(ctx, corpus_ids);
+                if (!rerank(query, select_passages(ctx, options), reranked)) {
+                    return nullptr;
+                }
+                unordered_map<unsigned, float> cross_scores(reranked.begin(), reranked.end());  // by corpus id
+                for (auto i: missing) {
+                    auto &[corpus_id, score] = results[i];
+                    score = cross_scores[corpus_id];
+                    cross_score_cache.put(cross_score_key(key, corpus_id),
+                                          make_shared<CrossScore>(CrossScore{score}));
+                }
+            }
+        }
+
+        sorted_infos = rank_and_cache(key, results, options);
+        if (semantic_cache && sorted_infos) {
+            semantic_cache->put(embedding.data(), sorted_infos);
+        }
+        return sorted_infos;
+    }
+};
+
+constexpr float RRF_K = 60;  // rank constant of reciprocal rank fusion, as in Cormack et al.
+
+// BM25 and semantic search of the same query at once, the disjunctive one on the thread of the query and the
+// semantic one on its own, fused by reciprocal rank: each doc scores the sum of 1 / (RRF_K + rank) over the lists
+// it is in. Each branch keeps its own result cache, so only the branch that misses is searched.
+class HybridSearcher : public Searcher {
+    unique_ptr<DisjunctiveSearcher> own_bm25;  // only if the branches are not shared with other query types
+    unique_ptr<TransformerSearcher> own_dense;
+    DisjunctiveSearcher &bm25;
+    TransformerSearcher &dense;
+
+public:
+    HybridSearcher(ShardedCache<Entry> &entry_cache, const Options &options, DisjunctiveSearcher &bm25,
+                   TransformerSearcher &dense) : Searcher(entry_cache, options), bm25(bm25), dense(dense) {}
+
+    HybridSearcher(ShardedCache<Entry> &entry_cache, ShardedCache<PositionList> &position_cache, const Options &options) :
+            Searcher(entry_cache, options),
+            own_bm25(make_unique<DisjunctiveSearcher>(entry_cache, position_cache, options)),
+            own_dense(make_unique<TransformerSearcher>(entry_cache, options)), bm25(*own_bm25), dense(*own_dense) {}
+
+    void clear_caches() override {
+        Searcher::clear_caches();
+        bm25.clear_caches();
+        dense.clear_caches();
+    }
+
+    json cache_stats() override {
+        json stats = Searcher::cache_stats();
+        stats["disjunctive"] = bm25.cache_stats();
+        stats["transformer"] = dense.cache_stats();
+        return stats;
+    }
+
+    string result_key(const string &query, const string &cleaned_query) override {
+        return cleaned_query + '\t' + normalize_query(query);
+    }
+
+private:
+    shared_ptr<ResultDocInfos>
+    collect_and_rank_docs(const string &query, const string &cleaned_query, QueryContext &ctx,
+                          const Options &options, json &result) override {
+        // The semantic branch gets its own context, the entries of the disjunctive one are kept for the snippets
+        Options dense_options = options;
+        dense_options.query_type = QueryType::SEMANTIC;
+        bool dense_cached = false;
+        auto dense_future = std::async(std::launch::async, [&]() {
+            QueryContext dense_ctx;
+            dense_ctx.query_list = ctx.query_list;
+            dense_ctx.phrases = ctx.phrases;
+            return dense.rank(query, cleaned_query, dense_ctx, dense_options, dense_cached);
+        });
+        // As deep as the semantic list, so that neither list dominates the fused one
+        Options bm25_options = options;
+        bm25_options.query_type = QueryType::DISJUNCTIVE;
+        bm25_options.n_results = max(options.n_results, (int) SEMANTIC_TOP_K);
+        bool bm25_cached = false;
+        auto bm25_infos = bm25.rank(query, cleaned_query, ctx, bm25_options, bm25_cached);
+        auto dense_infos = dense_future.get();
+        result["cached"] = bm25_cached && dense_cached;
+
+        unordered_map<unsigned, float> fused;  // by doc id
+        vector<unsigned> order;  // doc ids by first appearance, which breaks ties
+        for (const auto &infos: {bm25_infos, dense_infos}) {
+            if (!infos) {
+                continue;
+            }
+            // a cached BM25 result may keep more docs than were asked for
+            size_t depth = infos == bm25_infos ? min(infos->size(), (size_t) bm25_options.n_results) : infos->size();
+            for (size_t i = 0; i < depth; i++) {
+                auto [it, inserted] = fused.try_emplace(infos->doc_ids[i], 0.f);
+                if (inserted) {
+                    order.push_back(infos->doc_ids[i]);
+                }
+                it->second += 1 / (RRF_K + (float) (i + 1));
+            }
+        }
+        if (order.empty()) {
+            return nullptr;
+        }
+        std::stable_sort(order.begin(), order.end(), [&fused](unsigned a, unsigned b) {
+            return fused.at(a) > fused.at(b);
+        });
+        auto sorted_infos = make_shared<ResultDocInfos>();
+        sorted_infos->count = order.size();
+        sorted_infos->doc_ids = order;
+        for (auto doc_id: order) {
+            sorted_infos->scores.push_back(fused.at(doc_id));
+        }
+        return sorted_infos;
+    }
+};
+
+// The top --cascade BM25 candidates of a query re-scored by the cosine similarity of their corpus embeddings with
+// the query embedding, a cheap way to semantic ranking without scanning all embeddings. The query is encoded on its
+// own thread while the candidates are searched, and only the embeddings of the candidates are read, by doc id.
+class CascadeSearcher : public Searcher {
+    unique_ptr<BM25Searcher> own_bm25;  // only if the searchers are not shared with other query types
+    unique_ptr<TransformerSearcher> own_dense;
+    BM25Searcher &bm25;
+    TransformerSearcher &dense;
+
+public:
+    CascadeSearcher(ShardedCache<Entry> &entry_cache, const Options &options, BM25Searcher &bm25,
+                    TransformerSearcher &dense) : Searcher(entry_cache, options), bm25(bm25), dense(dense) {}
+
+    CascadeSearcher(ShardedCache<Entry> &entry_cache, ShardedCache<PositionList> &position_cache, const Options &options) :
+            Searcher(entry_cache, options),
+            own_bm25(options.cascade_from == QueryType::CONJUNCTIVE
+                     ? (unique_ptr<BM25Searcher>) make_unique<ConjunctiveSearcher>(entry_cache, position_cache, options)
+                     : make_unique<DisjunctiveSearcher>(entry_cache, position_cache, options)),
+            own_dense(make_unique<TransformerSearcher>(entry_cache, options)), bm25(*own_bm25), dense(*own_dense) {}
+
+    void clear_caches() override {
+        Searcher::clear_caches();
+        bm25.clear_caches();
+        dense.clear_caches();
+    }
+
+    json cache_stats() override {
+        json stats = Searcher::cache_stats();
+        stats["bm25"] = bm25.cache_stats();
+        stats["transformer"] = dense.cache_stats();
+        return stats;
+    }
+
+    string result_key(const string &query, const string &cleaned_query) override {
+        return cleaned_query + '\t' + normalize_query(query);
+    }
+
+private:
+    shared_ptr<ResultDocInfos>
+    collect_and_rank_docs(const string &query, const string &cleaned_query, QueryContext &ctx,
+                          const Options &options, json &result) override {
+        // Check if query is in cache
+        string key = result_key(query, cleaned_query);
+        if (auto cached = result_cache.get(key)) {
+            result["cached"] = true;
+            return cached;
+        }
+        result["cached"] = false;
+
+        vector<float> embedding;
+        auto embedded = std::async(std::launch::async, [&]() {
+            return dense.embed(query, embedding);
+        });
+        Options bm25_options = options;
+        bm25_options.query_type = options.cascade_from;
+        bm25_options.n_results = options.cascade;
+        bool bm25_cached = false;
+        auto candidates = bm25.rank(query, cleaned_query, ctx, bm25_options, bm25_cached);
+        if (!embedded.get() || !candidates) {  // a model worker failed, or no doc matched
+            return nullptr;
+        }
+
+        // a cached BM25 result may keep more candidates than were asked for
+        vector<pair<unsigned, float>> rescored;  // indices of the candidates and cosine similarities
+        dense.rescore(embedding, *candidates, min(candidates->size(), (size_t) options.cascade), rescored);
+        if (rescored.empty()) {
+            return nullptr;
+        }
+        // The freqs of the query words are kept from the BM25 candidates
+        auto sorted_infos = make_shared<ResultDocInfos>();
+        size_t n_terms = candidates->terms.size();
+        sorted_infos->terms = candidates->terms;
+        sorted_infos->count = rescored.size();
+        for (const auto &[i, score]: rescored) {
+            sorted_infos->doc_ids.push_back(candidates->doc_ids[i]);
+            sorted_infos->scores.push_back(score);
+            sorted_infos->freqs.insert(sorted_infos->freqs.end(), candidates->freqs.begin() + i * n_terms,
+                                       candidates->freqs.begin() + (i + 1) * n_terms);
+        }
+
+        // Cache result
+        result_cache.put(key, sorted_infos);
         return sorted_infos;
     }
 };
@@ -857,43 +4574,161 @@ void clean_up(int signal) {
     if (svr.is_running()) {
         svr.stop();
     }
-    if (ids_fp != nullptr) {
-        fclose(ids_fp);
+    if (ids_fd >= 0) {
+        close(ids_fd);
     }
-    if (freqs_fp != nullptr) {
-        fclose(freqs_fp);
+    if (freqs_fd >= 0) {
+        close(freqs_fd);
     }
-    if (dataset_fp != nullptr) {
-        fclose(dataset_fp);
+    if (offsets_fd >= 0) {
+        close(offsets_fd);
     }
-    if (doc_content != nullptr) {
-        free(doc_content);
+    if (positions_fd >= 0) {
+        close(positions_fd);
     }
-    if (tokenize_buffer != nullptr) {
-        free(tokenize_buffer);
+    if (dataset_fd >= 0) {
+        close(dataset_fd);
     }
     if (home_page_buffer != nullptr) {
         free(home_page_buffer);
     }
     delete searcher;
+    if (resident_arena != nullptr) {
+#ifdef __linux__
+        munmap(resident_arena, resident_arena_size);
+#else
+        free(resident_arena);
+#endif
+    }
     exit(EXIT_SUCCESS);
 }
 
+// Run the queries from stdin once on this thread to get the expected results, then on n threads at once,
+// first with cold caches and then with warm ones, and check that every result matches the expected one.
+// The latency percentiles of each run compare the ways of reading the index, e.g. --resident and --io.
+void stress_test(Searcher &searcher, ShardedCache<Entry> &entry_cache, const Options &options) {
+    vector<string> queries;
+    string query;
+    while (getline(cin, query)) {
+        queries.push_back(query);
+    }
+    if (queries.empty()) {
+        cerr << "No queries for the stress test" << endl;
+        exit(EXIT_FAILURE);
+    }
+    auto strip = [](json result) {  // drop the fields that depend on timing and caching
+        result.erase("time");
+        result.erase("cached");
+        result.erase("complete");  // impact queries only report these when not cached
+        result.erase("postings");
+        return result;
+    };
+    vector<json> expected;
+    for (const auto &q: queries) {
+        expected.push_back(strip(searcher.search(q, options)));
+    }
+    for (const char *caches: {"cold", "warm"}) {
+        if (strcmp(caches, "cold") == 0) {
+            searcher.clear_caches();
+        }
+        std::atomic<size_t> mismatches = 0;
+        vector<vector<double>> latencies(options.stress_threads);  // in microseconds, per thread
+        vector<std::thread> threads;
+        auto start = std::chrono::steady_clock::now();
+        for (int t = 0; t < options.stress_threads; t++) {
+            threads.emplace_back([&, t]() {
+                // every thread runs all queries, each from a different starting point
+                size_t offset = queries.size() * t / options.stress_threads;
+                for (size_t i = 0; i < queries.size(); i++) {
+                    size_t j = (offset + i) % queries.size();
+                    // the whole search, as the time in the result does not include the reads of the snippets
+                    auto query_start = std::chrono::steady_clock::now();
+                    json result = searcher.search(queries[j], options);
+                    latencies[t].push_back(std::chrono::duration<double, std::micro>(
+                            std::chrono::steady_clock::now() - query_start).count());
+                    if (strip(std::move(result)) != expected[j]) {
+                        mismatches++;
+                    }
+                }
+            });
+        }
+        for (auto &thread: threads) {
+            thread.join();
+        }
+        auto stop = std::chrono::steady_clock::now();
+        auto n_queries = (double) queries.size() * options.stress_threads;
+        printf("%s caches: %.0f queries on %d threads in %.2f milliseconds, %.1f queries per second, %zu mismatches\n",
+               caches, n_queries, options.stress_threads,
+               std::chrono::duration<double, std::milli>(stop - start).count(),
+               n_queries / std::chrono::duration<double>(stop - start).count(), mismatches.load());
+        vector<double> all_latencies;
+        for (const auto &thread_latencies: latencies) {
+            all_latencies.insert(all_latencies.end(), thread_latencies.begin(), thread_latencies.end());
+        }
+        sort(all_latencies.begin(), all_latencies.end());
+        auto percentile = [&all_latencies](double p) {
+            return all_latencies[min((size_t) (p / 100 * all_latencies.size()), all_latencies.size() - 1)];
+        };
+        printf("%s caches latency: p50 %.2f, p90 %.2f, p99 %.2f, max %.2f microseconds\n",
+               caches, percentile(50), percentile(90), percentile(99), all_latencies.back());
+        if (mismatches > 0) {
+            exit(EXIT_FAILURE);
+        }
+    }
+    json stats = searcher.cache_stats();
+    stats["entries"] = entry_cache.stats();
+    printf("cache stats: %s\n", stats.dump().c_str());
+}
+
 int main(int argc, char *argv[]) {
     signal(SIGINT, clean_up);
     Options options = parse_args(argc, argv);
     read_storage_info(options.storage_path);
+    if (options.offsets_path != nullptr) {
+        read_column_storage_info(options.offsets_storage_path, &StorageInfo::offsets_begin);
+        offsets_fd = open_guarded(options.offsets_path);
+    }
+    if (options.positions_path != nullptr) {
+        read_column_storage_info(options.positions_storage_path, &StorageInfo::positions_begin);
+        positions_fd = open_guarded(options.positions_path);
+    }
+    set_storage_ends(options);
     read_docs_info(options);
-    ids_fp = fopen_guarded(options.index_ids_path, "rb");
-    freqs_fp = fopen_guarded(options.index_freqs_path, "rb");
-    dataset_fp = fopen_guarded(options.dataset_path, "r");
-    doc_content = (char *) malloc(buf_size + 1);
-    tokenize_buffer = (char *) malloc(buf_size + 1);
+    if (options.impact_index_path != nullptr) {
+        read_impact_header(options);
+    }
+    init_doc_norms(options);
+    ids_fd = open_guarded(options.index_ids_path);
+    freqs_fd = open_guarded(options.index_freqs_path);
+    dataset_fd = open_guarded(options.dataset_path);
+    if (options.resident) {
+        load_resident(options);
+    }
+    init_io(options);
+    // The positions read by phrase queries, and the entries of the impact-ordered index, are cached out of the same
+    // budget as the entries, by all searchers
+    size_t cache_bytes = (size_t) options.cache_size << 20;
+    size_t position_cache_bytes = positions_fd >= 0 ? cache_bytes / 4 : 0;
+    size_t impact_cache_bytes = options.impact_index_path != nullptr ? cache_bytes / 4 : 0;
+    ShardedCache<Entry> entry_cache(cache_bytes - position_cache_bytes - impact_cache_bytes, options.cache_policy);
+    ShardedCache<PositionList> position_cache(position_cache_bytes);
 
     if (options.server_port >= 0 && options.server_port <= 65535) {
-        ConjunctiveSearcher conjunctive_searcher(options.cache_size);
-        DisjunctiveSearcher disjunctive_searcher(options.cache_size);
-        TransformerSearcher transformer_searcher(options);
+        ConjunctiveSearcher conjunctive_searcher(entry_cache, position_cache, options);
+        DisjunctiveSearcher disjunctive_searcher(entry_cache, position_cache, options);
+        TransformerSearcher transformer_searcher(entry_cache, options);
+        unique_ptr<ImpactSearcher> impact_searcher;
+        if (options.impact_index_path != nullptr) {
+            impact_searcher = make_unique<ImpactSearcher>(entry_cache, impact_cache_bytes, options);
+        }
+        HybridSearcher hybrid_searcher(entry_cache, options, disjunctive_searcher, transformer_searcher);
+        unique_ptr<CascadeSearcher> cascade_searcher;
+        if (options.cascade > 0) {
+            BM25Searcher &candidate_searcher = options.cascade_from == QueryType::CONJUNCTIVE
+                                               ? (BM25Searcher &) conjunctive_searcher : disjunctive_searcher;
+            cascade_searcher = make_unique<CascadeSearcher>(entry_cache, options, candidate_searcher,
+                                                            transformer_searcher);
+        }
 
         FILE *fp = fopen_guarded("index.html", "rb");
         fseek(fp, 0, SEEK_END);
@@ -906,7 +4741,24 @@ int main(int argc, char *argv[]) {
         svr.Get("/", [](const httplib::Request &req, httplib::Response &res) {
             res.set_content(home_page_buffer, "text/html");
         });
+        svr.Get("/stats", [&](const httplib::Request &, httplib::Response &res) {
+            json stats;
+            stats["entries"] = entry_cache.stats();
+            stats["conjunctive"] = conjunctive_searcher.cache_stats();
+            stats["disjunctive"] = disjunctive_searcher.cache_stats();
+            stats["transformer"] = transformer_searcher.cache_stats();
+            if (impact_searcher) {
+                stats["impact"] = impact_searcher->cache_stats();
+            }
+            stats["hybrid"] = hybrid_searcher.cache_stats();
+            if (cascade_searcher) {
+                stats["cascade"] = cascade_searcher->cache_stats();
+            }
+            res.set_content(stats.dump(), "application/json");
+        });
         svr.Post("/", [&](const httplib::Request &req, httplib::Response &res) {
+            // requests run concurrently on the server threads, so each one gets its own copy of the options
+            Options request_options = options;
             try {
                 json post = json::parse(req.body);
                 const string &query = post["query"].get<string>();
@@ -915,24 +4767,41 @@ int main(int argc, char *argv[]) {
                     report_error("Invalid value for snippet_len", res);
                     return;
                 }
-                options.snippet_len = snippet_len;
+                request_options.snippet_len = snippet_len;
                 int n_results = post["n_results"].get<int>();
                 if (n_results <= 0) {
                     report_error("Invalid value for n_results", res);
                     return;
                 }
-                options.n_results = n_results;
-                options.query_type = (QueryType) post["query_type"].get<int>();
+                request_options.n_results = n_results;
+                request_options.query_type = (QueryType) post["query_type"].get<int>();
                 json result;
-                switch (options.query_type) {
+                switch (request_options.query_type) {
                     case QueryType::CONJUNCTIVE:
-                        result = conjunctive_searcher.search(query, options);
+                        result = conjunctive_searcher.search(query, request_options);
                         break;
                     case QueryType::DISJUNCTIVE:
-                        result = disjunctive_searcher.search(query, options);
+                        result = disjunctive_searcher.search(query, request_options);
+                        break;
+                    case QueryType::IMPACT:
+                        if (!impact_searcher) {
+                            report_error("Impact-ordered index is not loaded", res);
+                            return;
+                        }
+                        result = impact_searcher->search(query, request_options);
+                        break;
+                    case QueryType::HYBRID:
+                        result = hybrid_searcher.search(query, request_options);
+                        break;
+                    case QueryType::CASCADE:
+                        if (!cascade_searcher) {
+                            report_error("Cascade queries are not enabled", res);
+                            return;
+                        }
+                        result = cascade_searcher->search(query, request_options);
                         break;
                     default:
-                        result = transformer_searcher.search(query, options);
+                        result = transformer_searcher.search(query, request_options);
                         break;
                 }
                 string json_str = result.dump(/*-1, ' ', false, json::error_handler_t::ignore*/);
@@ -946,15 +4815,38 @@ int main(int argc, char *argv[]) {
     } else {
         switch (options.query_type) {
             case QueryType::CONJUNCTIVE:
-                searcher = new ConjunctiveSearcher(options.cache_size);
+                searcher = new ConjunctiveSearcher(entry_cache, position_cache, options);
                 break;
             case QueryType::DISJUNCTIVE:
-                searcher = new DisjunctiveSearcher(options.cache_size);
+                searcher = new DisjunctiveSearcher(entry_cache, position_cache, options);
+                break;
+            case QueryType::IMPACT:
+                if (options.impact_index_path == nullptr) {
+                    cerr << "Impact queries need the impact-ordered index, see --impact-index" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                searcher = new ImpactSearcher(entry_cache, impact_cache_bytes, options);
+                break;
+            case QueryType::HYBRID:
+                searcher = new HybridSearcher(entry_cache, position_cache, options);
+                break;
+            case QueryType::CASCADE:
+                if (options.cascade == 0) {
+                    cerr << "Cascade queries need the number of BM25 candidates, see --cascade" << endl;
+                    exit(EXIT_FAILURE);
+                }
+                searcher = new CascadeSearcher(entry_cache, position_cache, options);
                 break;
             default:
-                searcher = new TransformerSearcher(options);
+                searcher = new TransformerSearcher(entry_cache, options);
                 break;
         }
+        if (options.stress_threads > 0) {
+            stress_test(*searcher, entry_cache, options);
+            clean_up(SIGINT);
+        }
+        // transformer does not know the total number of matched docs, and cascade only ranks the BM25 candidates
+        bool has_count = options.query_type < QueryType::SEMANTIC || options.query_type == QueryType::IMPACT;
         printf("query> ");
         string query;
         while (getline(cin, query)) {
@@ -964,7 +4856,7 @@ int main(int argc, char *argv[]) {
                        result["time"].get<double>());
             } else {
                 if (result["cached"]) {
-                    if (options.query_type >= QueryType::SEMANTIC) {
+                    if (!has_count) {
                         printf("\nFound the following results from cache in %.2f microseconds.\n\n\n",
                                result["time"].get<double>());
                     } else {
@@ -972,7 +4864,7 @@ int main(int argc, char *argv[]) {
                                result["count"].get<long long>(), result["time"].get<double>());
                     }
                 } else {
-                    if (options.query_type >= QueryType::SEMANTIC) {
+                    if (!has_count) {
                         printf("\nFound the following results in %.2f milliseconds.\n\n\n",
                                result["time"].get<double>() / 1000.);
                     } else {
@@ -982,7 +4874,7 @@ int main(int argc, char *argv[]) {
                 }
                 for (const auto &item: result["data"]) {
                     printf("%d. [%.2f] ", item["rank"].get<int>(), item["score"].get<double>());
-                    if (options.query_type < QueryType::SEMANTIC) {  // transformer does not have freqs
+                    if (item.contains("freqs")) {  // transformer and impact-ordered index do not have freqs
                         for (const auto &freq: item["freqs"]) {
                             printf("%s(%d) ", freq[0].get<string>().c_str(), freq[1].get<int>());
                         }
@@ -7,6 +7,7 @@
 #include <unordered_map>
 #include <queue>
 #include <algorithm>
+#include <cmath>
 
 using std::cout;
 using std::cerr;
@@ -32,6 +33,8 @@ namespace fs = std::filesystem;
 struct Entry {
     string term;
     vector<unsigned> doc_ids, freqs;
+    vector<unsigned> offsets;  // byte offsets of first occurrences, parallel to freqs, empty unless -f true
+    vector<unsigned> positions;  // freqs[i] delta-encoded word positions for the i-th doc, empty unless -r true
 
     bool operator<(const Entry &rhs) const {
         return term < rhs.term || (term == rhs.term && doc_ids < rhs.doc_ids);
@@ -48,13 +51,16 @@ struct StorageInfo {
     const string *term = nullptr;
     size_t ids_begin = 0, scores_begin = 0;
     unsigned doc_cnt = 0;
+    size_t offsets_begin = 0, positions_begin = 0;
 };
 
 vector<StorageInfo> storage_info;
 
-Index read_index_txt(ifstream &id_file, ifstream &freq_file, int n_entries) {
+// offset_file and position_file are null if offsets and positions are not merged
+Index read_index_txt(ifstream &id_file, ifstream &freq_file, ifstream *offset_file, ifstream *position_file,
+                     int n_entries) {
     Index index;
-    string id_line, freq_line;
+    string id_line, freq_line, offset_line, position_line;
     string term;
     for (int i = 0; i < n_entries && getline(id_file, id_line) && getline(freq_file, freq_line); i++) {
         istringstream id_iss(id_line), freq_iss(freq_line);
@@ -65,14 +71,30 @@ Index read_index_txt(ifstream &id_file, ifstream &freq_file, int n_entries) {
             entry.doc_ids.push_back(doc_id);
             entry.freqs.push_back(freq);
         }
+        if (offset_file != nullptr && getline(*offset_file, offset_line)) {
+            istringstream offset_iss(offset_line);
+            unsigned offset;
+            while (offset_iss >> offset) {
+                entry.offsets.push_back(offset);
+            }
+        }
+        if (position_file != nullptr && getline(*position_file, position_line)) {
+            istringstream position_iss(position_line);
+            unsigned position;
+            while (position_iss >> position) {
+                entry.positions.push_back(position);
+            }
+        }
     }
     return index;
 }
 
-Index read_index_bin(ifstream &id_file, ifstream &freq_file, int n_entries) {
+Index read_index_bin(ifstream &id_file, ifstream &freq_file, ifstream *offset_file, ifstream *position_file,
+                     int n_entries) {
     Index index;
     string term;
     for (int i = 0; i < n_entries; i++) {
+        term.clear();  // >> leaves term unchanged at EOF
         id_file >> term;
         if (term.empty()) {
             break;
@@ -88,6 +110,18 @@ Index read_index_bin(ifstream &id_file, ifstream &freq_file, int n_entries) {
         Entry &entry = index.emplace_back(term, vector<unsigned>(ids_size), vector<unsigned>(freqs_size));
         id_file.read((char *) entry.doc_ids.data(), (long long) sizeof(unsigned) * ids_size);
         freq_file.read((char *) entry.freqs.data(), (long long) sizeof(unsigned) * freqs_size);
+        if (offset_file != nullptr) {
+            unsigned offsets_size;
+            offset_file->read((char *) &offsets_size, sizeof(unsigned));
+            entry.offsets.resize(offsets_size);
+            offset_file->read((char *) entry.offsets.data(), (long long) sizeof(unsigned) * offsets_size);
+        }
+        if (position_file != nullptr) {
+            unsigned positions_size;
+            position_file->read((char *) &positions_size, sizeof(unsigned));
+            entry.positions.resize(positions_size);
+            position_file->read((char *) entry.positions.data(), (long long) sizeof(unsigned) * positions_size);
+        }
     }
     return index;
 }
@@ -113,10 +147,12 @@ void read_uints_vbyte(ifstream &file, vector<unsigned> &uints, unsigned count) {
     }
 }
 
-Index read_index_vbyte(ifstream &id_file, ifstream &freq_file, int n_entries) {
+Index read_index_vbyte(ifstream &id_file, ifstream &freq_file, ifstream *offset_file, ifstream *position_file,
+                       int n_entries) {
     Index index;
     string term;
     for (int i = 0; i < n_entries; i++) {
+        term.clear();  // >> leaves term unchanged at EOF
         id_file >> term;
         if (term.empty()) {
             break;
@@ -132,15 +168,29 @@ Index read_index_vbyte(ifstream &id_file, ifstream &freq_file, int n_entries) {
         Entry &entry = index.emplace_back(term, vector<unsigned>(), vector<unsigned>());
         read_uints_vbyte(id_file, entry.doc_ids, ids_size);
         read_uints_vbyte(freq_file, entry.freqs, ids_size);
+        if (offset_file != nullptr) {
+            unsigned offsets_size;
+            offset_file->read((char *) &offsets_size, sizeof(unsigned));
+            read_uints_vbyte(*offset_file, entry.offsets, offsets_size);
+        }
+        if (position_file != nullptr) {
+            unsigned positions_size;
+            position_file->read((char *) &positions_size, sizeof(unsigned));
+            read_uints_vbyte(*position_file, entry.positions, positions_size);
+        }
     }
     return index;
 }
 
 struct Options;
 
-void dump_index_vbyte(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &options);
+void dump_index_vbyte(const Index &index, FILE *ids_fp, FILE *freqs_fp, FILE *offsets_fp, FILE *positions_fp,
+                      Options &options);
+
+void dump_index_bin(const Index &index, FILE *ids_fp, FILE *freqs_fp, FILE *offsets_fp, FILE *positions_fp,
+                    Options &options);
 
-void dump_index_bin(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &options);
+vector<unsigned> doc_lens;
 
 struct Options {
     const char *index_path = "index";
@@ -155,6 +205,15 @@ struct Options {
     bool store_diff = true;
     int input_index_chunk_size = 8192;
     int output_entry_size = 131072;
+    bool merge_offsets = false;  // first occurrence offsets written by create_index -f true
+    bool merge_positions = false;  // word positions written by create_index -r true
+    // impact-ordered index, BM25 parameters must be the same as main
+    bool build_impact = false;
+    const char *doc_info_path = "docs.txt";
+    int total_doc_cnt = 3213835;
+    double avg_doc_len = 1172.448644;
+    double k = 0.9, b = 0.4;
+    double impact_scale = 1;  // BM25 score of a quantized impact of 1
 };
 
 void log() {
@@ -166,7 +225,9 @@ void log() {
     start = end;
 }
 
-void dump_index_txt(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &options) {
+// offsets_fp and positions_fp are null if offsets and positions are not merged
+void dump_index_txt(const Index &index, FILE *ids_fp, FILE *freqs_fp, FILE *offsets_fp, FILE *positions_fp,
+                    Options &options) {
     log();
     for (auto &p: index) {
         fprintf(ids_fp, "%s", p.term.c_str());
@@ -174,6 +235,22 @@ void dump_index_txt(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &o
         // use pointer to avoid copy
         auto &info = storage_info.emplace_back(&p.term, ftell64(ids_fp), ftell64(freqs_fp),
                                                (unsigned) p.doc_ids.size());
+        if (offsets_fp != nullptr) {
+            fprintf(offsets_fp, "%s", p.term.c_str());
+            info.offsets_begin = ftell64(offsets_fp);
+            for (auto offset: p.offsets) {
+                fprintf(offsets_fp, " %u", offset);
+            }
+            fprintf(offsets_fp, "\n");
+        }
+        if (positions_fp != nullptr) {
+            fprintf(positions_fp, "%s", p.term.c_str());
+            info.positions_begin = ftell64(positions_fp);
+            for (auto position: p.positions) {
+                fprintf(positions_fp, " %u", position);
+            }
+            fprintf(positions_fp, "\n");
+        }
         unsigned last_doc_id = 0;
         for (unsigned i = 0; i < info.doc_cnt; i++) {
             unsigned doc_id = p.doc_ids[i];
@@ -190,12 +267,21 @@ void dump_index_txt(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &o
     }
 }
 
-void dump_index_bin(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &options) {
+void dump_index_bin(const Index &index, FILE *ids_fp, FILE *freqs_fp, FILE *offsets_fp, FILE *positions_fp,
+                    Options &options) {
     log();
     for (auto &p: index) {
         // use pointer to avoid copy
         auto &info = storage_info.emplace_back(&p.term, ftell64(ids_fp), ftell64(freqs_fp),
                                                (unsigned) p.doc_ids.size());
+        if (offsets_fp != nullptr) {
+            info.offsets_begin = ftell64(offsets_fp);
+            fwrite(p.offsets.data(), sizeof(unsigned), p.offsets.size(), offsets_fp);
+        }
+        if (positions_fp != nullptr) {
+            info.positions_begin = ftell64(positions_fp);
+            fwrite(p.positions.data(), sizeof(unsigned), p.positions.size(), positions_fp);
+        }
         unsigned last_doc_id = 0;
         for (auto &doc_id: p.doc_ids) {
             if (options.store_diff) {
@@ -210,12 +296,36 @@ void dump_index_bin(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &o
     }
 }
 
-void dump_index_vbyte(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options &options) {
+void write_vbyte(FILE *fp, unsigned value) {
+    unsigned char byte;
+    while (value >= 128) {
+        byte = value & 127;
+        fwrite(&byte, sizeof(unsigned char), 1, fp);
+        value >>= 7;
+    }
+    byte = value | 128;
+    fwrite(&byte, sizeof(unsigned char), 1, fp);
+}
+
+void dump_index_vbyte(const Index &index, FILE *ids_fp, FILE *freqs_fp, FILE *offsets_fp, FILE *positions_fp,
+                      Options &options) {
     log();
     for (auto &p: index) {
         // use pointer to avoid copy
-        storage_info.emplace_back(&p.term, ftell64(ids_fp), ftell64(freqs_fp),
-                                  (unsigned) p.doc_ids.size());
+        auto &info = storage_info.emplace_back(&p.term, ftell64(ids_fp), ftell64(freqs_fp),
+                                               (unsigned) p.doc_ids.size());
+        if (offsets_fp != nullptr) {
+            info.offsets_begin = ftell64(offsets_fp);
+            for (auto offset: p.offsets) {
+                write_vbyte(offsets_fp, offset);
+            }
+        }
+        if (positions_fp != nullptr) {
+            info.positions_begin = ftell64(positions_fp);
+            for (auto position: p.positions) {
+                write_vbyte(positions_fp, position);
+            }
+        }
         unsigned last_doc_id = 0;
         for (auto &doc_id: p.doc_ids) {
             unsigned value = doc_id;
@@ -246,9 +356,88 @@ void dump_index_vbyte(const Index &index, FILE *ids_fp, FILE *freqs_fp, Options
     }
 }
 
-void dump_storage_txt(FILE *fp) {
+double BM25(unsigned freq, unsigned doc_cnt, unsigned doc_len, Options &options) {
+    double K = options.k * ((1 - options.b) + options.b * doc_len / options.avg_doc_len);
+    return log((options.total_doc_cnt - doc_cnt + 0.5) / (doc_cnt + 0.5)) *
+           (freq * (options.k + 1)) / (freq + K);
+}
+
+void read_doc_lens(Options &options) {
+    printf("Reading docs info from %s...", options.doc_info_path);
+    fflush(stdout);
+    ifstream fin(options.doc_info_path);
+    if (!fin.is_open()) {
+        cerr << "Failed to open file " << options.doc_info_path << endl;
+        exit(EXIT_FAILURE);
+    }
+    string url;
+    unsigned term_cnt;
+    long long begin, end;
+    unsigned long long total_term_cnt = 0;
+    while (fin >> url >> term_cnt >> begin >> end) {
+        doc_lens.push_back(term_cnt);
+        total_term_cnt += term_cnt;
+    }
+    options.total_doc_cnt = (int) doc_lens.size();
+    options.avg_doc_len = (double) total_term_cnt / options.total_doc_cnt;
+    // the largest possible score is from a term in only one doc with an infinite freq
+    options.impact_scale = log((options.total_doc_cnt - 1 + 0.5) / (1 + 0.5)) * (options.k + 1) / 255;
+    fin.close();
+    printf("done\n");
+}
+
+// Impact-ordered layout: BM25 scores are quantized to 8 bits, and postings of each term are grouped into
+// segments of the same impact, from the highest to the lowest. A segment is the impact (1 byte),
+// the number of docs (vbyte), and the diff doc ids (vbyte). Postings with a score <= 0 are dropped.
+// The lexicon line is "term begin n_bytes doc_cnt", where doc_cnt is the number of postings kept.
+void dump_impact_index(const Index &index, FILE *impact_fp, FILE *impact_storage_fp, Options &options) {
+    vector<vector<unsigned>> segments(256);
+    for (auto &p: index) {
+        for (auto &segment: segments) {
+            segment.clear();
+        }
+        auto doc_cnt = (unsigned) p.doc_ids.size();
+        for (unsigned i = 0; i < doc_cnt; i++) {
+            double score = BM25(p.freqs[i], doc_cnt, doc_lens[p.doc_ids[i]], options);
+            if (score <= 0) {
+                continue;
+            }
+            auto impact = (unsigned) std::lround(score / options.impact_scale);
+            segments[std::clamp(impact, 1U, 255U)].push_back(p.doc_ids[i]);  // doc ids stay sorted
+        }
+        long long begin = ftell64(impact_fp);
+        unsigned kept_cnt = 0;
+        for (int impact = 255; impact >= 1; impact--) {
+            auto &segment = segments[impact];
+            if (segment.empty()) {
+                continue;
+            }
+            auto byte = (unsigned char) impact;
+            fwrite(&byte, sizeof(unsigned char), 1, impact_fp);
+            write_vbyte(impact_fp, (unsigned) segment.size());
+            unsigned last_doc_id = 0;
+            for (auto doc_id: segment) {
+                write_vbyte(impact_fp, doc_id - last_doc_id);
+                last_doc_id = doc_id;
+            }
+            kept_cnt += (unsigned) segment.size();
+        }
+        if (kept_cnt > 0) {
+            fprintf(impact_storage_fp, "%s %lld %lld %u\n", p.term.c_str(), begin, ftell64(impact_fp) - begin, kept_cnt);
+        }
+    }
+}
+
+// The offsets and positions lexicons are "term begin", written only if their files are not null
+void dump_storage_txt(FILE *fp, FILE *offsets_fp, FILE *positions_fp) {
     for (auto &info: storage_info) {
         fprintf(fp, "%s %zu %zu %u\n", info.term->c_str(), info.ids_begin, info.scores_begin, info.doc_cnt);
+        if (offsets_fp != nullptr) {
+            fprintf(offsets_fp, "%s %zu\n", info.term->c_str(), info.offsets_begin);
+        }
+        if (positions_fp != nullptr) {
+            fprintf(positions_fp, "%s %zu\n", info.term->c_str(), info.positions_begin);
+        }
     }
     storage_info.clear();
 }
@@ -256,7 +445,8 @@ void dump_storage_txt(FILE *fp) {
 void print_usage(char *program_name) {
     printf("Usage: %s [-h] [-i index_path] [-s storage_path] [-o merged_index_path]\n"
            "\t[-t input_index_type] [-m merged_index_type] [-d store_diff]\n"
-           "\t[-c input_index_chunk_size] [-e output_entry_size]\n"
+           "\t[-c input_index_chunk_size] [-e output_entry_size] [-a build_impact] [-p doc_info_file]\n"
+           "\t[-f merge_offsets] [-r merge_positions]\n"
            "Options:\n"
            "\t-i\tindex path, default: index\n"
            "\t-s\tstorage info (lexicon) path, default: .\n"
@@ -266,6 +456,10 @@ void print_usage(char *program_name) {
            "\t-d\tstore diff docIDs in the merged index (true|false), default: true\n"
            "\t-c\tinput index chunk size, default: 8192\n"
            "\t-e\toutput entry size, default: 131072\n"
+           "\t-a\talso build the impact-ordered index (true|false), default: false\n"
+           "\t-p\tdoc info (page table) file for the impact-ordered index, default: docs.txt\n"
+           "\t-f\talso merge the first occurrence offsets written by create_index -f true (true|false), default: false\n"
+           "\t-r\talso merge the word positions written by create_index -r true (true|false), default: false\n"
            "\t-h\thelp", program_name);
 }
 
@@ -282,6 +476,7 @@ Options parse_args(int argc, char *argv[]) {
             if (strcmp(option, "-i") == 0) options.index_path = value;
             else if (strcmp(option, "-s") == 0) options.storage_path = value;
             else if (strcmp(option, "-o") == 0) options.merged_index_path = value;
+            else if (strcmp(option, "-p") == 0) options.doc_info_path = value;
             else if (strcmp(option, "-t") == 0) {
                 if (strcmp(value, "txt") == 0) {
                     options.input_index_type = value;
@@ -322,6 +517,36 @@ Options parse_args(int argc, char *argv[]) {
                     print_usage(argv[0]);
                     exit(EXIT_FAILURE);
                 }
+            } else if (strcmp(option, "-a") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.build_impact = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.build_impact = false;
+                } else {
+                    cerr << "Invalid build impact: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-f") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.merge_offsets = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.merge_offsets = false;
+                } else {
+                    cerr << "Invalid merge offsets: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-r") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.merge_positions = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.merge_positions = false;
+                } else {
+                    cerr << "Invalid merge positions: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
             } else if (strcmp(option, "-c") == 0) {
                 options.input_index_chunk_size = atoi(value);
                 if (options.input_index_chunk_size <= 0) {
@@ -355,7 +580,7 @@ int main(int argc, char *argv[]) {
 
     Options options = parse_args(argc, argv);
 
-    vector<string> id_filenames, freq_filenames;
+    vector<string> id_filenames, freq_filenames, offset_filenames, position_filenames;
     if (!fs::exists(options.index_path) || !fs::is_directory(options.index_path)) {
         perror("Failed to open index directory");
         exit(EXIT_FAILURE);
@@ -364,6 +589,10 @@ int main(int argc, char *argv[]) {
         string path = entry.path().string();
         if (path.ends_with("freqs." + options.input_index_type)) {
             freq_filenames.push_back(path);
+        } else if (path.ends_with("offsets." + options.input_index_type)) {
+            offset_filenames.push_back(path);
+        } else if (path.ends_with("positions." + options.input_index_type)) {
+            position_filenames.push_back(path);
         } else if (path.ends_with(options.input_index_type)) {
             id_filenames.push_back(path);
         }
@@ -376,7 +605,20 @@ int main(int argc, char *argv[]) {
         perror("The number of index files is not equal");
         exit(EXIT_FAILURE);
     }
-    vector<ifstream> id_files, freq_files;
+    if (options.merge_offsets && offset_filenames.size() != id_filenames.size()) {
+        cerr << "Offsets files are missing, run create_index with -f true" << endl;
+        exit(EXIT_FAILURE);
+    }
+    if (options.merge_positions && position_filenames.size() != id_filenames.size()) {
+        cerr << "Positions files are missing, run create_index with -r true" << endl;
+        exit(EXIT_FAILURE);
+    }
+    // directory order is unspecified, and the i-th files of each kind must be the same chunk
+    sort(id_filenames.begin(), id_filenames.end());
+    sort(freq_filenames.begin(), freq_filenames.end());
+    sort(offset_filenames.begin(), offset_filenames.end());
+    sort(position_filenames.begin(), position_filenames.end());
+    vector<ifstream> id_files, freq_files, offset_files, position_files;
     for (const auto &id_file: id_filenames) {
         id_files.emplace_back(id_file, std::ios::binary);
         if (!id_files.back().is_open()) {
@@ -391,9 +633,34 @@ int main(int argc, char *argv[]) {
             exit(EXIT_FAILURE);
         }
     }
+    if (options.merge_offsets) {
+        for (const auto &offset_file: offset_filenames) {
+            offset_files.emplace_back(offset_file, std::ios::binary);
+            if (!offset_files.back().is_open()) {
+                perror(("Failed to open index offset_file " + offset_file).c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    if (options.merge_positions) {
+        for (const auto &position_file: position_filenames) {
+            position_files.emplace_back(position_file, std::ios::binary);
+            if (!position_files.back().is_open()) {
+                perror(("Failed to open index position_file " + position_file).c_str());
+                exit(EXIT_FAILURE);
+            }
+        }
+    }
+    auto offset_file = [&](int i) {
+        return options.merge_offsets ? &offset_files[i] : nullptr;
+    };
+    auto position_file = [&](int i) {
+        return options.merge_positions ? &position_files[i] : nullptr;
+    };
     vector<Index> indices;
     for (int i = 0; i < id_files.size(); i++) {
-        indices.emplace_back(options.read_index(id_files[i], freq_files[i], options.input_index_chunk_size));
+        indices.emplace_back(options.read_index(id_files[i], freq_files[i], offset_file(i), position_file(i),
+                                                options.input_index_chunk_size));
     }
     auto cmp = [](const pair<Entry, int> &a, const pair<Entry, int> &b) {
         return a.first > b.first;
@@ -434,6 +701,50 @@ int main(int argc, char *argv[]) {
         perror("Failed to open storage file");
         exit(EXIT_FAILURE);
     }
+    FILE *offsets_fp = nullptr, *offsets_storage_fp = nullptr;
+    if (options.merge_offsets) {
+        offsets_fp = fopen((options.merged_index_path + "/offsets." + options.merged_index_type).c_str(), "wb");
+        if (offsets_fp == nullptr) {
+            perror("Failed to open offsets file");
+            exit(EXIT_FAILURE);
+        }
+        offsets_storage_fp = fopen((options.storage_path + "/storage_offsets_" + options.merged_index_type + ".txt").c_str(), "w");
+        if (offsets_storage_fp == nullptr) {
+            perror("Failed to open offsets storage file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    FILE *positions_fp = nullptr, *positions_storage_fp = nullptr;
+    if (options.merge_positions) {
+        positions_fp = fopen((options.merged_index_path + "/positions." + options.merged_index_type).c_str(), "wb");
+        if (positions_fp == nullptr) {
+            perror("Failed to open positions file");
+            exit(EXIT_FAILURE);
+        }
+        positions_storage_fp = fopen((options.storage_path + "/storage_positions_" + options.merged_index_type + ".txt").c_str(), "w");
+        if (positions_storage_fp == nullptr) {
+            perror("Failed to open positions storage file");
+            exit(EXIT_FAILURE);
+        }
+    }
+    FILE *impact_fp = nullptr, *impact_storage_fp = nullptr;
+    if (options.build_impact) {
+        read_doc_lens(options);
+        impact_fp = fopen((options.merged_index_path + "/impact.vbyte").c_str(), "wb");
+        if (impact_fp == nullptr) {
+            perror("Failed to open impact index file");
+            exit(EXIT_FAILURE);
+        }
+        // header: the BM25 score of an impact of 1, then the normalization main checks its BM25 queries against
+        double header[] = {options.impact_scale, (double) options.total_doc_cnt, options.avg_doc_len, options.k,
+                           options.b};
+        fwrite(header, sizeof(double), sizeof(header) / sizeof(double), impact_fp);
+        impact_storage_fp = fopen((options.storage_path + "/storage_impact.txt").c_str(), "w");
+        if (impact_storage_fp == nullptr) {
+            perror("Failed to open impact storage file");
+            exit(EXIT_FAILURE);
+        }
+    }
     while (!pq.empty()) {
         auto [min_entry, min_index] = pq.top();  // TODO: min_entry is a copy. Is using a pointer better?
         pq.pop();
@@ -444,12 +755,21 @@ int main(int argc, char *argv[]) {
             merged_index.back().freqs.insert(merged_index.back().freqs.end(),
                                              min_entry.freqs.begin(),
                                              min_entry.freqs.end());
+            merged_index.back().offsets.insert(merged_index.back().offsets.end(),
+                                               min_entry.offsets.begin(),
+                                               min_entry.offsets.end());
+            merged_index.back().positions.insert(merged_index.back().positions.end(),
+                                                 min_entry.positions.begin(),
+                                                 min_entry.positions.end());
         } else {
             if (merged_index.size() > options.output_entry_size) {  // prevent potential duplicate
                 auto last = merged_index.back();  // TODO: It is a copy. Is using a pointer better?
                 merged_index.pop_back();
-                options.dump_index(merged_index, merged_index_fp, scores_fp, options);
-                dump_storage_txt(storage_fp);  // must be called before merged_index.clear()
+                options.dump_index(merged_index, merged_index_fp, scores_fp, offsets_fp, positions_fp, options);
+                dump_storage_txt(storage_fp, offsets_storage_fp, positions_storage_fp);  // must be called before merged_index.clear()
+                if (options.build_impact) {
+                    dump_impact_index(merged_index, impact_fp, impact_storage_fp, options);
+                }
                 merged_index.clear();
                 merged_index.push_back(last);  // TODO: It is a copy. Is using a pointer better?
             }
@@ -463,7 +783,8 @@ int main(int argc, char *argv[]) {
         }
         // case 2: chunk finished, has new chunk
         if (indices_pos[i] >= indices[i].size()) {
-            indices[i] = options.read_index(id_files[i], freq_files[i], options.input_index_chunk_size);
+            indices[i] = options.read_index(id_files[i], freq_files[i], offset_file(i), position_file(i),
+                                            options.input_index_chunk_size);
             indices_pos[i] = 0;
         }
         // case 3: chunk not finished
@@ -475,8 +796,21 @@ int main(int argc, char *argv[]) {
         // nothing to do
     }
 
-    dump_storage_txt(storage_fp);  // must be called before merged_index.clear()
-    options.dump_index(merged_index, merged_index_fp, scores_fp, options);
+    options.dump_index(merged_index, merged_index_fp, scores_fp, offsets_fp, positions_fp, options);
+    dump_storage_txt(storage_fp, offsets_storage_fp, positions_storage_fp);  // must be called after dump_index, which fills storage_info
+    if (options.merge_offsets) {
+        fclose(offsets_fp);
+        fclose(offsets_storage_fp);
+    }
+    if (options.merge_positions) {
+        fclose(positions_fp);
+        fclose(positions_storage_fp);
+    }
+    if (options.build_impact) {
+        dump_impact_index(merged_index, impact_fp, impact_storage_fp, options);
+        fclose(impact_fp);
+        fclose(impact_storage_fp);
+    }
 
     for (auto &file_stream: id_files) {
         file_stream.close();
@@ -0,0 +1,92 @@
+import os
+import socket
+import struct
+import sys
+
+import learning_to_rank
+
+# Runs the functions of learning_to_rank.py for main in a separate process, started by main with --workers, so that
+# the models do not share one GIL with the server and a crash of Python only takes down this worker.
+#
+# python model_worker.py socket_path
+#     listens on the Unix-domain socket, serves the one connection of main until it is closed, then exits
+#
+# Every request is a header of three uint32 (operation, number of texts, number of results), the texts as uint32
+# lengths followed by UTF-8 bytes, and the results as (uint32 corpus id, float32 score) pairs. Every response is a
+# header of three uint32 (status, number of results, number of floats), the results, then the floats.
+
+SEMANTIC_SEARCH = 1  # texts: query; response: results
+ENCODE_QUERY = 2  # texts: query; response: floats of the embedding
+RERANK = 3  # texts: query, then one doc per result; response: the results with their cross-encoder scores
+
+OK = 0
+FAILED = 1
+
+
+def recv_exact(conn: socket.socket, size: int) -> bytes:
+    buf = bytearray()
+    while len(buf) < size:
+        chunk = conn.recv(size - len(buf))
+        if not chunk:
+            raise EOFError
+        buf += chunk
+    return bytes(buf)
+
+
+def pack_results(ids, scores) -> bytes:
+    return b''.join(struct.pack('<If', int(corpus_id), float(score)) for corpus_id, score in zip(ids, scores))
+
+
+def handle(op: int, texts: list, ids: tuple) -> tuple:
+    # Returns the number of results, their bytes, and the bytes of the floats
+    if op == SEMANTIC_SEARCH:
+        ids, scores = learning_to_rank.semantic_search(texts[0])
+        return len(ids), pack_results(ids, scores), b''
+    if op == ENCODE_QUERY:
+        return 0, b'', memoryview(learning_to_rank.encode_query(texts[0])).cast('B').tobytes()
+    if op == RERANK:
+        scores = learning_to_rank.rerank([[texts[0], doc] for doc in texts[1:]])
+        return len(ids), pack_results(ids, scores), b''
+    raise ValueError('unknown operation %d' % op)
+
+
+def serve(conn: socket.socket):
+    while True:
+        try:
+            op, n_texts, n_results = struct.unpack('<III', recv_exact(conn, 12))
+        except EOFError:
+            return
+        texts = []
+        for _ in range(n_texts):
+            size, = struct.unpack('<I', recv_exact(conn, 4))
+            texts.append(recv_exact(conn, size).decode('utf-8', errors='replace'))
+        pairs = struct.unpack('<' + 'If' * n_results, recv_exact(conn, 8 * n_results))
+        try:
+            n_results, results, floats = handle(op, texts, pairs[0::2])
+        except Exception as e:
+            print('Model worker failed:', repr(e), file=sys.stderr)
+            conn.sendall(struct.pack('<III', FAILED, 0, 0))
+            continue
+        conn.sendall(struct.pack('<III', OK, n_results, len(floats) // 4) + results + floats)
+
+
+def accept(server: socket.socket) -> socket.socket:
+    # Give up if main exits before connecting, as the worker would otherwise outlive it
+    parent = os.getppid()
+    server.settimeout(1)
+    while True:
+        try:
+            conn, _ = server.accept()
+            conn.settimeout(None)
+            return conn
+        except socket.timeout:
+            if os.getppid() != parent:
+                sys.exit(1)
+
+
+if __name__ == '__main__':
+    with socket.socket(socket.AF_UNIX, socket.SOCK_STREAM) as server:
+        server.bind(sys.argv[1])
+        server.listen(1)
+        with accept(server) as conn:
+            serve(conn)
@@ -0,0 +1,331 @@
+#define _CRT_SECURE_NO_WARNINGS
+#include <iostream>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <random>
+#include <cmath>
+#include <chrono>
+#include <fcntl.h>
+#ifdef _MSC_VER
+#include <io.h>
+#else
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+using std::cout;
+using std::cerr;
+using std::endl;
+using std::string;
+using std::vector;
+using std::min;
+using std::max;
+
+#ifdef _MSC_VER
+#define O_BINARY_FLAG _O_BINARY
+#else
+#define O_BINARY_FLAG 0
+#endif
+
+// Embeddings exported by export_embeddings.py: two unsigned (n, dim), then n rows of dim floats of unit length
+struct Embeddings {
+    unsigned n = 0, dim = 0;
+    const float *data = nullptr;
+
+    const float *row(unsigned i) const {
+        return data + (size_t) i * dim;
+    }
+};
+
+enum class FlatType : unsigned {
+    INT8, FP16
+};
+
+// The flat store, mapped to memory by main as it is, in the order of the corpus ids (which is the order of the
+// doc ids). After the header, each section begins on a cache line: a float scale per vector, the vectors (dim
+// int8 or fp16 each, a component is its value times the scale of its vector), and the sign sketch if any
+// (dim / 64 words per vector, a bit is set if the component is negative).
+struct FlatHeader {
+    char magic[8];
+    unsigned n, dim;
+    FlatType type;
+    unsigned has_sketch;
+    unsigned long long scales_begin, vectors_begin, sketch_begin, size;
+};
+
+constexpr char FLAT_MAGIC[8] = "FLAT v1";
+
+struct Options {
+    const char *embeddings_path = "corpus_embeddings.f32";
+    const char *output_path = nullptr;  // corpus_embeddings.int8 or corpus_embeddings.fp16
+    FlatType type = FlatType::INT8;
+    bool sketch = true;
+};
+
+void print_usage(char *program_name) {
+    printf("Usage: %s [-h] [-e embeddings_file] [-o flat_file] [-t type] [-k sketch]\n"
+           "Options:\n"
+           "\t-e\tcorpus embeddings file from export_embeddings.py, default: corpus_embeddings.f32\n"
+           "\t-o\tflat store file, default: corpus_embeddings.<type>\n"
+           "\t-t\ttype of the components (int8|fp16), default: int8\n"
+           "\t-k\talso write the 1-bit sign sketch of each vector (true|false), default: true\n"
+           "\t-h\thelp\n", program_name);
+}
+
+Options parse_args(int argc, char *argv[]) {
+    Options options;
+    for (int i = 1; i < argc; i += 2) {
+        char *option = argv[i];
+        if (strcmp(option, "-h") == 0) {
+            print_usage(argv[0]);
+            exit(EXIT_SUCCESS);
+        }
+        if (i + 1 < argc) {
+            char *value = argv[i + 1];
+            if (strcmp(option, "-e") == 0) options.embeddings_path = value;
+            else if (strcmp(option, "-o") == 0) options.output_path = value;
+            else if (strcmp(option, "-t") == 0) {
+                if (strcmp(value, "int8") == 0) {
+                    options.type = FlatType::INT8;
+                } else if (strcmp(value, "fp16") == 0) {
+                    options.type = FlatType::FP16;
+                } else {
+                    cerr << "Invalid value for option -t: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else if (strcmp(option, "-k") == 0) {
+                if (strcmp(value, "true") == 0) {
+                    options.sketch = true;
+                } else if (strcmp(value, "false") == 0) {
+                    options.sketch = false;
+                } else {
+                    cerr << "Invalid value for option -k: " << value << endl;
+                    print_usage(argv[0]);
+                    exit(EXIT_FAILURE);
+                }
+            } else {
+                cerr << "Unknown option: " << option << endl;
+                print_usage(argv[0]);
+                exit(EXIT_FAILURE);
+            }
+        } else {
+            cerr << "Missing value for option: " << argv[i] << endl;
+            print_usage(argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.output_path == nullptr) {
+        options.output_path = options.type == FlatType::INT8 ? "corpus_embeddings.int8" : "corpus_embeddings.fp16";
+    }
+    return options;
+}
+
+// Map a whole file to memory read-only, or read it into memory where mmap is not available
+const char *map_file(const char *path, size_t &size) {
+    int fd = open(path, O_RDONLY | O_BINARY_FLAG);
+    if (fd < 0) {
+        perror((string("Failed to open file ") + path).c_str());
+        exit(EXIT_FAILURE);
+    }
+#ifdef _MSC_VER
+    size = (size_t) _filelengthi64(fd);
+    auto data = (char *) malloc(max(size, (size_t) 1));
+    for (size_t pos = 0; pos < size;) {
+        int n = _read(fd, data + pos, (unsigned) min(size - pos, (size_t) 1 << 30));
+        if (n <= 0) {
+            perror((string("Failed to read file ") + path).c_str());
+            exit(EXIT_FAILURE);
+        }
+        pos += n;
+    }
+#else
+    struct stat st{};
+    fstat(fd, &st);
+    size = (size_t) st.st_size;
+    void *data = mmap(nullptr, max(size, (size_t) 1), PROT_READ, MAP_SHARED, fd, 0);
+    if (data == MAP_FAILED) {
+        perror((string("Failed to map file ") + path).c_str());
+        exit(EXIT_FAILURE);
+    }
+#endif
+    close(fd);
+    return (const char *) data;
+}
+
+Embeddings load_embeddings(const char *path) {
+    size_t size;
+    const char *data = map_file(path, size);
+    Embeddings embeddings;
+    if (size >= 2 * sizeof(unsigned)) {
+        memcpy(&embeddings.n, data, sizeof(unsigned));
+        memcpy(&embeddings.dim, data + sizeof(unsigned), sizeof(unsigned));
+    }
+    if (size < 2 * sizeof(unsigned) || size != 2 * sizeof(unsigned) + (size_t) embeddings.n * embeddings.dim * sizeof(float)) {
+        cerr << "Invalid embeddings file " << path << ", export it with export_embeddings.py" << endl;
+        exit(EXIT_FAILURE);
+    }
+    embeddings.data = (const float *) (data + 2 * sizeof(unsigned));
+    return embeddings;
+}
+
+// IEEE half precision, rounded to nearest even
+unsigned short float_to_half(float value) {
+    unsigned bits;
+    memcpy(&bits, &value, sizeof(bits));
+    unsigned sign = (bits >> 16) & 0x8000;
+    int exponent = (int) ((bits >> 23) & 0xff) - 127 + 15;
+    unsigned mantissa = bits & 0x7fffff;
+    if (exponent >= 31) {
+        return (unsigned short) (sign | 0x7c00);  // too large for a half, unit vectors never are
+    }
+    if (exponent <= 0) {  // subnormal half or zero
+        if (exponent < -10) {
+            return (unsigned short) sign;
+        }
+        mantissa |= 0x800000;
+        unsigned shift = 14 - exponent;
+        unsigned half = mantissa >> shift;
+        unsigned rest = mantissa & ((1u << shift) - 1);
+        unsigned halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) {
+            half++;
+        }
+        return (unsigned short) (sign | half);
+    }
+    unsigned half = sign | (exponent << 10) | (mantissa >> 13);
+    unsigned rest = mantissa & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) {
+        half++;  // may carry into the exponent, which is still the right rounding
+    }
+    return (unsigned short) half;
+}
+
+float half_to_float(unsigned short half) {
+    unsigned sign = (unsigned) (half & 0x8000) << 16;
+    unsigned exponent = (half >> 10) & 0x1f;
+    unsigned mantissa = half & 0x3ff;
+    float value;
+    if (exponent == 0) {
+        value = std::ldexp((float) mantissa, -24);
+    } else if (exponent == 31) {
+        value = mantissa ? NAN : INFINITY;
+    } else {
+        value = std::ldexp((float) (mantissa | 0x400), (int) exponent - 25);
+    }
+    unsigned bits;
+    memcpy(&bits, &value, sizeof(bits));
+    bits |= sign;
+    memcpy(&value, &bits, sizeof(bits));
+    return value;
+}
+
+int main(int argc, char *argv[]) {
+    auto start = std::chrono::steady_clock::now();
+
+    Options options = parse_args(argc, argv);
+    Embeddings embeddings = load_embeddings(options.embeddings_path);
+    printf("%u embeddings of %u dimensions\n", embeddings.n, embeddings.dim);
+    if (options.sketch && embeddings.dim % 64 != 0) {
+        cerr << "The sign sketch needs a dimension divisible by 64, use -k false" << endl;
+        exit(EXIT_FAILURE);
+    }
+    FILE *fp = fopen(options.output_path, "wb");
+    if (fp == nullptr) {
+        perror("Failed to open flat store file");
+        exit(EXIT_FAILURE);
+    }
+    auto aligned = [](unsigned long long pos) { return (pos + 63) / 64 * 64; };
+    size_t component_size = options.type == FlatType::INT8 ? 1 : 2;
+    size_t sketch_words = embeddings.dim / 64;
+    FlatHeader header{};
+    memcpy(header.magic, FLAT_MAGIC, sizeof(header.magic));
+    header.n = embeddings.n;
+    header.dim = embeddings.dim;
+    header.type = options.type;
+    header.has_sketch = options.sketch;
+    header.scales_begin = aligned(sizeof(FlatHeader));
+    header.vectors_begin = aligned(header.scales_begin + (unsigned long long) embeddings.n * sizeof(float));
+    header.sketch_begin = aligned(header.vectors_begin + (unsigned long long) embeddings.n * embeddings.dim * component_size);
+    header.size = options.sketch ? header.sketch_begin + embeddings.n * sketch_words * sizeof(unsigned long long)
+                                 : header.sketch_begin;
+
+    // The sections are written one after another, each in a pass over the embeddings
+    static const char zeros[64] = {};
+    unsigned long long pos = 0;
+    auto write = [&](const void *data, size_t size) {
+        if (fwrite(data, 1, size, fp) != size) {
+            perror("Failed to write flat store file");
+            exit(EXIT_FAILURE);
+        }
+        pos += size;
+    };
+    auto pad_to = [&](unsigned long long begin) {
+        write(zeros, begin - pos);
+    };
+    write(&header, sizeof(header));
+    pad_to(header.scales_begin);
+    vector<float> scales(embeddings.n);
+    for (unsigned i = 0; i < embeddings.n; i++) {
+        const float *row = embeddings.row(i);
+        float max_abs = 0;
+        for (unsigned d = 0; d < embeddings.dim; d++) {
+            max_abs = max(max_abs, std::fabs(row[d]));
+        }
+        // int8 components span [-127, 127], fp16 ones keep the range of unit vectors
+        scales[i] = options.type == FlatType::INT8 ? (max_abs > 0 ? max_abs / 127 : 1) : 1;
+    }
+    write(scales.data(), scales.size() * sizeof(float));
+    pad_to(header.vectors_begin);
+    double error_sum = 0, max_error = 0;
+    vector<signed char> int8_row(embeddings.dim);
+    vector<unsigned short> fp16_row(embeddings.dim);
+    for (unsigned i = 0; i < embeddings.n; i++) {
+        const float *row = embeddings.row(i);
+        double error = 0;  // squared distance between the vector and its quantized one
+        for (unsigned d = 0; d < embeddings.dim; d++) {
+            float restored;
+            if (options.type == FlatType::INT8) {
+                int8_row[d] = (signed char) std::lround(row[d] / scales[i]);
+                restored = int8_row[d] * scales[i];
+            } else {
+                fp16_row[d] = float_to_half(row[d]);
+                restored = half_to_float(fp16_row[d]);
+            }
+            error += (restored - row[d]) * (restored - row[d]);
+        }
+        error_sum += sqrt(error);
+        max_error = max(max_error, sqrt(error));
+        if (options.type == FlatType::INT8) {
+            write(int8_row.data(), embeddings.dim);
+        } else {
+            write(fp16_row.data(), embeddings.dim * sizeof(unsigned short));
+        }
+    }
+    if (options.sketch) {
+        pad_to(header.sketch_begin);
+        vector<unsigned long long> sketch(sketch_words);
+        for (unsigned i = 0; i < embeddings.n; i++) {
+            const float *row = embeddings.row(i);
+            std::fill(sketch.begin(), sketch.end(), 0);
+            for (unsigned d = 0; d < embeddings.dim; d++) {
+                if (row[d] < 0) {
+                    sketch[d / 64] |= 1ULL << (d % 64);
+                }
+            }
+            write(sketch.data(), sketch_words * sizeof(unsigned long long));
+        }
+    }
+    fclose(fp);
+
+    printf("quantization error (distance to the original unit vector): mean %.6f, max %.6f\n",
+           error_sum / max(embeddings.n, 1u), max_error);
+    printf("%.1f MiB instead of %.1f MiB\n", (double) header.size / (1 << 20),
+           (double) embeddings.n * embeddings.dim * sizeof(float) / (1 << 20));
+    auto end = std::chrono::steady_clock::now();
+    cout << "total time used " << std::chrono::duration_cast<std::chrono::seconds>(end - start).count() << "s" << endl;
+    return 0;
+}